@@ -150,15 +150,16 @@ static int decode_frame(char *rx_buffer, int rx_length, int header_size, char *n
 			start_bit = rx_buffer[2] & 0x80;
 			end_bit = rx_buffer[2] & 0x40;
 			nal_buffer[4] = (rx_buffer[0] & 0x81) | (rx_buffer[2] & 0x3F) << 1;
-			nal_buffer[5] = 1;
+			nal_buffer[5] = rx_buffer[1];
 
 			nal_code++;
 			rx_buffer++;
 			rx_length--;
 		}
 
-		rx_buffer++;
-		rx_length--;
+		// Skip FU indicator and FU header, NAL header is restored above
+		rx_buffer += 2;
+		rx_length -= 2;
 
 		if (start_bit) {
 			nal_buffer[0] = 0;
@@ -166,18 +167,17 @@ static int decode_frame(char *rx_buffer, int rx_length, int header_size, char *n
 			nal_buffer[2] = 0;
 			nal_buffer[3] = 1;
 
-			memcpy(nal_buffer + nal_code, rx_buffer, rx_length);
-			nal_size = rx_length + nal_code;
-		} else {
-			rx_buffer++;
-			rx_length--;
-
+			memcpy(nal_buffer + nal_code + 1, rx_buffer, rx_length);
+			nal_size = rx_length + nal_code + 1;
+		} else if (nal_size) {
 			memcpy(nal_buffer + nal_size, rx_buffer, rx_length);
 			nal_size += rx_length;
+		}
 
-			if (end_bit) {
-				return nal_size;
-			}
+		if (end_bit && nal_size) {
+			int size = nal_size;
+			nal_size = 0;
+			return size;
 		}
 	} else {
 		nal_buffer[0] = 0;
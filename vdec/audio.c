@@ -0,0 +1,364 @@
+#include "main.h"
+
+/*
+ * Audio playout.
+ *
+ * Audio packets carry their own SSRC and are taken out of the receive path
+ * before video reordering, FEC and outage detection see them. Frames wait
+ * in a small jitter buffer keyed by RTP sequence and leave for ADEC when
+ * their capture time plus the playout offset has passed. The offset is the
+ * smallest audio transit seen recently plus a jitter margin, raised up to
+ * video transit so sound matches picture, but never more than
+ * AUDIO_MAX_DEPTH above the audio floor. Audio and video timestamps both
+ * come from the encoder PTS, so their transits compare directly; should
+ * they ever disagree (clock wrap) the cap keeps audio at low latency.
+ * Lost frames are skipped after a frame length grace, AO queue is kept
+ * short by dropping frames when it backs up.
+ */
+
+#define AUDIO_SLOTS 32
+#define AUDIO_MAX_DEPTH 80      // Playout offset above fastest audio, ms
+#define AUDIO_WINDOW 2000000    // Transit minimum window, us
+#define AUDIO_AO_FRAMES 4       // AO buffer, frames
+#define AUDIO_AO_BUSY 2         // AO frames queued before dropping
+
+struct AudioSlot {
+  uint8_t valid;
+  uint16_t sequence;
+  int64_t capture;        // Capture time on encoder clock, us
+  uint32_t size;          // With frame header
+  uint8_t data[AUDIO_HISI_HEADER + AUDIO_MAX_FRAME];
+};
+
+static uint8_t audio_enabled = 0;
+static uint8_t audio_opened = 0;
+static uint8_t audio_started = 0;
+static AUDIO_DEV audio_device = 1;
+static int64_t audio_offset = 0;
+static ADEC_CHN audio_adec = 0;
+static AO_CHN audio_ao = 0;
+static uint8_t audio_payload = 0;
+static uint32_t audio_samples = 0;
+static int64_t audio_frame_time = 0;
+
+static struct AudioSlot audio_slots[AUDIO_SLOTS];
+static uint32_t audio_buffered = 0;
+static uint16_t audio_next = 0;
+static int64_t audio_next_capture = 0;
+
+// Timestamp extension to 64 bits
+static uint32_t audio_last_ts = 0;
+static int64_t audio_ts = 0;
+static uint8_t video_seen = 0;
+static uint32_t video_last_ts = 0;
+static int64_t video_ts = 0;
+
+// Transit statistics, us
+static int64_t audio_floor = 0;
+static int64_t audio_window_min = 0;
+static uint64_t audio_window_start = 0;
+static int64_t audio_last_transit = 0;
+static int64_t audio_jitter = 0;
+static int64_t video_transit = 0;
+static int64_t audio_target = 0;
+
+// Counters of current interval
+static struct AudioSummary audio_counters;
+
+static uint64_t audio_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t audio_extend(uint32_t timestamp, uint32_t* last, int64_t* extended) {
+  *extended += (int32_t)(timestamp - *last);
+  *last = timestamp;
+  return *extended;
+}
+
+static int audio_open(uint8_t payload, uint32_t samples) {
+  ADEC_ATTR_G711_S g711_attr;
+  ADEC_ATTR_ADPCM_S adpcm_attr;
+  memset(&g711_attr, 0x00, sizeof(g711_attr));
+  adpcm_attr.enADPCMType = ADPCM_TYPE_DVI4;
+
+  ADEC_CHN_ATTR_S adec_attr;
+  memset(&adec_attr, 0x00, sizeof(adec_attr));
+  adec_attr.enType = payload == AUDIO_PAYLOAD_PCMU ? PT_G711U :
+    payload == AUDIO_PAYLOAD_DVI4 ? PT_ADPCMA : PT_G711A;
+  adec_attr.u32BufSize = AUDIO_AO_FRAMES;
+  adec_attr.enMode = ADEC_MODE_PACK;
+  adec_attr.pValue = payload == AUDIO_PAYLOAD_DVI4 ? (HI_VOID*)&adpcm_attr :
+    (HI_VOID*)&g711_attr;
+
+  int ret = HI_MPI_ADEC_CreateChn(audio_adec, &adec_attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create ADEC channel = 0x%x\n", ret);
+    return ret;
+  }
+
+  // HDMI plays 48 kHz only, AO resamples decoded frames
+  AIO_ATTR_S aio_attr;
+  memset(&aio_attr, 0x00, sizeof(aio_attr));
+  aio_attr.enSamplerate = AUDIO_SAMPLE_RATE_48000;
+  aio_attr.enBitwidth = AUDIO_BIT_WIDTH_16;
+  aio_attr.enWorkmode = AIO_MODE_I2S_MASTER;
+  aio_attr.enSoundmode = AUDIO_SOUND_MODE_MONO;
+  aio_attr.u32EXFlag = 0;
+  aio_attr.u32FrmNum = AUDIO_AO_FRAMES;
+  aio_attr.u32PtNumPerFrm = samples * 48000 / AUDIO_SAMPLE_RATE;
+  aio_attr.u32ChnCnt = 1;
+  aio_attr.u32ClkChnCnt = 1;
+  aio_attr.u32ClkSel = 0;
+
+  ret = HI_MPI_AO_SetPubAttr(audio_device, &aio_attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set AO configuration = 0x%x\n", ret);
+    return ret;
+  }
+
+  ret = HI_MPI_AO_Enable(audio_device);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable AO device = 0x%x\n", ret);
+    return ret;
+  }
+
+  ret = HI_MPI_AO_EnableChn(audio_device, audio_ao);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable AO channel = 0x%x\n", ret);
+    return ret;
+  }
+
+  ret = HI_MPI_AO_EnableReSmp(audio_device, audio_ao, AUDIO_SAMPLE_RATE_8000);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable AO resampling = 0x%x\n", ret);
+    return ret;
+  }
+
+  MPP_CHN_S adec_src;
+  MPP_CHN_S ao_dst;
+
+  adec_src.enModId = HI_ID_ADEC;
+  adec_src.s32DevId = 0;
+  adec_src.s32ChnId = audio_adec;
+
+  ao_dst.enModId = HI_ID_AO;
+  ao_dst.s32DevId = audio_device;
+  ao_dst.s32ChnId = audio_ao;
+
+  ret = HI_MPI_SYS_Bind(&adec_src, &ao_dst);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to bind ADEC to AO = 0x%x\n", ret);
+    return ret;
+  }
+
+  printf("> Audio: payload type %d, %d samples per frame, AO device %d\n",
+    payload, samples, audio_device);
+  return HI_SUCCESS;
+}
+
+static void audio_reset(uint16_t sequence) {
+  for (uint32_t i = 0; i < AUDIO_SLOTS; i++) {
+    audio_slots[i].valid = 0;
+  }
+
+  audio_buffered = 0;
+  audio_next = sequence;
+  audio_next_capture = 0;
+  audio_started = 1;
+}
+
+void audio_init(AUDIO_DEV device, int32_t offset) {
+  audio_enabled = 1;
+  audio_device = device;
+  audio_offset = (int64_t)offset * 1000;
+}
+
+uint8_t audio_active() {
+  return audio_enabled;
+}
+
+uint8_t audio_is_packet(const uint8_t* datagram, uint32_t size) {
+  return size > 12 && (datagram[0] & 0xC0) == 0x80 &&
+    be32toh(*(uint32_t*)(datagram + 8)) == AUDIO_SSRC;
+}
+
+void audio_push(uint8_t* datagram, uint32_t size) {
+  // Fixed header only, encoder sends neither CSRC nor extensions
+  uint8_t payload = datagram[1] & 0x7F;
+  uint16_t sequence = be16toh(*(uint16_t*)(datagram + 2));
+  uint32_t timestamp = be32toh(*(uint32_t*)(datagram + 4));
+  uint8_t* data = datagram + 12;
+  uint32_t data_size = size - 12;
+  if (data_size > AUDIO_MAX_FRAME || (data_size & 1) ||
+      (payload == AUDIO_PAYLOAD_DVI4 && data_size <= 4)) {
+    return;
+  }
+
+  if (!audio_opened) {
+    audio_payload = payload;
+    audio_samples = payload == AUDIO_PAYLOAD_DVI4 ? (data_size - 4) * 2 : data_size;
+    audio_frame_time = (int64_t)audio_samples * 1000000 / AUDIO_SAMPLE_RATE;
+    if (audio_open(payload, audio_samples) != HI_SUCCESS) {
+      audio_enabled = 0;
+      return;
+    }
+
+    audio_opened = 1;
+    audio_last_ts = timestamp;
+    audio_ts = timestamp;
+  }
+
+  if (payload != audio_payload) {
+    return;
+  }
+
+  // Transit on encoder clock, its minimum over the last two windows
+  uint64_t now = audio_time();
+  int64_t capture = audio_extend(timestamp, &audio_last_ts, &audio_ts) *
+    1000000 / AUDIO_SAMPLE_RATE;
+  int64_t transit = (int64_t)now - capture;
+  if (!audio_window_start) {
+    audio_floor = audio_window_min = audio_last_transit = transit;
+    audio_window_start = now;
+  }
+
+  if (transit < audio_window_min) {
+    audio_window_min = transit;
+  }
+
+  if (now - audio_window_start > AUDIO_WINDOW) {
+    audio_floor = audio_window_min;
+    audio_window_min = transit;
+    audio_window_start = now;
+  }
+
+  if (transit < audio_floor) {
+    audio_floor = transit;
+  }
+
+  // Interarrival jitter (RFC 3550)
+  int64_t difference = transit - audio_last_transit;
+  audio_jitter += ((difference < 0 ? -difference : difference) - audio_jitter) / 16;
+  audio_last_transit = transit;
+
+  int16_t ahead = sequence - audio_next;
+  if (!audio_started || ahead >= AUDIO_SLOTS || ahead < -AUDIO_SLOTS) {
+    audio_reset(sequence);
+    ahead = 0;
+  }
+
+  if (ahead < 0) {
+    audio_counters.late++;
+    return;
+  }
+
+  // HiSilicon frame header in front, ADEC takes whole frames
+  struct AudioSlot* slot = &audio_slots[sequence % AUDIO_SLOTS];
+  if (slot->valid) {
+    return;
+  }
+
+  audio_buffered++;
+  slot->valid = 1;
+  slot->sequence = sequence;
+  slot->capture = capture;
+  slot->size = AUDIO_HISI_HEADER + data_size;
+  slot->data[0] = 0x00;
+  slot->data[1] = 0x01;
+  slot->data[2] = (data_size / 2) & 0xFF;
+  slot->data[3] = (data_size / 2) >> 8;
+  memcpy(slot->data + AUDIO_HISI_HEADER, data, data_size);
+}
+
+void audio_video(uint32_t timestamp) {
+  if (!video_seen) {
+    video_last_ts = timestamp;
+    video_ts = timestamp;
+    video_seen = 1;
+  }
+
+  int64_t capture = audio_extend(timestamp, &video_last_ts, &video_ts) * 100 / 9;
+  int64_t transit = (int64_t)audio_time() - capture;
+  if (!video_transit || transit - video_transit > 1000000 ||
+      video_transit - transit > 1000000) {
+    video_transit = transit;
+  }
+
+  video_transit += (transit - video_transit) / 16;
+}
+
+void audio_play() {
+  if (!audio_opened || !audio_started) {
+    return;
+  }
+
+  // Lowest offset that absorbs audio jitter, raised to follow video
+  int64_t margin = audio_jitter * 2 > audio_frame_time ? audio_jitter * 2 : audio_frame_time;
+  int64_t target = audio_floor + margin;
+  if (video_seen && video_transit + audio_offset > target) {
+    target = video_transit + audio_offset;
+  }
+
+  if (target > audio_floor + AUDIO_MAX_DEPTH * 1000) {
+    target = audio_floor + AUDIO_MAX_DEPTH * 1000;
+  }
+
+  audio_target = target;
+
+  int64_t now = audio_time();
+  while (1) {
+    struct AudioSlot* slot = &audio_slots[audio_next % AUDIO_SLOTS];
+    if (!slot->valid || slot->sequence != audio_next) {
+      // Give a missing frame one frame length after it was due, nothing
+      // is skipped while the link is down
+      if (!audio_buffered || !audio_next_capture ||
+          now < audio_next_capture + target + audio_frame_time) {
+        return;
+      }
+
+      audio_counters.lost++;
+      audio_next++;
+      audio_next_capture += audio_frame_time;
+      continue;
+    }
+
+    if (now < slot->capture + target) {
+      return;
+    }
+
+    slot->valid = 0;
+    audio_buffered--;
+    audio_next++;
+    audio_next_capture = slot->capture + audio_frame_time;
+
+    // AO behind, ground and encoder clocks drift apart
+    AO_CHN_STATE_S state;
+    if (HI_MPI_AO_QueryChnStat(audio_device, audio_ao, &state) == HI_SUCCESS &&
+        state.u32ChnBusyNum > AUDIO_AO_BUSY) {
+      audio_counters.dropped++;
+      continue;
+    }
+
+    AUDIO_STREAM_S stream;
+    memset(&stream, 0x00, sizeof(stream));
+    stream.pStream = slot->data;
+    stream.u32Len = slot->size;
+    stream.u32Seq = slot->sequence;
+    if (HI_MPI_ADEC_SendStream(audio_adec, &stream, HI_FALSE) != HI_SUCCESS) {
+      audio_counters.dropped++;
+      continue;
+    }
+
+    audio_counters.played++;
+  }
+}
+
+uint32_t audio_summary(struct AudioSummary* summary) {
+  *summary = audio_counters;
+  summary->depth = (audio_target - audio_floor) / 1000;
+  summary->jitter = audio_jitter;
+  memset(&audio_counters, 0x00, sizeof(audio_counters));
+  return audio_opened;
+}
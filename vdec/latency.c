@@ -0,0 +1,226 @@
+#include "main.h"
+
+/*
+ * Glass-to-glass latency measurement.
+ *
+ * Encoder attaches timing of each frame (capture PTS, time it left encoder)
+ * as user data SEI to the following frame. Ground side remembers when the
+ * first packet of every frame arrived and when the frame was submitted to
+ * VDEC, both keyed by RTP timestamp. Clock offset between encoder and ground
+ * is estimated from ping / pong exchanges, the sample with the smallest
+ * round trip out of the last few is used, as NTP does.
+ */
+
+#define LATENCY_FRAMES 64
+#define LATENCY_SAMPLES 256
+#define LATENCY_PROBES 8
+
+struct LatencyFrame {
+  uint32_t timestamp;
+  uint64_t arrival;
+  uint64_t submit;
+};
+
+struct LatencySample {
+  int32_t capture;        // Capture -> encoder output, us
+  int32_t network;        // Encoder output -> first packet received, us
+  int32_t receive;        // First packet received -> VDEC submit, us
+  int32_t total;          // Capture -> VDEC submit, us
+};
+
+struct ClockProbe {
+  int64_t offset;
+  int64_t delay;
+};
+
+static uint8_t latency_enabled = 0;
+static FILE* latency_log = NULL;
+static struct LatencyFrame latency_frames[LATENCY_FRAMES];
+static struct LatencySample latency_samples[LATENCY_SAMPLES];
+static uint32_t latency_sample_count = 0;
+static struct ClockProbe latency_probes[LATENCY_PROBES];
+static uint32_t latency_probe_count = 0;
+static int64_t latency_offset = 0;
+static int64_t latency_delay = -1;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t latency_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void latency_init(const char* log_path) {
+  latency_enabled = 1;
+
+  if (log_path) {
+    latency_log = fopen(log_path, "w");
+    if (!latency_log) {
+      printf("ERROR: Unable to open latency log [%s]\n", log_path);
+      return;
+    }
+
+    fprintf(latency_log, "frame,capture_us,network_us,receive_us,total_us,offset_us,rtt_us\n");
+  }
+}
+
+uint8_t latency_active() {
+  return latency_enabled;
+}
+
+void latency_ping(struct ClockPing* ping) {
+  ping->header.magic = htobe16(FEEDBACK_MAGIC);
+  ping->header.type = FEEDBACK_PING;
+  ping->header.reserved = 0;
+  ping->origin = htobe64(latency_time());
+}
+
+void latency_pong(const struct ClockPong* pong) {
+  uint64_t now = latency_time();
+  int64_t origin = be64toh(pong->origin);
+  int64_t receive = be64toh(pong->receive);
+  int64_t transmit = be64toh(pong->transmit);
+
+  struct ClockProbe* probe = &latency_probes[latency_probe_count++ % LATENCY_PROBES];
+  probe->offset = ((receive - origin) + (transmit - (int64_t)now)) / 2;
+  probe->delay = ((int64_t)now - origin) - (transmit - receive);
+
+  // Queueing only adds delay, least delayed probe has the best offset
+  uint32_t count = MIN(latency_probe_count, LATENCY_PROBES);
+  struct ClockProbe* best = &latency_probes[0];
+  for (uint32_t i = 1; i < count; i++) {
+    if (latency_probes[i].delay < best->delay) {
+      best = &latency_probes[i];
+    }
+  }
+
+  latency_offset = best->offset;
+  latency_delay = best->delay;
+}
+
+void latency_packet(uint32_t timestamp) {
+  struct LatencyFrame* frame = &latency_frames[timestamp % LATENCY_FRAMES];
+  if (frame->timestamp != timestamp || !frame->arrival) {
+    frame->timestamp = timestamp;
+    frame->arrival = latency_time();
+    frame->submit = 0;
+  }
+}
+
+static void latency_record(const struct LatencyRecord* record) {
+  uint64_t capture = be64toh(record->capture);
+  uint64_t encoded = be64toh(record->encoded);
+  uint32_t timestamp = capture * 9 / 100;
+
+  struct LatencyFrame* frame = &latency_frames[timestamp % LATENCY_FRAMES];
+  if (frame->timestamp != timestamp || !frame->submit || latency_delay < 0) {
+    return;
+  }
+
+  // Encoder times moved to ground clock
+  struct LatencySample sample;
+  sample.capture = encoded - capture;
+  sample.network = (int64_t)frame->arrival - ((int64_t)encoded - latency_offset);
+  sample.receive = frame->submit - frame->arrival;
+  sample.total = (int64_t)frame->submit - ((int64_t)capture - latency_offset);
+
+  pthread_mutex_lock(&latency_lock);
+  latency_samples[latency_sample_count++ % LATENCY_SAMPLES] = sample;
+  pthread_mutex_unlock(&latency_lock);
+
+  if (latency_log) {
+    fprintf(latency_log, "%u,%d,%d,%d,%d,%lld,%lld\n", be32toh(record->frame),
+      sample.capture, sample.network, sample.receive, sample.total,
+      (long long)latency_offset, (long long)latency_delay);
+  }
+}
+
+void latency_submit(const uint8_t* data, uint32_t size, uint32_t timestamp) {
+  struct LatencyFrame* frame = &latency_frames[timestamp % LATENCY_FRAMES];
+  if (frame->timestamp == timestamp) {
+    frame->submit = latency_time();
+  }
+
+  // Look for user data SEI, H.264 type 6 or H.265 prefix SEI type 39
+  for (uint32_t i = 0; i + 4 < size; i++) {
+    if (data[i] || data[i + 1] || data[i + 2] != 1) {
+      continue;
+    }
+
+    uint8_t header = data[i + 3];
+    if ((header & 0x1F) != 6 && ((header >> 1) & 0x3F) != 39) {
+      continue;
+    }
+
+    // Magic has no zero bytes, so it is never escaped
+    const uint8_t* found = NULL;
+    for (uint32_t j = i + 4; j + 4 <= size; j++) {
+      uint32_t word = (uint32_t)data[j] << 24 | data[j + 1] << 16 | data[j + 2] << 8 | data[j + 3];
+      if (word == LATENCY_MAGIC) {
+        found = data + j;
+        break;
+      }
+    }
+
+    if (!found) {
+      return;
+    }
+
+    // Strip emulation prevention bytes
+    struct LatencyRecord record;
+    uint8_t* output = (uint8_t*)&record;
+    uint32_t length = 0, zeros = 0;
+    for (const uint8_t* p = found; p < data + size && length < sizeof(record); p++) {
+      if (zeros >= 2 && *p == 3) {
+        zeros = 0;
+        continue;
+      }
+
+      zeros = *p ? 0 : zeros + 1;
+      output[length++] = *p;
+    }
+
+    if (length == sizeof(record)) {
+      latency_record(&record);
+    }
+    return;
+  }
+}
+
+static int latency_compare(const void* a, const void* b) {
+  return *(const int32_t*)a - *(const int32_t*)b;
+}
+
+uint32_t latency_summary(struct LatencySummary* summary) {
+  int32_t values[4][LATENCY_SAMPLES];
+
+  pthread_mutex_lock(&latency_lock);
+  uint32_t count = MIN(latency_sample_count, LATENCY_SAMPLES);
+  for (uint32_t i = 0; i < count; i++) {
+    values[0][i] = latency_samples[i].capture;
+    values[1][i] = latency_samples[i].network;
+    values[2][i] = latency_samples[i].receive;
+    values[3][i] = latency_samples[i].total;
+  }
+  pthread_mutex_unlock(&latency_lock);
+
+  if (!count) {
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < 4; i++) {
+    qsort(values[i], count, sizeof(int32_t), latency_compare);
+  }
+
+  summary->capture = values[0][count / 2];
+  summary->network = values[1][count / 2];
+  summary->receive = values[2][count / 2];
+  summary->p50 = values[3][count / 2];
+  summary->p95 = values[3][count * 95 / 100];
+  summary->p99 = values[3][count * 99 / 100];
+
+  if (latency_log) {
+    fflush(latency_log);
+  }
+  return count;
+}
@@ -158,6 +158,16 @@ void printHelp() {
     "    --ar-w [Value]     - Image width\n"
     "    --ar-h [Value]     - Image height\n"
     "\n"
+    "    --report-port [Port]   - Receiver reports to venc, 0 - off (Default: 5001)\n"
+    "    --report-interval [ms] - Receiver report interval  (Default: 200)\n"
+    "    --nack [ms]            - Request lost packets, wait up to ms for them (Default: off)\n"
+    "    --latency              - Measure latency from venc timing SEI (needs venc --latency)\n"
+    "    --latency-log [Path]   - Write per-frame latency CSV, enables --latency\n"
+    "    --audio                - Play venc audio stream    (Default: off)\n"
+    "    --audio-dev [Dev]      - AO device, 1 - HDMI       (Default: 1)\n"
+    "    --audio-offset [ms]    - Delay audio against video frames leaving\n"
+    "                             for VDEC, decode and display time (Default: 0)\n"
+    "\n"
     "    --osd                  - Enable OSD\n"
     "    --mavlink-port [port]  - MavLink Rx port           (Default: 14550)\n"
     "    --bg-r [Value]         - Background color red      (Default: 0)\n"
@@ -168,6 +178,9 @@ void printHelp() {
 }
 
 extern uint32_t frames_received;
+extern uint32_t packets_lost;
+extern uint32_t packets_recovered;
+extern uint32_t packets_oversized;
 uint32_t stats_rx_bytes = 0;
 struct timespec last_timestamp = {0, 0};
 
@@ -285,6 +298,59 @@ uint16_t mavlink_port = 14550;
 uint32_t vo_width = 1280;
 uint32_t vo_height = 720;
 
+// Decoder waits for a sequence parameter set after start or link outage
+uint8_t keyframe_needed = 1;
+
+// Latency percentiles shown on OSD
+struct LatencySummary latency_stats;
+
+void decodeDatagram(uint8_t* datagram, uint32_t size, uint32_t rtp_header,
+  uint8_t* nal_buffer, VDEC_CHN vdec_channel_id, int codec_mode_stream) {
+  VDEC_STREAM_S stream;
+  memset(&stream, 0x00, sizeof(stream));
+  stream.bEndOfStream = HI_FALSE;
+  stream.bEndOfFrame = codec_mode_stream ? HI_FALSE : HI_TRUE;
+
+  // Frame is identified by RTP timestamp
+  uint32_t timestamp = rtp_header ? be32toh(*(uint32_t*)(datagram + 4)) : 0;
+
+  // Decode UDP stream
+  stream.pu8Addr = decode_frame(datagram, size,
+    rtp_header, nal_buffer, &stream.u32Len);
+  if (!stream.pu8Addr) {
+    return;
+  }
+
+  if (stream.u32Len < 5) {
+    printf("> Broken frame\n");
+  }
+
+  stats_rx_bytes += stream.u32Len;
+
+  // Parameter sets precede every IDR, H.264 SPS or H.265 SPS
+  uint8_t nal_header = stream.pu8Addr[4];
+  if ((nal_header & 0x1F) == 7 || ((nal_header >> 1) & 0x3F) == 33) {
+    keyframe_needed = 0;
+  }
+
+  recorder_input_data(&stream);
+
+  // Send frame into decoder
+  int ret = HI_MPI_VDEC_SendStream(vdec_channel_id, &stream, 0);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Unable to send data into VDEC = 0x%x\n", ret);
+  }
+
+  if (rtp_header && latency_active()) {
+    latency_submit(stream.pu8Addr, stream.u32Len, timestamp);
+  }
+
+  // Frame complete, audio follows its transit
+  if (rtp_header && audio_active() && (datagram[1] & 0x80)) {
+    audio_video(timestamp);
+  }
+}
+
 int main(int argc, const char* argv[]) {
   VO_INTF_SYNC_E vo_mode = VO_OUTPUT_720P60;
   uint32_t vo_framerate = 60;
@@ -299,8 +365,14 @@ int main(int argc, const char* argv[]) {
   VO_CHN vo_channel_id = 0;
 
   uint16_t listen_port = 5600;
+  uint16_t report_port = 5001;
+  uint32_t report_interval = 200;
   uint32_t background_color = 0x006000;
 
+  uint8_t audio_enabled = 0;
+  AUDIO_DEV audio_device_id = 1;
+  int32_t audio_offset = 0;
+
   const char* write_stream_path = 0;
   int enable_osd = 0;
   int codec_mode_stream = 1;
@@ -317,6 +389,46 @@ int main(int argc, const char* argv[]) {
     continue;
   }
 
+  __OnArgument("--report-port") {
+    report_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--nack") {
+    nack_enable(atoi(__ArgValue));
+    continue;
+  }
+
+  __OnArgument("--latency") {
+    latency_init(NULL);
+    continue;
+  }
+
+  __OnArgument("--latency-log") {
+    latency_init(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--audio") {
+    audio_enabled = 1;
+    continue;
+  }
+
+  __OnArgument("--audio-dev") {
+    audio_device_id = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--audio-offset") {
+    audio_offset = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--report-interval") {
+    report_interval = atoi(__ArgValue);
+    continue;
+  }
+
   __OnArgument("-c") {
     const char* codec = __ArgValue;
     if (!strcmp(codec, "h264")) {
@@ -757,8 +869,11 @@ __OnArgument("--crsf") {
   // Initialize VO
   VO_init(vo_device_id, VO_INTF_HDMI | VO_INTF_VGA, vo_mode, vo_framerate, background_color);
 
-  // Initialize HDMI
-  VO_HDMI_init(0, vo_mode);
+  // Initialize HDMI, audio is sent along with picture
+  if (audio_enabled) {
+    audio_init(audio_device_id, audio_offset);
+  }
+  VO_HDMI_init(0, vo_mode, audio_enabled && audio_device_id == 1);
 
   ret = HI_MPI_VO_GetDevFrameRate(vo_device_id, &vo_framerate);
   if (ret != HI_SUCCESS) {
@@ -976,43 +1091,149 @@ __OnArgument("--crsf") {
   uint8_t* write_buffer = malloc(write_buffer_capacity);
   uint32_t write_buffer_size = 0;
 
+  // Receiver reports go back to the address video comes from
+  struct sockaddr_in sender_address;
+  socklen_t sender_address_size = sizeof(sender_address);
+  memset(&sender_address, 0x00, sizeof(sender_address));
+  struct timespec last_report;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &last_report);
+  struct timespec last_receive = last_report;
+  struct timespec last_latency = last_report;
+  struct timespec last_audio = last_report;
+
   while (1) {
-    int rx = recv(port, rx_buffer+8, 4096, 0);
+    if (audio_active()) {
+      audio_play();
+    }
+
+    if (report_port && sender_address.sin_family == AF_INET) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+      uint32_t interval = getTimeInterval(&now, &last_report) * 1000;
+      if (interval >= report_interval) {
+        struct sockaddr_in report_address = sender_address;
+        report_address.sin_port = htons(report_port);
+
+        struct ReceiverReport report;
+        if (report_fill(&report, interval)) {
+          sendto(port, &report, sizeof(report), 0,
+            (struct sockaddr*)&report_address, sizeof(report_address));
+        }
+
+        // Clock offset probe
+        if (latency_active()) {
+          struct ClockPing ping;
+          latency_ping(&ping);
+          sendto(port, &ping, sizeof(ping), 0,
+            (struct sockaddr*)&report_address, sizeof(report_address));
+        }
+
+        // Ask for parameter sets and IDR until decoder locks on, repeated as
+        // requests may be lost
+        if (keyframe_needed) {
+          struct FeedbackHeader request;
+          request.magic = htobe16(FEEDBACK_MAGIC);
+          request.type = FEEDBACK_PARAMETER_SETS;
+          request.reserved = 0;
+          sendto(port, &request, sizeof(request), 0,
+            (struct sockaddr*)&report_address, sizeof(report_address));
+
+          request.type = FEEDBACK_KEYFRAME;
+          sendto(port, &request, sizeof(request), 0,
+            (struct sockaddr*)&report_address, sizeof(report_address));
+        }
+        last_report = now;
+      }
+    }
+
+    sender_address_size = sizeof(sender_address);
+    int rx = recvfrom(port, rx_buffer+8, RX_MAX_DATAGRAM, 0,
+      (struct sockaddr*)&sender_address, &sender_address_size);
     if (rx <= 0) {
       usleep(1);
       continue;
     }
 
-    VDEC_STREAM_S stream;
-    memset(&stream, 0x00, sizeof(stream));
-    stream.bEndOfStream = HI_FALSE;
-    stream.bEndOfFrame = codec_mode_stream ? HI_FALSE : HI_TRUE;
-
-    uint32_t rtp_header = 0;
-    if (rx_buffer[8] & 0x80 && rx_buffer[9] & 0x60) {
-      rtp_header = 12;
+    // Clock offset probe answer
+    struct FeedbackHeader* feedback = (struct FeedbackHeader*)(rx_buffer + 8);
+    if (rx == sizeof(struct ClockPong) && be16toh(feedback->magic) == FEEDBACK_MAGIC &&
+        feedback->type == FEEDBACK_PONG) {
+      latency_pong((struct ClockPong*)feedback);
+      continue;
     }
 
-    // Decode UDP stream
-    stream.pu8Addr = decode_frame(rx_buffer + 8, rx,
-      rtp_header, nal_buffer, &stream.u32Len);
-    if (!stream.pu8Addr) {
+    // Audio has a clock and a buffer of its own, video path never sees it
+    if (audio_is_packet(rx_buffer + 8, rx)) {
+      if (audio_active()) {
+        audio_push(rx_buffer + 8, rx);
+        audio_play();
+      }
       continue;
     }
 
-    if (stream.u32Len < 5) {
-      printf("> Broken frame\n");
+    // Decoder references are likely gone after a long outage
+    struct timespec receive_time;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &receive_time);
+    if (getTimeInterval(&receive_time, &last_receive) > KEYFRAME_OUTAGE) {
+      keyframe_needed = 1;
+    }
+    last_receive = receive_time;
+
+    if (latency_active() && getTimeInterval(&receive_time, &last_latency) > 1) {
+      struct LatencySummary summary;
+      if (latency_summary(&summary)) {
+        printf("> Latency: p50 %.1f, p95 %.1f, p99 %.1f ms | Capture %.1f, "
+          "Network %.1f, Receive %.1f ms\n", summary.p50 / 1000., summary.p95 / 1000.,
+          summary.p99 / 1000., summary.capture / 1000., summary.network / 1000.,
+          summary.receive / 1000.);
+        latency_stats = summary;
+      }
+      last_latency = receive_time;
     }
 
-    stats_rx_bytes += stream.u32Len;
+    if (audio_active() && getTimeInterval(&receive_time, &last_audio) > 1) {
+      struct AudioSummary summary;
+      if (audio_summary(&summary)) {
+        printf("> Audio: played %d, lost %d, late %d, dropped %d | Depth %d ms, "
+          "Jitter %.1f ms\n", summary.played, summary.lost, summary.late,
+          summary.dropped, summary.depth, summary.jitter / 1000.);
+      }
+      last_audio = receive_time;
+    }
 
-    recorder_input_data(&stream);
+    // Reorder and recover lost RTP packets
+    if (rx_buffer[8] & 0x80 && rx_buffer[9] & 0x60) {
+      report_input(rx_buffer + 8, rx);
+      if (latency_active()) {
+        latency_packet(be32toh(*(uint32_t*)(rx_buffer + 12)));
+      }
 
-    // Send frame into decoder
-    int ret = HI_MPI_VDEC_SendStream(vdec_channel_id, &stream, 0);
-    if (ret != HI_SUCCESS) {
-      printf("WARN: Unable to send data into VDEC = 0x%x\n", ret);
+      // Nothing to reorder or recover without parity and NACK
+      if (!fec_active(rx_buffer + 8, rx)) {
+        decodeDatagram(rx_buffer + 8, rx, 12, nal_buffer,
+          vdec_channel_id, codec_mode_stream);
+        continue;
+      }
+      fec_push(rx_buffer + 8, rx);
+
+      // Ask for lost packets right away, while they may still be played
+      struct NackMessage nack;
+      uint32_t nack_size = nack_fill(&nack);
+      if (nack_size && report_port) {
+        struct sockaddr_in nack_address = sender_address;
+        nack_address.sin_port = htons(report_port);
+        sendto(port, &nack, nack_size, 0,
+          (struct sockaddr*)&nack_address, sizeof(nack_address));
+      }
+      while ((rx = fec_pop(rx_buffer + 8))) {
+        decodeDatagram(rx_buffer + 8, rx, 12, nal_buffer,
+          vdec_channel_id, codec_mode_stream);
+      }
+      continue;
     }
+
+    decodeDatagram(rx_buffer + 8, rx, 0, nal_buffer,
+      vdec_channel_id, codec_mode_stream);
   }
 
   return 0;
@@ -1388,10 +1609,17 @@ void* __OSD_THREAD__(void* arg) {
       }
     }
 
-    char hud_frames_rx[32];
+    char hud_frames_rx[96];
     memset(hud_frames_rx, 0, sizeof(hud_frames_rx));
-    sprintf(hud_frames_rx, "RX Packets %d", frames_received);
+    sprintf(hud_frames_rx, "RX Packets %d Lost %d FEC %d Big %d",
+      frames_received, packets_lost, packets_recovered, packets_oversized);
     if (osd_element15x > 0){fbg_write(fbg, hud_frames_rx, osd_element15x*resX_multiplier, osd_element15y*resY_multiplier);}
+    if (osd_element15x > 0 && latency_active()) {
+      memset(hud_frames_rx, 0, sizeof(hud_frames_rx));
+      sprintf(hud_frames_rx, "G2G %.1f/%.1f/%.1f ms", latency_stats.p50 / 1000.,
+        latency_stats.p95 / 1000., latency_stats.p99 / 1000.);
+      fbg_write(fbg, hud_frames_rx, osd_element15x*resX_multiplier, osd_element15y*resY_multiplier + 20);
+    }
     memset(hud_frames_rx, 0, sizeof(hud_frames_rx));
     sprintf(hud_frames_rx, "Rate %.02f Kbit/s", rx_rate);
     if (osd_element16x > 0){fbg_write(fbg, hud_frames_rx, osd_element16x*resX_multiplier, osd_element16y*resY_multiplier);}
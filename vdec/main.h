@@ -1,6 +1,8 @@
 #pragma once
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +11,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -52,7 +55,11 @@
 #define ALIGN_UP(x, a) ((x + a - 1) & (~(a - 1)))
 #define ALIGN_BACK(x, a) ((a) * (((x) / (a))))
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define KEYFRAME_OUTAGE 1.0 // Receive gap after which stream is re-requested, sec.
 
+#include "../venc/audio.h"
+#include "../venc/fec.h"
+#include "../venc/feedback.h"
 #include "fbg_fbdev.h"
 #include "fbgraphics.h"
 #include "mavlink/common/mavlink.h"
@@ -72,21 +79,190 @@ int VO_init(VO_DEV device_id, VO_INTF_TYPE_E interface_type,
  * @brief
  * @param device_id
  * @param interface_mode
+ * @param enable_audio - Send AO output over HDMI
  * @return
  */
-int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode);
+int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode,
+  uint8_t enable_audio);
 
 /**
  * @brief
  * @param rx_buffer - UDP data
  * @param rx_size - Size of UDP data
- * @param header_size - Size of data before payload
+ * @param header_size - Size of data before payload, RTP CSRC list and
+ *   header extension are skipped on top of it
  * @param nal_buffer - Buffer for NAL reassembly
  * @param out_nal_size
  */
 uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
   uint32_t header_size, uint8_t* nal_buffer, uint32_t* out_nal_size);
 
+// Largest datagram read from the socket
+#define RX_MAX_DATAGRAM 4096
+
+/**
+ * @brief Tell whether RTP datagrams go through reordering and recovery,
+ *   only once parity was received or with retransmission requests enabled
+ * @param datagram - RTP datagram
+ * @param size - Size of datagram
+ * @return 1 if datagram is passed to fec_push()
+ */
+int fec_active(const uint8_t* datagram, uint32_t size);
+
+/**
+ * @brief Store received RTP datagram, recover lost datagrams from parity
+ * @param datagram - RTP datagram
+ * @param size - Size of datagram
+ */
+void fec_push(uint8_t* datagram, uint32_t size);
+
+/**
+ * @brief Get next datagram in sequence order
+ * @param datagram - Output buffer
+ * @return Size of datagram, 0 if none is ready
+ */
+uint32_t fec_pop(uint8_t* datagram);
+
+/**
+ * @brief Enable retransmission requests for lost RTP packets
+ * @param wait - Time to wait for a retransmitted packet, ms
+ */
+void nack_enable(uint32_t wait);
+
+/**
+ * @brief Build retransmission request for packets lost since previous call
+ * @param message - Output message
+ * @return Size of message, 0 if nothing is lost
+ */
+uint32_t nack_fill(struct NackMessage* message);
+
+/**
+ * @brief Account received RTP datagram in receiver report
+ * @param datagram - RTP datagram
+ * @param size - Size of datagram
+ */
+void report_input(uint8_t* datagram, uint32_t size);
+
+/**
+ * @brief Build receiver report and start a new report interval
+ * @param report - Output report
+ * @param interval - Time since previous report, ms
+ * @return 1 if report is ready
+ */
+int report_fill(struct ReceiverReport* report, uint32_t interval);
+
+/* --- Latency measurement --- */
+
+// Percentiles of recent frames, us
+struct LatencySummary {
+  int32_t capture;        // Median capture -> encoder output
+  int32_t network;        // Median encoder output -> first packet received
+  int32_t receive;        // Median first packet received -> VDEC submit
+  int32_t p50;            // Capture -> VDEC submit
+  int32_t p95;
+  int32_t p99;
+};
+
+/**
+ * @brief Enable latency measurement
+ * @param log_path - Per-frame CSV log, NULL - no log
+ */
+void latency_init(const char* log_path);
+
+/**
+ * @brief Check if latency measurement is enabled
+ */
+uint8_t latency_active();
+
+/**
+ * @brief Build clock offset probe
+ * @param ping - Output message
+ */
+void latency_ping(struct ClockPing* ping);
+
+/**
+ * @brief Update clock offset from probe answer
+ * @param pong - Answer from encoder
+ */
+void latency_pong(const struct ClockPong* pong);
+
+/**
+ * @brief Account arrival of RTP data packet
+ * @param timestamp - RTP timestamp of the packet
+ */
+void latency_packet(uint32_t timestamp);
+
+/**
+ * @brief Account data submitted to VDEC, parse timing SEI found in it
+ * @param data - Annex B data
+ * @param size - Data size
+ * @param timestamp - RTP timestamp of the data
+ */
+void latency_submit(const uint8_t* data, uint32_t size, uint32_t timestamp);
+
+/**
+ * @brief Compute percentiles over recent frames
+ * @param summary - Output summary
+ * @return Number of frames, 0 if nothing is measured yet
+ */
+uint32_t latency_summary(struct LatencySummary* summary);
+
+/* --- Audio playout --- */
+
+// Counters since previous summary
+struct AudioSummary {
+  uint32_t played;
+  uint32_t lost;          // Never arrived or arrived after being skipped
+  uint32_t late;          // Arrived after their turn
+  uint32_t dropped;       // Not accepted by ADEC or AO backed up
+  int32_t depth;          // Playout offset above fastest audio, ms
+  int32_t jitter;         // Audio interarrival jitter, us
+};
+
+/**
+ * @brief Enable audio playout, ADEC and AO open on the first audio packet
+ * @param device - AO device
+ * @param offset - Audio delay relative to video frames leaving VDEC input, ms
+ */
+void audio_init(AUDIO_DEV device, int32_t offset);
+
+/**
+ * @brief Check if audio playout is enabled
+ */
+uint8_t audio_active();
+
+/**
+ * @brief Check if datagram belongs to audio stream
+ * @param datagram - UDP data
+ * @param size - Size of UDP data
+ */
+uint8_t audio_is_packet(const uint8_t* datagram, uint32_t size);
+
+/**
+ * @brief Store audio RTP packet in jitter buffer
+ * @param datagram - RTP packet
+ * @param size - Size of packet
+ */
+void audio_push(uint8_t* datagram, uint32_t size);
+
+/**
+ * @brief Account last packet of a video frame submitted to VDEC
+ * @param timestamp - RTP timestamp of the frame
+ */
+void audio_video(uint32_t timestamp);
+
+/**
+ * @brief Send due frames to ADEC, called from receive loop
+ */
+void audio_play();
+
+/**
+ * @brief Take counters and start a new interval
+ * @param summary - Output summary
+ * @return 1 if audio is playing
+ */
+uint32_t audio_summary(struct AudioSummary* summary);
+
 /* --- Console arguments parser --- */
 #define __BeginParseConsoleArguments__(printHelpFunction) \
   if (argc < 2 || (argc == 2 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "/?") \
@@ -1,10 +1,34 @@
 #include "main.h"
 
 uint32_t frames_received = 0;
+uint32_t packets_lost = 0;
+uint32_t packets_recovered = 0;
+uint32_t packets_oversized = 0;
 static uint32_t in_nal_size = 0;
+static uint16_t in_sequence = 0;
 
 uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
   uint32_t header_size, uint8_t* nal_buffer, uint32_t* out_nal_size) {
+  // Drop partially assembled NAL if RTP sequence has a gap
+  if (header_size) {
+    uint16_t sequence = rx_buffer[2] << 8 | rx_buffer[3];
+    if (sequence != (uint16_t)(in_sequence + 1)) {
+      in_nal_size = 0;
+    }
+    in_sequence = sequence;
+
+    // Skip CSRC list and header extension, e.g. temporal layer frame marking
+    header_size += (rx_buffer[0] & 0x0F) * 4;
+    if ((rx_buffer[0] & 0x10) && header_size + 4 <= rx_size) {
+      header_size += 4 + (rx_buffer[header_size + 2] << 8 | rx_buffer[header_size + 3]) * 4;
+    }
+
+    if (header_size >= rx_size) {
+      in_nal_size = 0;
+      return NULL;
+    }
+  }
+
   rx_buffer += header_size;
   rx_size -= header_size;
 
@@ -16,6 +40,35 @@ uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
   uint8_t end_bit = 0;
   uint8_t copy_size = 4;
 
+  // Aggregation packet: STAP-A (H.264) or AP (H.265), forbidden type 0 in H.264
+  if (fragment_type_avc == 24 || (fragment_type_hevc == 48 && fragment_type_avc == 0)) {
+    uint32_t offset = fragment_type_avc == 24 ? 1 : 2;
+    uint32_t nal_size = 0;
+
+    // Convert to Annex B: replace 16-bit sizes with start codes
+    while (offset + 2 <= rx_size) {
+      uint32_t unit_size = rx_buffer[offset] << 8 | rx_buffer[offset + 1];
+      offset += 2;
+      if (!unit_size || offset + unit_size > rx_size) {
+        break;
+      }
+
+      nal_buffer[nal_size + 0] = 0;
+      nal_buffer[nal_size + 1] = 0;
+      nal_buffer[nal_size + 2] = 0;
+      nal_buffer[nal_size + 3] = 1;
+      memcpy(nal_buffer + nal_size + copy_size, rx_buffer + offset, unit_size);
+
+      nal_size += unit_size + copy_size;
+      offset += unit_size;
+      frames_received++;
+    }
+
+    *out_nal_size = nal_size;
+    in_nal_size = 0;
+    return nal_size ? nal_buffer : NULL;
+  }
+
   if (fragment_type_avc == 28 || fragment_type_hevc == 49) {
     if (fragment_type_avc == 28) {
       start_bit = rx_buffer[1] & 0x80;
@@ -25,14 +78,15 @@ uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
       start_bit = rx_buffer[2] & 0x80;
       end_bit = rx_buffer[2] & 0x40;
       nal_buffer[4] = (rx_buffer[0] & 0x81) | (rx_buffer[2] & 0x3F) << 1;
-      nal_buffer[5] = 1;
+      nal_buffer[5] = rx_buffer[1];
       copy_size++;
       rx_buffer++;
       rx_size--;
     }
 
-    rx_buffer++;
-    rx_size--;
+    // Skip FU indicator and FU header, NAL header is restored above
+    rx_buffer += 2;
+    rx_size -= 2;
 
     if (start_bit) {
       // Write NAL header
@@ -42,20 +96,18 @@ uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
       nal_buffer[3] = 1;
 
       // Copy data
-      memcpy(nal_buffer + copy_size, rx_buffer, rx_size);
-      in_nal_size = rx_size + copy_size;
-    } else {
-      rx_buffer++;
-      rx_size--;
+      memcpy(nal_buffer + copy_size + 1, rx_buffer, rx_size);
+      in_nal_size = rx_size + copy_size + 1;
+    } else if (in_nal_size) {
       memcpy(nal_buffer + in_nal_size, rx_buffer, rx_size);
       in_nal_size += rx_size;
+    }
 
-      if (end_bit) {
-        *out_nal_size = in_nal_size;
-        in_nal_size = 0;
-        frames_received++;
-        return nal_buffer;
-      }
+    if (end_bit && in_nal_size) {
+      *out_nal_size = in_nal_size;
+      in_nal_size = 0;
+      frames_received++;
+      return nal_buffer;
     }
 
     return NULL;
@@ -74,3 +126,433 @@ uint8_t* decode_frame(uint8_t* rx_buffer, uint32_t rx_size,
     return rx_buffer - copy_size;
   }
 }
+
+/* --- FEC recovery and reordering of RTP packets --- */
+
+#define FEC_SLOT_COUNT 256
+#define FEC_MAX_BLOCKS 16
+#define FEC_RTP_HEADER 12
+
+// Received data datagram, symbol length field is placed right before data
+struct FECSlot {
+  uint16_t sequence;
+  uint16_t size;
+  uint8_t valid;
+  uint64_t missing_time;      // Packet was found missing, ms
+  uint8_t symbol[RX_MAX_DATAGRAM + 2];
+};
+
+// Parity packets received for one block
+struct FECParityBlock {
+  uint8_t valid;
+  uint16_t base_sequence;
+  uint8_t stride;
+  uint8_t data_count;
+  uint8_t received;
+  uint8_t parity_index[FEC_MAX_PARITY];
+  uint16_t symbol_size;
+  uint8_t parity[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+};
+
+static struct FECSlot* fec_slots = NULL;
+static struct FECParityBlock* fec_blocks = NULL;
+static uint32_t fec_block_index = 0;
+static uint16_t fec_next_sequence = 0;
+static uint16_t fec_last_sequence = 0;
+static uint16_t fec_hold = 0;
+static uint8_t fec_started = 0;
+static uint8_t fec_seen = 0;          // Parity was received
+
+// Retransmission requests
+static uint32_t nack_wait = 0;
+static struct NackEntry nack_entries[NACK_MAX_ENTRIES];
+static uint32_t nack_count = 0;
+uint32_t packets_requested = 0;
+
+static uint64_t fec_get_time() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void nack_add(uint16_t sequence) {
+  // Extend bitmask of the last entry when possible
+  if (nack_count) {
+    struct NackEntry* entry = &nack_entries[nack_count - 1];
+    uint16_t offset = sequence - entry->sequence;
+    if (offset >= 1 && offset <= 16) {
+      entry->bitmask |= 1 << (offset - 1);
+      packets_requested++;
+      return;
+    }
+  }
+
+  if (nack_count == NACK_MAX_ENTRIES) {
+    return;
+  }
+
+  nack_entries[nack_count].sequence = sequence;
+  nack_entries[nack_count].bitmask = 0;
+  nack_count++;
+  packets_requested++;
+}
+
+static struct FECSlot* fec_find_slot(uint16_t sequence) {
+  struct FECSlot* slot = &fec_slots[sequence % FEC_SLOT_COUNT];
+  return slot->valid && slot->sequence == sequence ? slot : NULL;
+}
+
+static void fec_recover(struct FECParityBlock* block) {
+  uint8_t missing[FEC_MAX_PARITY];
+  uint8_t count = 0;
+
+  for (uint8_t i = 0; i < block->data_count; i++) {
+    uint16_t sequence = block->base_sequence + i * block->stride;
+    if (fec_find_slot(sequence)) {
+      continue;
+    }
+
+    // Not enough parity yet
+    if (count == block->received) {
+      return;
+    }
+
+    missing[count++] = i;
+  }
+
+  block->valid = 0;
+  if (!count) {
+    return;
+  }
+
+  // Received data longer than the block symbol does not belong to it
+  for (uint8_t i = 0; i < block->data_count; i++) {
+    struct FECSlot* slot = fec_find_slot(block->base_sequence + i * block->stride);
+    if (slot && slot->size + 2 > block->symbol_size) {
+      return;
+    }
+  }
+
+  // Remove received data from parity
+  for (uint8_t r = 0; r < count; r++) {
+    for (uint8_t i = 0; i < block->data_count; i++) {
+      struct FECSlot* slot = fec_find_slot(block->base_sequence + i * block->stride);
+      if (slot) {
+        fec_encode(block->parity[r], slot->symbol, slot->size + 2,
+          fec_coefficient(block->parity_index[r], i));
+      }
+    }
+  }
+
+  uint8_t* residuals[FEC_MAX_PARITY];
+  uint8_t* output[FEC_MAX_PARITY];
+  for (uint8_t c = 0; c < count; c++) {
+    uint16_t sequence = block->base_sequence + missing[c] * block->stride;
+    struct FECSlot* slot = &fec_slots[sequence % FEC_SLOT_COUNT];
+
+    // Never overwrite a packet which is not delivered yet
+    if (slot->valid && (int16_t)(slot->sequence - fec_next_sequence) >= 0) {
+      return;
+    }
+
+    slot->valid = 0;
+    memset(slot->symbol, 0x00, block->symbol_size);
+    residuals[c] = block->parity[c];
+    output[c] = slot->symbol;
+  }
+
+  if (fec_decode(residuals, block->parity_index, missing, count,
+      output, block->symbol_size)) {
+    return;
+  }
+
+  for (uint8_t c = 0; c < count; c++) {
+    struct FECSlot* slot = (struct FECSlot*)(output[c] - offsetof(struct FECSlot, symbol));
+    slot->sequence = block->base_sequence + missing[c] * block->stride;
+    slot->size = slot->symbol[0] << 8 | slot->symbol[1];
+    slot->valid = slot->size >= FEC_RTP_HEADER && slot->size + 2 <= block->symbol_size;
+    packets_recovered += slot->valid;
+  }
+}
+
+static uint8_t fec_is_parity(const uint8_t* datagram) {
+  return be32toh(*(uint32_t*)(datagram + 8)) == FEC_SSRC;
+}
+
+int fec_active(const uint8_t* datagram, uint32_t size) {
+  if (size >= FEC_RTP_HEADER && fec_is_parity(datagram)) {
+    fec_seen = 1;
+  }
+
+  return fec_seen || nack_wait;
+}
+
+static void fec_push_parity(uint8_t* datagram, uint32_t size) {
+  struct FECHeader* header = (struct FECHeader*)(datagram + FEC_RTP_HEADER);
+  uint32_t symbol_size = size - FEC_RTP_HEADER - sizeof(struct FECHeader);
+  uint16_t base_sequence = be16toh(header->base_sequence);
+
+  if (size < FEC_RTP_HEADER + sizeof(struct FECHeader) || symbol_size > FEC_MAX_SYMBOL ||
+      !header->data_count || header->data_count > FEC_MAX_DATA ||
+      header->parity_index >= FEC_MAX_PARITY) {
+    return;
+  }
+
+  // Find block of this parity packet or replace the oldest one
+  struct FECParityBlock* block = NULL;
+  for (uint32_t i = 0; i < FEC_MAX_BLOCKS; i++) {
+    if (fec_blocks[i].valid && fec_blocks[i].base_sequence == base_sequence &&
+        fec_blocks[i].stride == header->stride) {
+      block = &fec_blocks[i];
+      break;
+    }
+  }
+
+  if (!block) {
+    block = &fec_blocks[fec_block_index++ % FEC_MAX_BLOCKS];
+    block->valid = 1;
+    block->base_sequence = base_sequence;
+    block->stride = header->stride;
+    block->data_count = header->data_count;
+    block->symbol_size = symbol_size;
+    block->received = 0;
+  }
+
+  for (uint8_t i = 0; i < block->received; i++) {
+    if (block->parity_index[i] == header->parity_index) {
+      return;
+    }
+  }
+
+  if (symbol_size != block->symbol_size) {
+    return;
+  }
+
+  memcpy(block->parity[block->received], datagram + size - symbol_size, symbol_size);
+  block->parity_index[block->received++] = header->parity_index;
+
+  // Wait for missing packets as long as a block may span
+  fec_hold = header->data_count * header->stride;
+  fec_recover(block);
+}
+
+void fec_push(uint8_t* datagram, uint32_t size) {
+  if (!fec_slots) {
+    fec_init();
+    fec_slots = calloc(FEC_SLOT_COUNT, sizeof(struct FECSlot));
+    fec_blocks = calloc(FEC_MAX_BLOCKS, sizeof(struct FECParityBlock));
+  }
+
+  if (size < FEC_RTP_HEADER) {
+    return;
+  }
+
+  if (size > RX_MAX_DATAGRAM) {
+    if (!packets_oversized++) {
+      printf("WARN: RTP datagram of %d bytes is above %d, dropped\n", size,
+        RX_MAX_DATAGRAM);
+    }
+    return;
+  }
+
+  // Parity has its own SSRC and sequence space
+  if (fec_is_parity(datagram)) {
+    fec_push_parity(datagram, size);
+    return;
+  }
+
+  uint16_t sequence = datagram[2] << 8 | datagram[3];
+  if (!fec_started) {
+    fec_next_sequence = sequence;
+    fec_last_sequence = sequence;
+    fec_started = 1;
+  }
+
+  int16_t offset = sequence - fec_next_sequence;
+  if (offset < 0) {
+    // Late or duplicate packet, unless sender was restarted
+    if (offset > -FEC_SLOT_COUNT) {
+      return;
+    }
+    fec_next_sequence = sequence;
+    fec_last_sequence = sequence;
+  } else if (offset >= FEC_SLOT_COUNT) {
+    // Too far ahead, skip everything in between
+    packets_lost += offset;
+    fec_next_sequence = sequence;
+  }
+
+  // Request packets missing before this one, each gets its own deadline
+  int16_t ahead = sequence - fec_last_sequence;
+  if (nack_wait && ahead > 1) {
+    uint64_t now = fec_get_time();
+    for (uint16_t i = 1; i < ahead && i < FEC_SLOT_COUNT; i++) {
+      uint16_t missing = fec_last_sequence + i;
+      struct FECSlot* gap = &fec_slots[missing % FEC_SLOT_COUNT];
+      gap->sequence = missing;
+      gap->valid = 0;
+      gap->missing_time = now;
+      nack_add(missing);
+    }
+  }
+
+  struct FECSlot* slot = &fec_slots[sequence % FEC_SLOT_COUNT];
+  slot->sequence = sequence;
+  slot->size = size;
+  slot->valid = 1;
+  slot->symbol[0] = size >> 8;
+  slot->symbol[1] = size & 0xFF;
+  memcpy(slot->symbol + 2, datagram, size);
+
+  if ((int16_t)(sequence - fec_last_sequence) > 0) {
+    fec_last_sequence = sequence;
+  }
+}
+
+uint32_t fec_pop(uint8_t* datagram) {
+  if (!fec_started) {
+    return 0;
+  }
+
+  while ((int16_t)(fec_last_sequence - fec_next_sequence) >= 0) {
+    struct FECSlot* slot = fec_find_slot(fec_next_sequence);
+    if (slot) {
+      fec_next_sequence++;
+      memcpy(datagram, slot->symbol + 2, slot->size);
+      return slot->size;
+    }
+
+    // Packet is missing, wait while it still may be recovered
+    if ((uint16_t)(fec_last_sequence - fec_next_sequence) < fec_hold) {
+      return 0;
+    }
+
+    // or retransmitted, a burst of losses shares one deadline and is skipped
+    // in a single pass once it passed
+    if (nack_wait) {
+      struct FECSlot* gap = &fec_slots[fec_next_sequence % FEC_SLOT_COUNT];
+      uint64_t now = fec_get_time();
+      if (gap->sequence != fec_next_sequence || !gap->missing_time) {
+        gap->sequence = fec_next_sequence;
+        gap->valid = 0;
+        gap->missing_time = now;
+      }
+
+      if (now - gap->missing_time < nack_wait) {
+        return 0;
+      }
+    }
+
+    fec_next_sequence++;
+    packets_lost++;
+  }
+
+  return 0;
+}
+
+void nack_enable(uint32_t wait) {
+  nack_wait = wait;
+}
+
+uint32_t nack_fill(struct NackMessage* message) {
+  if (!nack_count) {
+    return 0;
+  }
+
+  message->header.magic = htobe16(FEEDBACK_MAGIC);
+  message->header.type = FEEDBACK_NACK;
+  message->header.reserved = 0;
+
+  for (uint32_t i = 0; i < nack_count; i++) {
+    message->entries[i].sequence = htobe16(nack_entries[i].sequence);
+    message->entries[i].bitmask = htobe16(nack_entries[i].bitmask);
+  }
+
+  uint32_t size = sizeof(struct FeedbackHeader) + nack_count * sizeof(struct NackEntry);
+  nack_count = 0;
+  return size;
+}
+
+/* --- Receiver reports --- */
+
+static uint32_t report_started = 0;
+static uint16_t report_highest = 0;
+static uint32_t report_expected_base = 0;
+static uint32_t report_cycles = 0;
+static uint32_t report_received = 0;
+static uint32_t report_bytes = 0;
+static uint32_t report_residual_base = 0;
+static int64_t report_transit = 0;
+static int64_t report_jitter = 0;
+
+static uint32_t report_extended_highest() {
+  return report_cycles + report_highest;
+}
+
+void report_input(uint8_t* datagram, uint32_t size) {
+  if (size < FEC_RTP_HEADER || fec_is_parity(datagram)) {
+    return;
+  }
+
+  uint16_t sequence = datagram[2] << 8 | datagram[3];
+  uint32_t timestamp = datagram[4] << 24 | datagram[5] << 16 |
+    datagram[6] << 8 | datagram[7];
+
+  // Interarrival jitter in 90 kHz units, RFC 3550 A.8
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint32_t arrival = (uint64_t)now.tv_sec * 90000 + now.tv_nsec / 11111;
+  int64_t transit = (int32_t)(arrival - timestamp);
+
+  if (!report_started) {
+    report_started = 1;
+    report_highest = sequence - 1;
+    report_expected_base = report_extended_highest();
+    report_transit = transit;
+  }
+
+  // Track highest sequence number with wrap around
+  int16_t offset = sequence - report_highest;
+  if (offset > 0) {
+    if (sequence < report_highest) {
+      report_cycles += 0x10000;
+    }
+    report_highest = sequence;
+  }
+
+  report_received++;
+  report_bytes += size - FEC_RTP_HEADER;
+
+  int64_t delta = transit - report_transit;
+  if (delta < 0) {
+    delta = -delta;
+  }
+  report_jitter += (delta - report_jitter) / 16;
+  report_transit = transit;
+}
+
+int report_fill(struct ReceiverReport* report, uint32_t interval) {
+  if (!report_started || !interval) {
+    return 0;
+  }
+
+  uint32_t expected = report_extended_highest() - report_expected_base;
+  uint32_t lost = expected > report_received ? expected - report_received : 0;
+
+  memset(report, 0x00, sizeof(struct ReceiverReport));
+  report->header.magic = htobe16(FEEDBACK_MAGIC);
+  report->header.type = FEEDBACK_REPORT;
+  report->interval = htobe32(interval);
+  report->expected = htobe32(expected);
+  report->lost = htobe32(lost);
+  report->residual = htobe32(packets_lost - report_residual_base);
+  report->jitter = htobe32((uint64_t)report_jitter * 1000 / 90);
+  // Bytes per ms to Kbit/s of 1024 bit, the unit of encoder bitrate
+  report->goodput = htobe32((uint64_t)report_bytes * 8 * 1000 / 1024 / interval);
+
+  report_expected_base = report_extended_highest();
+  report_residual_base = packets_lost;
+  report_received = 0;
+  report_bytes = 0;
+  return 1;
+}
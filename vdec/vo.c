@@ -99,7 +99,8 @@ HI_HDMI_VIDEO_FMT_E VO_interfaceModeToHDMIMode(VO_INTF_SYNC_E enIntfSync) {
   }
 }
 
-int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode) {
+int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode,
+  uint8_t enable_audio) {
   // Initialize HDMI
   int ret = HI_MPI_HDMI_Init();
   if (ret != HI_SUCCESS) {
@@ -131,7 +132,7 @@ int VO_HDMI_init(HI_HDMI_ID_E device_id, VO_INTF_SYNC_E interface_mode) {
   hdmi_config.enDeepColorMode = HI_HDMI_DEEP_COLOR_OFF;
   hdmi_config.bxvYCCMode = HI_FALSE;
 
-  hdmi_config.bEnableAudio = HI_FALSE;
+  hdmi_config.bEnableAudio = enable_audio ? HI_TRUE : HI_FALSE;
   hdmi_config.enSoundIntf = HI_HDMI_SND_INTERFACE_I2S;
   hdmi_config.bIsMultiChannel = HI_FALSE;
   hdmi_config.enSampleRate = HI_HDMI_SAMPLE_RATE_48K;
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Audio stream next to video on the same sinks.
+ *
+ * Every encoded audio frame is one RTP packet with the static payload type
+ * of its codec (RFC 3551) and its own SSRC, so receivers tell it from video
+ * and FEC without parsing the payload. Timestamps run at the 8 kHz sample
+ * clock and are taken from the same PTS as video timestamps, so the ground
+ * station can play audio in step with video.
+ */
+
+#define AUDIO_SSRC 0xDEADBEF0
+#define AUDIO_SAMPLE_RATE 8000
+
+// Static RTP payload types
+#define AUDIO_PAYLOAD_PCMU 0
+#define AUDIO_PAYLOAD_DVI4 5
+#define AUDIO_PAYLOAD_PCMA 8
+
+// Largest frame, 60 ms of G.711
+#define AUDIO_MAX_FRAME 480
+
+// HiSilicon voice frame header ahead of AENC output and ADEC input:
+// 0x00 0x01, frame size in 16-bit words, little-endian
+#define AUDIO_HISI_HEADER 4
@@ -0,0 +1,101 @@
+#include "congestion.h"
+#include <string.h>
+
+// Queue fill each class is dropped at, parameter sets and IDR never are
+static const uint32_t congestion_thresholds[CONGESTION_CLASSES] = {
+  [CONGESTION_PARAMETER_SETS] = 0,
+  [CONGESTION_IDR] = 0,
+  [CONGESTION_REFERENCE] = CONGESTION_REFERENCE_FILL,
+  [CONGESTION_NON_REFERENCE] = CONGESTION_NON_REFERENCE_FILL,
+};
+
+enum CongestionClass congestion_classify(const uint8_t* nal, bool hevc, uint8_t layer) {
+  if (hevc) {
+    uint8_t type = (nal[0] >> 1) & 0x3F;
+    if (type >= 32 && type <= 34) {
+      return CONGESTION_PARAMETER_SETS;
+    }
+
+    if (type >= 16 && type <= 21) {
+      return CONGESTION_IDR;
+    }
+
+    // Even types up to RSV_VCL_N14 are sub-layer non-reference pictures
+    if (type <= 14 && !layer && (type & 1)) {
+      return CONGESTION_REFERENCE;
+    }
+
+    return CONGESTION_NON_REFERENCE;
+  }
+
+  uint8_t type = nal[0] & 0x1F;
+  if (type == 7 || type == 8) {
+    return CONGESTION_PARAMETER_SETS;
+  }
+
+  if (type == 5) {
+    return CONGESTION_IDR;
+  }
+
+  // nal_ref_idc is 0 for non-reference slices
+  if (type >= 1 && type <= 4 && !layer && (nal[0] & 0x60)) {
+    return CONGESTION_REFERENCE;
+  }
+
+  return CONGESTION_NON_REFERENCE;
+}
+
+void congestion_init(struct CongestionState* state) {
+  memset(state, 0x00, sizeof(*state));
+  state->dropped_from = CONGESTION_CLASSES;
+}
+
+void congestion_frame(struct CongestionState* state, uint32_t fill, bool blocked) {
+  if (fill > state->fill_max) {
+    state->fill_max = fill;
+  }
+
+  // Socket had no space at all
+  if (blocked) {
+    fill = 100;
+  }
+
+  // Most important class first, a class keeps being dropped until fill is
+  // well below its threshold, so dropping does not flap around it
+  enum CongestionClass dropped_from = CONGESTION_CLASSES;
+  for (uint8_t i = CONGESTION_REFERENCE; i < CONGESTION_CLASSES; i++) {
+    uint32_t threshold = congestion_thresholds[i];
+    if (state->dropped_from <= i) {
+      threshold -= CONGESTION_HYSTERESIS;
+    }
+
+    if (fill >= threshold) {
+      dropped_from = i;
+      break;
+    }
+  }
+
+  state->dropped_from = dropped_from;
+}
+
+bool congestion_admit(struct CongestionState* state, enum CongestionClass nal_class,
+  uint8_t layer) {
+  // Base layer frame ends the run of enhancement frames
+  if (!layer) {
+    state->drop_layer = 0;
+  }
+
+  // Later enhancement frames of a run reference the dropped one
+  bool drop = nal_class >= state->dropped_from ||
+    (nal_class >= CONGESTION_REFERENCE && state->drop_layer && layer >= state->drop_layer);
+  if (!drop) {
+    return true;
+  }
+
+  if (layer && (!state->drop_layer || layer < state->drop_layer)) {
+    state->drop_layer = layer;
+  }
+
+  state->dropped[nal_class]++;
+  return false;
+}
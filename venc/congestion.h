@@ -0,0 +1,77 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Sender side congestion manager.
+ *
+ * NAL units are ranked by what their loss costs the receiver: a parameter
+ * set or IDR fragment costs the whole GOP, a reference slice the rest of
+ * the GOP, a non-reference slice one frame. Kernel queue occupancy is
+ * sampled at every frame start and, once it crosses a threshold, whole NALs
+ * of the lowest classes are dropped before they are packetized, instead of
+ * the socket dropping random fragments. Decisions are made per frame, so
+ * all slices of a frame share them.
+ */
+
+// Queue fill to start dropping non-reference / reference NALs at, percent
+#define CONGESTION_NON_REFERENCE_FILL 50
+#define CONGESTION_REFERENCE_FILL 80
+
+// Dropping stops once fill is this far below the threshold, percent
+#define CONGESTION_HYSTERESIS 20
+
+// Longest wait for socket space after EAGAIN, ms
+#define CONGESTION_SEND_WAIT 20
+
+// NAL classes, most important first
+enum CongestionClass {
+  CONGESTION_PARAMETER_SETS,  // VPS, SPS, PPS
+  CONGESTION_IDR,             // IDR, H.265 IRAP
+  CONGESTION_REFERENCE,       // Slices of reference frames
+  CONGESTION_NON_REFERENCE,   // Non-reference slices, enhancement layers, SEI
+  CONGESTION_CLASSES
+};
+
+// Congestion state of one sink
+struct CongestionState {
+  enum CongestionClass dropped_from; // Classes from this one on are dropped
+  uint8_t drop_layer;         // Lowest enhancement layer being dropped, 0 - none
+  uint32_t fill_max;          // Highest queue fill, percent
+
+  // Counters
+  uint32_t dropped[CONGESTION_CLASSES]; // NALs dropped per class
+};
+
+/**
+ * @brief Rank NAL unit
+ * @param nal - NAL data without start code
+ * @param hevc - Stream is H.265
+ * @param layer - Temporal layer of the frame, 0 - base
+ * @return Class of NAL
+ */
+enum CongestionClass congestion_classify(const uint8_t* nal, bool hevc, uint8_t layer);
+
+/**
+ * @brief Reset state, nothing is dropped
+ * @param state - State
+ */
+void congestion_init(struct CongestionState* state);
+
+/**
+ * @brief Choose classes to drop for the frame that starts now
+ * @param state - State
+ * @param fill - Kernel queue fill, percent
+ * @param blocked - Socket returned EAGAIN during the previous frame
+ */
+void congestion_frame(struct CongestionState* state, uint32_t fill, bool blocked);
+
+/**
+ * @brief Decide whether NAL is sent, counts drops
+ * @param state - State
+ * @param nal_class - Class of NAL
+ * @param layer - Temporal layer of the frame, 0 - base
+ * @return true if NAL is sent
+ */
+bool congestion_admit(struct CongestionState* state, enum CongestionClass nal_class,
+  uint8_t layer);
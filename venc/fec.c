@@ -0,0 +1,117 @@
+#include "fec.h"
+#include <string.h>
+
+// GF(2^8) with polynomial x^8 + x^4 + x^3 + x^2 + 1
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul[256][256];
+
+static uint8_t gf_inverse(uint8_t value) {
+  return gf_exp[255 - gf_log[value]];
+}
+
+void fec_init() {
+  uint32_t value = 1;
+  for (uint32_t i = 0; i < 255; i++) {
+    gf_exp[i] = value;
+    gf_log[value] = i;
+
+    value <<= 1;
+    if (value & 0x100) {
+      value ^= 0x11D;
+    }
+  }
+
+  for (uint32_t i = 255; i < 512; i++) {
+    gf_exp[i] = gf_exp[i - 255];
+  }
+
+  // Full multiplication table, one row per coefficient
+  for (uint32_t a = 1; a < 256; a++) {
+    for (uint32_t b = 1; b < 256; b++) {
+      gf_mul[a][b] = gf_exp[gf_log[a] + gf_log[b]];
+    }
+  }
+}
+
+uint8_t fec_coefficient(uint8_t parity_index, uint8_t data_index) {
+  // Cauchy matrix 1 / (x + y): x = 255 - parity index never meets y = data index
+  return gf_inverse((255 - parity_index) ^ data_index);
+}
+
+void fec_encode(uint8_t* parity, const uint8_t* data, uint32_t size,
+  uint8_t coefficient) {
+  const uint8_t* row = gf_mul[coefficient];
+  for (uint32_t i = 0; i < size; i++) {
+    parity[i] ^= row[data[i]];
+  }
+}
+
+int fec_decode(uint8_t** residuals, const uint8_t* parity_index,
+  const uint8_t* missing, uint8_t count, uint8_t** output, uint32_t size) {
+  uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+  uint8_t inverse[FEC_MAX_PARITY][FEC_MAX_PARITY];
+
+  if (count > FEC_MAX_PARITY) {
+    return -1;
+  }
+
+  // Sub-matrix of generator for missing symbols, start with identity inverse
+  for (uint8_t r = 0; r < count; r++) {
+    for (uint8_t c = 0; c < count; c++) {
+      matrix[r][c] = fec_coefficient(parity_index[r], missing[c]);
+      inverse[r][c] = r == c;
+    }
+  }
+
+  // Gauss-Jordan elimination
+  for (uint8_t c = 0; c < count; c++) {
+    uint8_t pivot = c;
+    while (pivot < count && !matrix[pivot][c]) {
+      pivot++;
+    }
+
+    if (pivot == count) {
+      return -1;
+    }
+
+    if (pivot != c) {
+      uint8_t swap[FEC_MAX_PARITY];
+      memcpy(swap, matrix[c], count);
+      memcpy(matrix[c], matrix[pivot], count);
+      memcpy(matrix[pivot], swap, count);
+      memcpy(swap, inverse[c], count);
+      memcpy(inverse[c], inverse[pivot], count);
+      memcpy(inverse[pivot], swap, count);
+    }
+
+    uint8_t scale = gf_inverse(matrix[c][c]);
+    for (uint8_t i = 0; i < count; i++) {
+      matrix[c][i] = gf_mul[scale][matrix[c][i]];
+      inverse[c][i] = gf_mul[scale][inverse[c][i]];
+    }
+
+    for (uint8_t r = 0; r < count; r++) {
+      uint8_t factor = matrix[r][c];
+      if (r == c || !factor) {
+        continue;
+      }
+
+      for (uint8_t i = 0; i < count; i++) {
+        matrix[r][i] ^= gf_mul[factor][matrix[c][i]];
+        inverse[r][i] ^= gf_mul[factor][inverse[c][i]];
+      }
+    }
+  }
+
+  // Missing symbol c = sum of inverse[c][r] * residual r
+  for (uint8_t c = 0; c < count; c++) {
+    for (uint8_t r = 0; r < count; r++) {
+      if (inverse[c][r]) {
+        fec_encode(output[c], residuals[r], size, inverse[c][r]);
+      }
+    }
+  }
+
+  return 0;
+}
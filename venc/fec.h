@@ -0,0 +1,67 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Systematic Reed-Solomon erasure code over GF(2^8).
+ *
+ * Every data datagram of a block is protected as a symbol made of its 16-bit
+ * length followed by the datagram itself, zero padded to the longest symbol
+ * of the block. Parity symbol j is the sum of c(j, i) * data symbol i, where
+ * c is a Cauchy matrix, so any K of the N symbols of a block recover it.
+ */
+
+// RTP payload type and SSRC of parity packets, parity is a separate RTP
+// stream with its own sequence numbers (RFC 8627)
+#define FEC_PAYLOAD_TYPE 0x61
+#define FEC_SSRC 0xDEADBEF1
+
+// Block limits
+#define FEC_MAX_DATA 64
+#define FEC_MAX_PARITY 16
+#define FEC_MAX_DEPTH 8
+#define FEC_MAX_SYMBOL 2048
+
+#pragma pack(push, 1)
+struct FECHeader {
+  uint16_t base_sequence; // RTP sequence of the first data packet
+  uint8_t stride;         // Sequence step between data packets (interleave depth)
+  uint8_t data_count;     // Number of data packets in block
+  uint8_t parity_count;   // Number of parity packets in block
+  uint8_t parity_index;   // Index of this parity packet
+};
+#pragma pack(pop)
+
+/**
+ * @brief Build Galois field tables, must be called once before use
+ */
+void fec_init();
+
+/**
+ * @brief Get generator matrix coefficient
+ * @param parity_index - Parity symbol index
+ * @param data_index - Data symbol index
+ */
+uint8_t fec_coefficient(uint8_t parity_index, uint8_t data_index);
+
+/**
+ * @brief Accumulate data into parity symbol: parity += coefficient * data
+ * @param parity - Parity symbol
+ * @param data - Data bytes
+ * @param size - Data size
+ * @param coefficient - Generator matrix coefficient
+ */
+void fec_encode(uint8_t* parity, const uint8_t* data, uint32_t size,
+  uint8_t coefficient);
+
+/**
+ * @brief Recover missing data symbols
+ * @param residuals - Parity symbols with all received data symbols removed
+ * @param parity_index - Parity indices of residuals
+ * @param missing - Data indices of missing symbols
+ * @param count - Number of missing symbols (and residuals)
+ * @param output - Zeroed buffers for recovered symbols
+ * @param size - Symbol size
+ * @return 0 on success
+ */
+int fec_decode(uint8_t** residuals, const uint8_t* parity_index,
+  const uint8_t* missing, uint8_t count, uint8_t** output, uint32_t size);
@@ -0,0 +1,206 @@
+#include "fec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Host loss simulation for the erasure code.
+ *
+ * Every trial encodes one block of random datagrams, loses a random subset
+ * of its N symbols and recovers the data from what is left, the way the
+ * ground station does: received data is removed from received parity and
+ * the residuals are decoded. Up to P losses must recover byte-exact, more
+ * than P must be refused without touching the output.
+ */
+
+#define TRIALS 2000
+#define MAX_DATAGRAM 1400
+
+struct Block {
+  uint8_t data_count;
+  uint8_t parity_count;
+  uint32_t symbol_size;
+  uint8_t data[FEC_MAX_DATA][FEC_MAX_SYMBOL];
+  uint8_t parity[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+};
+
+static struct Block block;
+static uint8_t received[FEC_MAX_DATA + FEC_MAX_PARITY];
+static uint8_t residual[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+static uint8_t recovered[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+
+static void encode_block(uint8_t data_count, uint8_t parity_count) {
+  memset(&block, 0x00, sizeof(block));
+  block.data_count = data_count;
+  block.parity_count = parity_count;
+
+  // Symbol is 16-bit length and datagram, padded to the longest one
+  for (uint8_t i = 0; i < data_count; i++) {
+    uint32_t size = 12 + rand() % (MAX_DATAGRAM - 12);
+    block.data[i][0] = size >> 8;
+    block.data[i][1] = size & 0xFF;
+    for (uint32_t j = 0; j < size; j++) {
+      block.data[i][2 + j] = rand();
+    }
+
+    if (size + 2 > block.symbol_size) {
+      block.symbol_size = size + 2;
+    }
+  }
+
+  for (uint8_t p = 0; p < parity_count; p++) {
+    for (uint8_t i = 0; i < data_count; i++) {
+      fec_encode(block.parity[p], block.data[i], block.symbol_size,
+        fec_coefficient(p, i));
+    }
+  }
+}
+
+static void lose_symbols(uint8_t lost) {
+  uint8_t total = block.data_count + block.parity_count;
+  memset(received, 1, total);
+  while (lost) {
+    uint8_t index = rand() % total;
+    if (received[index]) {
+      received[index] = 0;
+      lost--;
+    }
+  }
+}
+
+/**
+ * @brief Recover lost data of the block from received symbols
+ * @return Number of recovered symbols, -1 if block can not be recovered
+ */
+static int recover_block() {
+  uint8_t missing[FEC_MAX_PARITY];
+  uint8_t parity_index[FEC_MAX_PARITY];
+  uint8_t count = 0;
+  uint8_t available = 0;
+
+  for (uint8_t p = 0; p < block.parity_count; p++) {
+    if (received[block.data_count + p]) {
+      parity_index[available++] = p;
+    }
+  }
+
+  for (uint8_t i = 0; i < block.data_count; i++) {
+    if (received[i]) {
+      continue;
+    }
+
+    if (count == available) {
+      return -1;
+    }
+
+    missing[count++] = i;
+  }
+
+  uint8_t* residuals[FEC_MAX_PARITY];
+  uint8_t* output[FEC_MAX_PARITY];
+  for (uint8_t r = 0; r < count; r++) {
+    memcpy(residual[r], block.parity[parity_index[r]], block.symbol_size);
+    for (uint8_t i = 0; i < block.data_count; i++) {
+      if (received[i]) {
+        fec_encode(residual[r], block.data[i], block.symbol_size,
+          fec_coefficient(parity_index[r], i));
+      }
+    }
+
+    memset(recovered[r], 0x00, block.symbol_size);
+    residuals[r] = residual[r];
+    output[r] = recovered[r];
+  }
+
+  if (fec_decode(residuals, parity_index, missing, count, output, block.symbol_size)) {
+    return -1;
+  }
+
+  for (uint8_t c = 0; c < count; c++) {
+    if (memcmp(recovered[c], block.data[missing[c]], block.symbol_size)) {
+      printf("FAIL: K = %d, P = %d, data symbol %d differs\n", block.data_count,
+        block.parity_count, missing[c]);
+      exit(1);
+    }
+  }
+
+  return count;
+}
+
+static uint32_t test_losses(uint8_t data_count, uint8_t parity_count) {
+  uint32_t recovered_total = 0;
+  for (uint32_t trial = 0; trial < TRIALS; trial++) {
+    encode_block(data_count, parity_count);
+
+    // Up to P lost symbols anywhere in the block are always recovered
+    lose_symbols(rand() % (parity_count + 1));
+    int count = recover_block();
+    if (count < 0) {
+      printf("FAIL: K = %d, P = %d, recoverable block refused\n", data_count,
+        parity_count);
+      exit(1);
+    }
+    recovered_total += count;
+
+    // More than P lost symbols are refused, at least one of them is data
+    uint8_t total = data_count + parity_count;
+    uint8_t lost = parity_count + 1 + rand() % (total - parity_count);
+    lose_symbols(lost > total ? total : lost);
+    if (recover_block() >= 0) {
+      printf("FAIL: K = %d, P = %d, %d lost symbols recovered\n", data_count,
+        parity_count, lost);
+      exit(1);
+    }
+  }
+
+  return recovered_total;
+}
+
+static void test_singular() {
+  // Same parity twice gives a singular system, output must stay untouched
+  encode_block(8, 2);
+  uint8_t parity_index[2] = {1, 1};
+  uint8_t missing[2] = {0, 1};
+  uint8_t* residuals[2] = {block.parity[1], block.parity[1]};
+  uint8_t* output[2] = {recovered[0], recovered[1]};
+  memset(recovered, 0x00, sizeof(recovered));
+
+  if (!fec_decode(residuals, parity_index, missing, 2, output, block.symbol_size)) {
+    printf("FAIL: singular system decoded\n");
+    exit(1);
+  }
+
+  for (uint32_t i = 0; i < block.symbol_size; i++) {
+    if (recovered[0][i] || recovered[1][i]) {
+      printf("FAIL: output written by failed decode\n");
+      exit(1);
+    }
+  }
+
+  // More missing symbols than parity can exist
+  uint8_t many[FEC_MAX_PARITY + 1] = {0};
+  if (!fec_decode(residuals, many, many, FEC_MAX_PARITY + 1, output, block.symbol_size)) {
+    printf("FAIL: %d missing symbols accepted\n", FEC_MAX_PARITY + 1);
+    exit(1);
+  }
+}
+
+int main() {
+  static const uint8_t settings[][2] = {
+    {1, 1}, {4, 1}, {4, 2}, {8, 2}, {8, 4}, {16, 4}, {32, 8},
+    {FEC_MAX_DATA, FEC_MAX_PARITY}
+  };
+
+  srand(1);
+  fec_init();
+
+  for (uint32_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+    uint32_t count = test_losses(settings[i][0], settings[i][1]);
+    printf("> K = %d, P = %d: %d trials, %d symbols recovered\n", settings[i][0],
+      settings[i][1], TRIALS, count);
+  }
+
+  test_singular();
+  printf("> FEC tests passed\n");
+  return 0;
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Feedback messages sent by the ground station back to the encoder over UDP.
+ * Every message starts with a common header, multi-byte fields are big-endian.
+ */
+
+#define FEEDBACK_MAGIC 0x4642
+
+// Message types
+#define FEEDBACK_REPORT 1
+#define FEEDBACK_NACK 2
+#define FEEDBACK_KEYFRAME 3     // Header only, receiver can't decode until IDR
+#define FEEDBACK_PING 4
+#define FEEDBACK_PONG 5
+#define FEEDBACK_PARAMETER_SETS 6 // Header only, receiver has no parameter sets
+
+// Maximum number of entries in one NACK message
+#define NACK_MAX_ENTRIES 32
+
+#pragma pack(push, 1)
+struct FeedbackHeader {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t reserved;
+};
+
+// Statistics of RTP data packets received since the previous report
+struct ReceiverReport {
+  struct FeedbackHeader header;
+  uint32_t interval;      // Report interval, ms
+  uint32_t expected;      // Packets expected from RTP sequence numbers
+  uint32_t lost;          // Packets lost on link
+  uint32_t residual;      // Packets still lost after FEC recovery
+  uint32_t jitter;        // Interarrival jitter (RFC 3550), us
+  uint32_t goodput;       // Received payload rate, Kbit/s of 1024 bit like venc rates
+};
+
+// Lost packet and a bitmask of lost packets following it (RFC 4585 generic NACK)
+struct NackEntry {
+  uint16_t sequence;
+  uint16_t bitmask;       // Bit i set - packet sequence + i + 1 is lost too
+};
+
+// Retransmission request, entry count is taken from message size
+struct NackMessage {
+  struct FeedbackHeader header;
+  struct NackEntry entries[NACK_MAX_ENTRIES];
+};
+// Clock offset probe, NTP-style: ground origin time is echoed back together
+// with encoder receive and transmit times, all in us of the sender's clock
+struct ClockPing {
+  struct FeedbackHeader header;
+  uint64_t origin;        // Ground time of ping
+};
+
+struct ClockPong {
+  struct FeedbackHeader header;
+  uint64_t origin;        // Copied from ping
+  uint64_t receive;       // Encoder time ping was received
+  uint64_t transmit;      // Encoder time pong was sent
+};
+
+// Frame timing inserted by encoder as user data SEI, describes the frame
+// preceding the one it is attached to. Times are encoder MPI PTS, us
+#define LATENCY_MAGIC 0x4732474C
+
+struct LatencyRecord {
+  uint32_t magic;
+  uint32_t frame;         // Frame counter
+  uint64_t capture;       // VI capture PTS, RTP timestamp is derived from it
+  uint64_t encoded;       // Time frame was taken from encoder
+};
+#pragma pack(pop)
@@ -0,0 +1,554 @@
+#include "main.h"
+#include <signal.h>
+#include <sys/resource.h>
+
+/*
+ * File source: feeds a raw H.264 / H.265 elementary stream through the same
+ * Tx ring and packetizer as the encoder, without any MPI. Builds on a host
+ * (make venc-file) to benchmark packetization and to test receivers.
+ */
+
+#define FILE_MAX_NALS 256
+
+// Latency model of the file at nominal frame rate
+bool budget_enabled = false;
+struct LatencyBudgetConfig budget_config;
+struct LatencyModel budget_model;
+uint64_t budget_bytes = 0;
+uint32_t budget_keyframes = 0;
+
+void printHelp() {
+  printf(
+    "\n\t\tOpenIPC FPV Streamer, file source (%s)\n"
+    "\n"
+    "  Usage:\n"
+    "    venc-file -i [File] [Arguments]\n"
+    "\n"
+    "  Arguments:\n"
+    "    -i [File]      - Raw .h264 / .h265 stream\n"
+    "    -c [Codec]     - h264 or h265          (Default: by file extension)\n"
+    "    -f [FPS]       - Frame rate            (Default: 60)\n"
+    "    --max-speed    - Send frames as fast as possible\n"
+    "    --loop [N]     - Send file N times, 0 - forever (Default: 1)\n"
+    "\n"
+    "    -h [IP]        - Sink IP address       (Default: 127.0.0.1)\n"
+    "    -p [Port]      - Sink port             (Default: 5000)\n"
+    "    -r [Rate]      - Rate for pacing in Kbit/sec. (Default: 8192)\n"
+    "    -n [Size]      - Max payload frame size in bytes (Default: 1400)\n"
+    "    --mtu [Size]   - Path MTU, overrides -n (Default: 1500)\n"
+    "    -m [Mode]      - compact or rtp        (Default: compact)\n"
+    "    --fec [K:N]    - FEC, K data of N packets (RTP) (Default: off)\n"
+    "    --fec-depth [D] - FEC interleave depth (Default: 1)\n"
+    "    --sink [Sink]  - Additional sink, up to %d, same format as venc\n"
+    "    --packet [If[:radiotap]] - Send through AF_PACKET ring on interface\n"
+    "    --pace [Percent] - Spread frame over %% of interval (Default: off)\n"
+    "    --pace-burst [N] - Packets sent without pacing (Default: 4)\n"
+    "    --sender-cpu [N] - Pin sender thread to CPU core (Default: off)\n"
+    "    --tx-mode [Mode] - plain, batch or gso (Default: batch)\n"
+    "    --ps-interval [Ms] - Re-send cached parameter sets (Default: 1000)\n"
+    "    --svc-t        - Mark temporal layers (RTP), layer is H.265\n"
+    "                     TemporalId or 1 for H.264 non-reference frames\n"
+    "    --latency-budget [Ms:Link] - Model queueing delay of the file on a\n"
+    "                     Link Kbit/sec. link with a Ms frame budget\n"
+    "\n", __DATE__, MAX_SINKS - 1
+  );
+}
+
+static void handler(int value) {
+  (void)value;
+  loop_running = false;
+}
+
+/**
+ * @brief Find next Annex B start code
+ * @return Offset of start code, size if there is none
+ */
+uint32_t findStartCode(const uint8_t* data, uint32_t size, uint32_t offset) {
+  for (uint32_t i = offset; i + 3 <= size; i++) {
+    if (!data[i] && !data[i + 1] && data[i + 2] == 1) {
+      return i;
+    }
+  }
+  return size;
+}
+
+/**
+ * @brief Check if NAL unit begins a new access unit after picture data
+ */
+bool isAccessUnitStart(const uint8_t* nal, uint32_t size, bool hevc) {
+  if (size < 3) {
+    return false;
+  }
+
+  if (hevc) {
+    uint8_t type = (nal[0] >> 1) & 0x3F;
+    if (type < 32) {
+      // first_slice_segment_in_pic_flag
+      return nal[2] & 0x80;
+    }
+    return type == 32 || type == 33 || type == 34 || type == 35 || type == 39;
+  }
+
+  uint8_t type = nal[0] & 0x1F;
+  if (type >= 1 && type <= 5) {
+    // first_mb_in_slice is 0
+    return nal[1] & 0x80;
+  }
+  return type == 6 || type == 7 || type == 8 || type == 9;
+}
+
+bool isPicture(const uint8_t* nal, bool hevc) {
+  return hevc ? ((nal[0] >> 1) & 0x3F) < 32 : (nal[0] & 0x1F) >= 1 && (nal[0] & 0x1F) <= 5;
+}
+
+/**
+ * @brief Temporal layer of a picture NAL, encoder output carries it in stream info
+ */
+uint8_t getNalLayer(const uint8_t* nal, bool hevc, bool* independent) {
+  if (hevc) {
+    uint8_t type = (nal[0] >> 1) & 0x3F;
+    *independent = type >= 16 && type <= 21;
+    uint8_t temporal_id = nal[1] & 0x07;
+    return temporal_id ? MIN2(temporal_id - 1, MAX_TEMPORAL_LAYER) : 0;
+  }
+
+  *independent = (nal[0] & 0x1F) == 5;
+  return (nal[0] & 0x60) ? 0 : 1;
+}
+
+/**
+ * @brief Queue access unit in the latency model
+ */
+void modelAccessUnit(uint8_t** nals, uint32_t* sizes, uint32_t count, bool hevc) {
+  uint32_t size = 0;
+  bool keyframe = false;
+  for (uint32_t i = 0; i < count; i++) {
+    bool independent = false;
+    if (isPicture(nals[i], hevc)) {
+      getNalLayer(nals[i], hevc, &independent);
+    }
+
+    keyframe |= independent;
+    size += sizes[i] + 4;
+  }
+
+  latency_model_frame(&budget_config, &budget_model, size);
+  budget_bytes += size;
+  budget_keyframes += keyframe;
+}
+
+/**
+ * @brief Push access unit into Tx ring, waits while sender is behind
+ * @return Number of waits for free space
+ */
+uint32_t pushAccessUnit(uint8_t** nals, uint32_t* sizes, uint32_t count,
+  uint8_t* pack, uint64_t pts, bool hevc) {
+  uint32_t waits = 0;
+  uint8_t layer = 0;
+  bool independent = false;
+  for (uint32_t i = 0; i < count; i++) {
+    if (isPicture(nals[i], hevc)) {
+      layer = getNalLayer(nals[i], hevc, &independent);
+      break;
+    }
+  }
+
+  for (uint32_t i = 0; i < count && loop_running; i++) {
+    // Packs carry 4 byte start code like encoder output
+    pack[0] = 0;
+    pack[1] = 0;
+    pack[2] = 0;
+    pack[3] = 1;
+    memcpy(pack + 4, nals[i], sizes[i]);
+
+    bool last = i + 1 == count;
+    while (pushPack(pack, sizes[i] + 4, pts, last, last, layer, independent) &&
+        loop_running) {
+      waits++;
+      usleep(100);
+    }
+  }
+
+  uint64_t event_value = 1;
+  write(tx_ring_event, &event_value, sizeof(event_value));
+  return waits;
+}
+
+int main(int argc, const char* argv[]) {
+  const char* input_path = NULL;
+  int codec = 0;
+  uint32_t framerate = 60;
+  bool max_speed = false;
+  uint32_t loop_count = 1;
+  uint32_t udp_sink_ip = inet_addr("127.0.0.1");
+  uint16_t udp_sink_port = 5000;
+  uint32_t max_rate = 1024 * 8;
+  uint16_t max_frame_size = 1400;
+  bool limit_to_mtu = false;
+  uint32_t path_mtu = 1500;
+  uint8_t fec_data_count = 0;
+  uint8_t fec_parity_count = 0;
+  uint8_t fec_depth = 1;
+  const char* sink_options[MAX_SINKS];
+  int sender_cpu = -1;
+
+  __BeginParseConsoleArguments__(printHelp)
+  __OnArgument("-i") {
+    input_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("-c") {
+    const char* value = __ArgValue;
+    if (!strcmp(value, "h264")) {
+      codec = 264;
+    } else if (!strcmp(value, "h265")) {
+      codec = 265;
+    } else {
+      printf("> ERROR: Unsupported codec [%s]\n", value);
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("-f") {
+    framerate = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--max-speed") {
+    max_speed = true;
+    continue;
+  }
+
+  __OnArgument("--ps-interval") {
+    ps_interval = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--svc-t") {
+    layer_marking = true;
+    continue;
+  }
+
+  __OnArgument("--latency-budget") {
+    uint32_t budget = 0, link_rate = 0;
+    int count = sscanf(__ArgValue, "%u:%u", &budget, &link_rate);
+    if (count < 2 || !budget || !link_rate) {
+      printf("> ERROR: Latency budget must be Ms:Link in Kbit/sec.\n");
+      return 1;
+    }
+
+    budget_enabled = true;
+    budget_config.budget = budget;
+    budget_config.link_rate = link_rate;
+    continue;
+  }
+
+  __OnArgument("--loop") {
+    loop_count = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-h") {
+    udp_sink_ip = inet_addr(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-p") {
+    udp_sink_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-r") {
+    max_rate = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("-n") {
+    max_frame_size = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--mtu") {
+    path_mtu = atoi(__ArgValue);
+    limit_to_mtu = true;
+    continue;
+  }
+
+  __OnArgument("-m") {
+    const char* value = __ArgValue;
+    if (!strcmp(value, "compact")) {
+      stream_mode = 0;
+    } else if (!strcmp(value, "rtp")) {
+      stream_mode = 1;
+    } else {
+      printf("> ERROR: Unsupported streaming mode [%s]\n", value);
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("--fec") {
+    if (parseFEC(__ArgValue, &fec_data_count, &fec_parity_count)) {
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("--fec-depth") {
+    fec_depth = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--tx-mode") {
+    if (parseTxMode(__ArgValue)) {
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("--packet") {
+    if (parsePacketInterface(&sinks[0], __ArgValue)) {
+      return 1;
+    }
+    continue;
+  }
+
+  __OnArgument("--sink") {
+    if (sink_count == MAX_SINKS) {
+      printf("> ERROR: Too many sinks, up to %d are supported\n", MAX_SINKS - 1);
+      return 1;
+    }
+    sink_options[sink_count++] = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--pace") {
+    pace_percent = atoi(__ArgValue);
+    if (pace_percent > 100) {
+      pace_percent = 100;
+    }
+    continue;
+  }
+
+  __OnArgument("--pace-burst") {
+    pace_burst = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--sender-cpu") {
+    sender_cpu = atoi(__ArgValue);
+    continue;
+  }
+
+  __EndParseConsoleArguments__
+
+  if (!input_path) {
+    printf("> ERROR: Input file is not set\n");
+    return 1;
+  }
+
+  if (!codec) {
+    const char* extension = strrchr(input_path, '.');
+    codec = extension && (!strcmp(extension, ".h265") || !strcmp(extension, ".hevc")) ? 265 : 264;
+  }
+
+  if (!framerate) {
+    framerate = 60;
+  }
+
+  // Whole file is kept in memory, reading must not disturb timing
+  FILE* input = fopen(input_path, "rb");
+  if (!input) {
+    printf("ERROR: Unable to open [%s]: %s\n", input_path, strerror(errno));
+    return 1;
+  }
+
+  fseek(input, 0, SEEK_END);
+  long file_size = ftell(input);
+  fseek(input, 0, SEEK_SET);
+
+  uint8_t* data = malloc(file_size > 0 ? file_size : 1);
+  if (!data || fread(data, 1, file_size, input) != (size_t)file_size) {
+    printf("ERROR: Unable to read [%s]\n", input_path);
+    return 1;
+  }
+  fclose(input);
+
+  // Same sink setup as encoder
+  stream_codec = codec == 265 ? PT_H265 : PT_H264;
+  struct Sink* main_sink = &sinks[0];
+  main_sink->address.sin_family = AF_INET;
+  main_sink->address.sin_port = htons(udp_sink_port);
+  main_sink->address.sin_addr.s_addr = udp_sink_ip;
+  main_sink->mode = stream_mode;
+  main_sink->mtu = path_mtu;
+  main_sink->limit_to_mtu = limit_to_mtu;
+  main_sink->max_size = max_frame_size;
+  main_sink->fec_data_count = fec_data_count;
+  main_sink->fec_parity_count = fec_parity_count;
+  main_sink->fec_depth = fec_depth;
+
+  for (uint8_t i = 1; i < sink_count; i++) {
+    if (parseSink(&sinks[i], main_sink, sink_options[i])) {
+      return 1;
+    }
+  }
+
+  tx_max_rate = max_rate;
+  pace_framerate = framerate;
+  for (uint8_t i = 0; i < sink_count; i++) {
+    if (setupSink(&sinks[i], i)) {
+      return 1;
+    }
+  }
+
+  metrics_init(&metrics_state, codec == 265, sinks[0].max_size);
+
+  budget_config.framerate = framerate;
+  budget_config.payload = main_sink->max_size;
+  for (uint8_t i = 1; i < sink_count; i++) {
+    budget_config.payload = MIN2(budget_config.payload, sinks[i].max_size);
+  }
+
+  if (pace_percent) {
+    setPaceRate(max_rate);
+  }
+
+  int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  for (uint8_t i = 0; i < sink_count; i++) {
+    sinks[i].socket_handle = socket_handle;
+  }
+
+  if (tx_mode == TX_MODE_GSO && enableGSO(socket_handle)) {
+    tx_mode = TX_MODE_BATCH;
+  }
+
+  pthread_t sender_thread;
+  if (startSender(&sender_thread, sender_cpu)) {
+    return 1;
+  }
+
+  printf("> Streaming [%s], H%d, %d fps%s\n", input_path, codec, framerate,
+    max_speed ? ", max speed" : "");
+  signal(SIGINT, handler);
+
+  uint8_t* pack = malloc(file_size + 4);
+  uint8_t* nals[FILE_MAX_NALS];
+  uint32_t sizes[FILE_MAX_NALS];
+  uint32_t nal_count = 0;
+  bool has_picture = false;
+  uint64_t frames = 0;
+  uint64_t waits = 0;
+  uint64_t interval = 1000000000ULL / framerate;
+
+  struct rusage usage_start;
+  getrusage(RUSAGE_SELF, &usage_start);
+  uint64_t start_ns = getNanoseconds(CLOCK_MONOTONIC);
+
+  for (uint32_t pass = 0; loop_running && (!loop_count || pass < loop_count); pass++) {
+    uint32_t offset = findStartCode(data, file_size, 0);
+    while (offset < file_size && loop_running) {
+      uint32_t nal_start = offset + 3;
+      uint32_t next = findStartCode(data, file_size, nal_start);
+
+      // Trailing zero belongs to the next 4 byte start code
+      uint32_t nal_end = next;
+      while (nal_end > nal_start && next < file_size && !data[nal_end - 1]) {
+        nal_end--;
+      }
+
+      uint8_t* nal = data + nal_start;
+      uint32_t nal_size = nal_end - nal_start;
+      offset = next;
+      if (!nal_size) {
+        continue;
+      }
+
+      // Previous access unit is complete
+      if (has_picture && (nal_count == FILE_MAX_NALS ||
+          isAccessUnitStart(nal, nal_size, codec == 265))) {
+        if (!max_speed) {
+          uint64_t deadline = start_ns + frames * interval;
+          struct timespec wake = {deadline / 1000000000, deadline % 1000000000};
+          clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        }
+
+        if (budget_enabled) {
+          modelAccessUnit(nals, sizes, nal_count, codec == 265);
+        }
+
+        waits += pushAccessUnit(nals, sizes, nal_count, pack, frames * 1000000 / framerate,
+      codec == 265);
+        frames++;
+        nal_count = 0;
+        has_picture = false;
+      }
+
+      nals[nal_count] = nal;
+      sizes[nal_count] = nal_size;
+      nal_count++;
+      has_picture |= isPicture(nal, codec == 265);
+    }
+  }
+
+  if (nal_count && loop_running) {
+    if (budget_enabled) {
+      modelAccessUnit(nals, sizes, nal_count, codec == 265);
+    }
+
+    waits += pushAccessUnit(nals, sizes, nal_count, pack, frames * 1000000 / framerate,
+      codec == 265);
+    frames++;
+  }
+
+  // Let sender finish with the ring
+  while (loop_running && !isTxRingEmpty()) {
+    usleep(1000);
+  }
+
+  loop_running = false;
+  stopSender(sender_thread);
+
+  uint64_t end_ns = getNanoseconds(CLOCK_MONOTONIC);
+  struct rusage usage_end;
+  getrusage(RUSAGE_SELF, &usage_end);
+
+  double elapsed = (end_ns - start_ns) / 1000000000.;
+  double cpu = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+    (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1000000. +
+    (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+    (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1000000.;
+  double mbits = bytes_total * 8 / 1000000.;
+
+  printf("> Sent %llu frames, %llu packets, %.2f Mbit in %.2f sec. | "
+    "%.1f fps, %.0f pps, %.2f Mbit/sec. | CPU %.3f sec., %.2f ms per Mbit, %.0f ns per packet | "
+    "Ring waits: %llu\n",
+    (unsigned long long)frames, (unsigned long long)packets_total, mbits, elapsed,
+    frames / elapsed, packets_total / elapsed, mbits / elapsed,
+    cpu, mbits ? cpu * 1000 / mbits : 0., packets_total ? cpu * 1e9 / packets_total : 0.,
+    (unsigned long long)waits);
+
+  if (budget_enabled && budget_model.frames) {
+    // Limits the encoder would get for the rate and GOP of this file
+    budget_config.bitrate = budget_bytes * 8 * framerate / 1024 / budget_model.frames;
+    budget_config.gop = budget_model.frames / MAX2(budget_keyframes, 1);
+
+    struct LatencyBudgetLimits limits;
+    latency_budget_limits(&budget_config, &limits);
+    printf("> Latency model: worst delay %u us, %llu of %llu frames above %u ms | "
+      "At %u Kbit/sec., GOP %u: max frame %u bytes, I/P ratio <= %u, IP dQp = %d, "
+      "predicted worst delay %u us%s\n",
+      budget_model.worst, (unsigned long long)budget_model.over_budget,
+      (unsigned long long)budget_model.frames, budget_config.budget,
+      budget_config.bitrate, budget_config.gop, limits.max_frame, limits.max_iprop,
+      limits.ip_qp_delta, latency_budget_worst_delay(&budget_config, &limits),
+      limits.feasible ? "" : ", average frame does not fit");
+  }
+
+  close(socket_handle);
+  free(pack);
+  free(data);
+  return 0;
+}
@@ -0,0 +1,117 @@
+#include "latency_budget.h"
+
+/**
+ * @brief Frame size on the wire with datagram headers
+ */
+static uint64_t latency_wire_size(const struct LatencyBudgetConfig* config, uint64_t size) {
+  uint32_t payload = config->payload ? config->payload : 1;
+  return size + (size + payload - 1) / payload * LATENCY_PACKET_OVERHEAD;
+}
+
+void latency_budget_limits(const struct LatencyBudgetConfig* config,
+  struct LatencyBudgetLimits* limits) {
+  uint64_t payload = config->payload ? config->payload : 1;
+  uint32_t gop = config->gop ? config->gop : 1;
+
+  // Kbit is 1024 bits like the encoder rate
+  uint64_t budget_bytes = (uint64_t)config->link_rate * 128 * config->budget / 1000;
+  uint64_t packets = (budget_bytes + payload + LATENCY_PACKET_OVERHEAD - 1) /
+    (payload + LATENCY_PACKET_OVERHEAD);
+  uint64_t overhead = packets * LATENCY_PACKET_OVERHEAD;
+
+  // Budget too short to carry even the headers of a single datagram
+  uint64_t max_frame = budget_bytes > overhead ? budget_bytes - overhead : 0;
+  uint64_t average = (uint64_t)config->bitrate * 128 / config->framerate;
+  uint64_t gop_bytes = average * gop;
+
+  // I frame at ratio R to P frames takes R / (R + GOP - 1) of GOP bits
+  uint64_t max_iprop = 100;
+  if (gop == 1) {
+    max_iprop = 1;
+  } else if (gop_bytes > max_frame) {
+    max_iprop = max_frame * (gop - 1) / (gop_bytes - max_frame);
+  }
+
+  if (max_iprop < 1) {
+    max_iprop = 1;
+  }
+
+  if (max_iprop > 100) {
+    max_iprop = 100;
+  }
+
+  // Frame size about halves every 6 QP, so every sqrt(2) the ratio is
+  // below the natural one takes 3 off the delta
+  int32_t delta = LATENCY_NATURAL_QP_DELTA;
+  uint64_t ratio = max_iprop * 100;
+  while (ratio < LATENCY_NATURAL_IPROP * 100 && delta > LATENCY_MIN_QP_DELTA) {
+    ratio = ratio * 141 / 100;
+    delta -= 3;
+  }
+
+  if (delta < LATENCY_MIN_QP_DELTA) {
+    delta = LATENCY_MIN_QP_DELTA;
+  }
+
+  limits->max_frame = max_frame;
+  limits->average_p = gop_bytes / (max_iprop + gop - 1);
+  limits->i_frame_bits = max_frame * 8;
+  limits->p_frame_bits = max_frame * 8;
+  limits->max_iprop = max_iprop;
+  limits->ip_qp_delta = delta;
+  limits->max_qp = 51;
+  limits->reencode_times = LATENCY_REENCODE_TIMES;
+
+  // Average frame must fit and the link must keep up with the encoder
+  limits->feasible = average <= max_frame &&
+    latency_wire_size(config, (uint64_t)config->bitrate * 128) <= (uint64_t)config->link_rate * 128;
+}
+
+uint32_t latency_model_frame(const struct LatencyBudgetConfig* config,
+  struct LatencyModel* model, uint32_t size) {
+  uint64_t interval = 1000000000ULL / config->framerate;
+  if (model->frames) {
+    model->backlog = model->backlog > interval ? model->backlog - interval : 0;
+  }
+
+  uint64_t transmit = latency_wire_size(config, size) * 8 * 1000000000ULL /
+    ((uint64_t)config->link_rate * 1024);
+  if (transmit > (uint64_t)config->budget * 1000000) {
+    model->over_budget++;
+  }
+
+  model->backlog += transmit;
+  model->frames++;
+
+  uint32_t delay = model->backlog / 1000;
+  if (delay > model->worst) {
+    model->worst = delay;
+  }
+
+  return delay;
+}
+
+uint32_t latency_budget_worst_delay(const struct LatencyBudgetConfig* config,
+  const struct LatencyBudgetLimits* limits) {
+  uint32_t gop = config->gop ? config->gop : 1;
+  uint64_t i_frame = (uint64_t)limits->average_p * limits->max_iprop;
+  if (i_frame > limits->max_frame) {
+    i_frame = limits->max_frame;
+  }
+
+  // Two GOPs, so backlog left by the first one is seen by the second
+  struct LatencyModel model = {0};
+  for (uint32_t i = 0; i < gop * 2; i++) {
+    uint32_t position = i % gop;
+    uint32_t size = limits->average_p;
+    if (!position) {
+      size = i_frame;
+    } else if (position == 1) {
+      size = limits->max_frame;
+    }
+
+    latency_model_frame(config, &model, size);
+  }
+
+  return model.worst;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Latency bounded frame size limits.
+ *
+ * A frame may take at most the budget to leave over the link, so no frame
+ * may be larger than link rate x budget. I frames are held below that cap by
+ * the largest I / P size ratio the rate control may use, a smaller IP QP
+ * delta and super frame re-encoding, P frames by the same cap. The queue
+ * model drains frames at link rate, one arriving every frame interval, and
+ * reports how long the last byte of a frame waits after its arrival.
+ */
+
+// Wire overhead per datagram: IPv4, UDP and RTP headers, bytes
+#define LATENCY_PACKET_OVERHEAD 40
+
+// I / P size ratio the encoder reaches with the default IP QP delta
+#define LATENCY_NATURAL_IPROP 10
+#define LATENCY_NATURAL_QP_DELTA 4
+#define LATENCY_MIN_QP_DELTA -10
+
+// Re-encodes of a frame above its threshold, each costs encoder time
+#define LATENCY_REENCODE_TIMES 1
+
+// Link and encoder configuration
+struct LatencyBudgetConfig {
+  uint32_t link_rate;         // Link rate, Kbit/s
+  uint32_t budget;            // Longest transmit time of one frame, ms
+  uint32_t bitrate;           // Encoder rate, Kbit/s
+  uint32_t framerate;         // Frames per second
+  uint32_t gop;               // Frames per GOP, I frame included
+  uint32_t payload;           // Datagram payload, bytes
+};
+
+// Encoder settings derived from the budget
+struct LatencyBudgetLimits {
+  uint32_t max_frame;         // Largest frame leaving within budget, bytes
+  uint32_t average_p;         // Average P frame at encoder rate, bytes
+  uint32_t i_frame_bits;      // Super I frame threshold, bits
+  uint32_t p_frame_bits;      // Super P frame threshold, bits
+  uint32_t max_iprop;         // Largest I / P size ratio, 1..100
+  int32_t ip_qp_delta;        // I frame QP below P frame QP
+  uint32_t max_qp;            // Highest QP of I and P frames
+  int32_t reencode_times;     // Re-encodes of a super frame
+  bool feasible;              // Average frame fits budget
+};
+
+// Queue state, carried from one frame to the next
+struct LatencyModel {
+  uint64_t backlog;           // Transmit time left at last arrival, ns
+  uint64_t frames;
+  uint64_t over_budget;       // Frames whose own transmit time is above budget
+  uint32_t worst;             // Longest delay, us
+};
+
+/**
+ * @brief Derive encoder settings, has no side effects
+ * @param config - Link and encoder configuration
+ * @param limits - Settings
+ */
+void latency_budget_limits(const struct LatencyBudgetConfig* config,
+  struct LatencyBudgetLimits* limits);
+
+/**
+ * @brief Queue one frame
+ * @param config - Link and encoder configuration
+ * @param model - Queue state, zeroed before the first frame
+ * @param size - Encoded frame size, bytes
+ * @return Time from frame arrival until its last byte left, us
+ */
+uint32_t latency_model_frame(const struct LatencyBudgetConfig* config,
+  struct LatencyModel* model, uint32_t size);
+
+/**
+ * @brief Predict worst case delay with frames at their limits: an I frame at
+ *        its threshold, a scene change P frame at the cap right after it and
+ *        the rest of the GOP at the average P frame size
+ * @param config - Link and encoder configuration
+ * @param limits - Settings from latency_budget_limits
+ * @return Longest time from frame arrival until its last byte left, us
+ */
+uint32_t latency_budget_worst_delay(const struct LatencyBudgetConfig* config,
+  const struct LatencyBudgetLimits* limits);
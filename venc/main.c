@@ -17,9 +17,6 @@ extern VI_PIPE_ATTR_S PIPE_ATTR_RAW12_420_3DNR_RFR;
 extern ISP_PUB_ATTR_S ISP_PROFILE_IMX307_MIPI_2M_30FPS;
 extern ISP_PUB_ATTR_S ISP_PROFILE_IMX307_MIPI_2M_30FPS_WDR2TO1_LINE;
 
-uint8_t* tx_buffer;
-uint32_t tx_buffer_used = 0;
-
 void printHelp() {
   printf(
     "\n\t\tOpenIPC FPV Streamer for HiSilicon/Goke (%s)\n"
@@ -49,11 +46,61 @@ void printHelp() {
     "    -p [Port]      - Sink port                       (Default: 5000)\n"
     "    -r [Rate]      - Max video rate in Kbit/sec.     (Default: 8192)\n"
     "    -n [Size]      - Max payload frame size in bytes (Default: 1400)\n"
+    "    --mtu [Size]   - Path MTU, overrides -n          (Default: 1500)\n"
     "    -m [Mode]      - Streaming mode                  (Default: "
     "compact)\n"
     "       compact       - Compact UDP stream \n"
     "       rtp           - RTP stream\n"
     "\n"
+    "    --fec [K:N]    - FEC, K data of N packets (RTP)  (Default: off)\n"
+    "    --fec-depth [D] - FEC interleave depth           (Default: 1)\n"
+    "\n"
+    "    --sink [Sink]  - Additional sink, up to %d        (Default: none)\n"
+    "      IP:Port[,compact|rtp][,mtu=Size][,fec=K:N|off][,depth=D]\n"
+    "             [,packet=If[:radiotap]|off]\n"
+    "      Options not given are taken from the main sink\n"
+    "    --packet [If[:radiotap]] - Send through AF_PACKET ring on\n"
+    "                     interface, ethernet or radiotap (Default: off)\n"
+    "\n"
+    "    --pace [Percent] - Spread frame over %% of interval (Default: off)\n"
+    "    --pace-burst [N] - Packets sent without pacing     (Default: 4)\n"
+    "    --pace-txtime    - Pace with SO_TXTIME, needs ETF qdisc\n"
+    "    --sender-cpu [N] - Pin sender thread to CPU core  (Default: off)\n"
+    "    --tx-mode [Mode] - plain, batch or gso            (Default: batch)\n"
+    "       plain         - sendmsg per datagram\n"
+    "       batch         - sendmmsg per frame\n"
+    "       gso           - sendmmsg, equal size fragments\n"
+    "                       segmented by kernel (UDP GSO)\n"
+    "\n"
+    "    --feedback-port [Port] - Ground feedback port      (Default: 5001)\n"
+    "    --abr [Floor:Ceiling]  - Adapt rate to reported loss, Kbit/sec.\n"
+    "                             (Default: off, ceiling is -r)\n"
+    "    --latency-budget [Ms:Link] - Cap I / P frames to leave within Ms\n"
+    "                             over a Link Kbit/sec. link (Default: off)\n"
+    "    --nack [Window]        - Retransmit lost RTP packets until\n"
+    "                             frame is Window ms old (Default: off)\n"
+    "    --control-port [Port]  - Local runtime control port (Default: off)\n"
+    "    --metrics-port [Port]  - Local metrics snapshot port, replaces\n"
+    "                             stats output   (Default: off)\n"
+    "    --latency              - Send frame timing SEI and answer\n"
+    "                             ground clock probes  (Default: off)\n"
+    "    --refresh [Lines:Sec]  - Intra refresh Lines per frame, IDR\n"
+    "                             every Sec seconds or on ground\n"
+    "                             request (Default: off, 10 sec.)\n"
+    "    --ps-interval [Ms]     - Re-send cached parameter sets if\n"
+    "                             none were sent for Ms (Default: 1000,\n"
+    "                             0 - on IDR and request only)\n"
+    "    --svc-t [N]            - Temporal layers, N enhancement frames\n"
+    "                             after every base frame, dropped first\n"
+    "                             on congestion (Default: off, 1..7)\n"
+    "    --audio [Codec]        - Send microphone audio to RTP sinks\n"
+    "                             (Default: off)\n"
+    "       g711a         - G.711 A-law, 64 Kbit/sec.\n"
+    "       g711u         - G.711 u-law, 64 Kbit/sec.\n"
+    "       adpcm         - ADPCM DVI4, 32 Kbit/sec.\n"
+    "    --audio-frame [Ms]     - Audio frame length, 10, 20, 30, 40\n"
+    "                             or 60 ms (Default: 10)\n"
+    "\n"
     "    -s [Size]      - Encoded image size              (Default: "
     "version specific)\n"
     "\n"
@@ -92,6 +139,7 @@ void printHelp() {
     "\n"
     "    --no-slices          - Disable slices\n"
     "    --slice-size [size]  - Slices size in lines      (Default: 4)\n"
+    "      auto               - Adapt lines so most slices fit one packet\n"
     "\n"
     "    --low-delay    - Enable low delay mode\n"
     "    --mirror       - Mirror image\n"
@@ -100,22 +148,166 @@ void printHelp() {
     "\n"
     "    --roi          - Enable ROI\n"
     "    --roi-qp [QP]  - ROI quality points              (Default: 20)\n"
-    "\n", __DATE__
+    "\n"
+    "    --record [Path]      - Record second stream to Path_NNN.h264/h265\n"
+    "                           on local storage   (Default: off)\n"
+    "    --record-size [WxH]  - Recorded image size (Default: sensor size)\n"
+    "    --record-rate [Rate] - Recorded rate in Kbit/sec. (Default: 16384)\n"
+    "\n", __DATE__, MAX_SINKS - 1
   );
 }
 
-uint8_t stream_mode = 0;
+uint32_t path_mtu = 1500;
+uint8_t fec_data_count = 0;
+uint8_t fec_parity_count = 0;
+uint8_t fec_depth = 1;
+const char* sink_options[MAX_SINKS];
+int sender_cpu = -1;
+uint16_t feedback_port = 5001;
+uint16_t control_port = 0;
+bool latency_enabled = false;
+uint32_t latency_frame = 0;
+bool abr_enabled = false;
+uint32_t refresh_lines = 0;
+uint32_t refresh_period = 10;
+uint32_t svc_enhance = 0;
+bool slice_adaptive = false;
+struct SliceControlConfig slice_config;
+struct SliceControlState slice_state;
+uint64_t keyframe_time = 0;
+struct RateControlConfig abr_config;
+struct RateControlState abr_state;
+bool budget_enabled = false;
+struct LatencyBudgetConfig budget_config;
+struct LatencyBudgetLimits budget_limits;
+bool audio_enabled = false;
+PAYLOAD_TYPE_E audio_codec = PT_G711A;
+uint8_t audio_payload = AUDIO_PAYLOAD_PCMA;
+uint32_t audio_frame = 10;
+AUDIO_DEV audio_device_id = 0;
+AI_CHN audio_channel_id = 0;
 uint16_t goke_version = 200;
 SensorType sensor_type = IMX307;
 uint32_t sensor_width = 1280;
 uint32_t sensor_height = 720;
 uint32_t sensor_framerate = 60;
-bool loop_running = true;
+const char* record_path = NULL;
+uint32_t record_width = 0;
+uint32_t record_height = 0;
+uint32_t record_rate = 1024 * 16;
+struct Recorder recorder;
 
 static void handler(int value) {
   loop_running = false;
 }
 
+// Frame size and QP limits every RC mode has, each mode keeps them in
+// parameters of its own type
+struct RcLimits {
+  HI_U32* min_iprop;
+  HI_U32* max_iprop;
+  HI_S32* reencode_times;
+  HI_U32* min_qp;
+  HI_U32* max_qp;
+  HI_U32* min_i_qp;
+  HI_U32* max_i_qp;
+};
+
+/**
+ * @brief Locate limits of an RC mode in its RC parameters
+ * @return 0 on success, 1 if mode has no such parameters
+ */
+static int getRcLimits(VENC_RC_PARAM_S* rc_param, VENC_RC_MODE_E mode,
+  struct RcLimits* limits) {
+  switch (mode) {
+    case VENC_RC_MODE_H264CBR: {
+      VENC_PARAM_H264_CBR_S* param = &rc_param->stParamH264Cbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H264VBR: {
+      VENC_PARAM_H264_VBR_S* param = &rc_param->stParamH264Vbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H264AVBR: {
+      VENC_PARAM_H264_AVBR_S* param = &rc_param->stParamH264AVbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H264QVBR: {
+      VENC_PARAM_H264_QVBR_S* param = &rc_param->stParamH264QVbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H265CBR: {
+      VENC_PARAM_H265_CBR_S* param = &rc_param->stParamH265Cbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H265VBR: {
+      VENC_PARAM_H265_VBR_S* param = &rc_param->stParamH265Vbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H265AVBR: {
+      VENC_PARAM_H265_AVBR_S* param = &rc_param->stParamH265AVbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    case VENC_RC_MODE_H265QVBR: {
+      VENC_PARAM_H265_QVBR_S* param = &rc_param->stParamH265QVbr;
+      *limits = (struct RcLimits){ &param->u32MinIprop, &param->u32MaxIprop,
+        &param->s32MaxReEncodeTimes, &param->u32MinQp, &param->u32MaxQp,
+        &param->u32MinIQp, &param->u32MaxIQp };
+      return 0;
+    }
+
+    default:
+      return 1;
+  }
+}
+
+/**
+ * @brief Apply latency budget limits to RC parameters, re-encode is only
+ *   used to hold frames within latency budget
+ */
+static void setFrameLimits(VENC_RC_PARAM_S* rc_param, VENC_RC_MODE_E mode) {
+  struct RcLimits limits;
+  if (getRcLimits(rc_param, mode, &limits)) {
+    return;
+  }
+
+  *limits.reencode_times = budget_enabled ? budget_limits.reencode_times : 0;
+  if (budget_enabled) {
+    *limits.max_iprop = budget_limits.max_iprop;
+    *limits.min_iprop = MIN2(*limits.min_iprop, budget_limits.max_iprop);
+    *limits.max_qp = budget_limits.max_qp;
+    *limits.max_i_qp = budget_limits.max_qp;
+  }
+}
+
 int main(int argc, const char* argv[]) {
   if (argc == 2 && !strcmp(argv[1], "help")) {
     printHelp();
@@ -150,6 +342,7 @@ int main(int argc, const char* argv[]) {
   uint32_t udp_sink_ip = inet_addr("127.0.0.1");
   uint16_t udp_sink_port = 5000;
   uint16_t max_frame_size = 1400;
+  bool limit_to_mtu = false;
 
   int enable_slices = 1;
   int enable_lowdelay = 0;
@@ -185,6 +378,188 @@ int main(int argc, const char* argv[]) {
     continue;
   }
 
+  __OnArgument("--mtu") {
+    path_mtu = atoi(__ArgValue);
+    limit_to_mtu = true;
+    continue;
+  }
+
+  __OnArgument("--fec") {
+    if (parseFEC(__ArgValue, &fec_data_count, &fec_parity_count)) {
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--fec-depth") {
+    fec_depth = atoi(__ArgValue);
+    if (!fec_depth || fec_depth > FEC_MAX_DEPTH) {
+      printf("> ERROR: FEC interleave depth must be 1..%d\n", FEC_MAX_DEPTH);
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--tx-mode") {
+    if (parseTxMode(__ArgValue)) {
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--packet") {
+    if (parsePacketInterface(&sinks[0], __ArgValue)) {
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--sink") {
+    if (sink_count == MAX_SINKS) {
+      printf("> ERROR: No more than %d sinks are supported\n", MAX_SINKS);
+      exit(1);
+    }
+
+    sink_options[sink_count++] = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--pace") {
+    pace_percent = atoi(__ArgValue);
+    if (pace_percent > 100) {
+      printf("> ERROR: Pacing must be 0..100 percent of frame interval\n");
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--pace-burst") {
+    pace_burst = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--pace-txtime") {
+    pace_txtime = true;
+    continue;
+  }
+
+  __OnArgument("--feedback-port") {
+    feedback_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--metrics-port") {
+    metrics_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--latency") {
+    latency_enabled = true;
+    continue;
+  }
+
+  __OnArgument("--control-port") {
+    control_port = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--abr") {
+    uint32_t floor = 0, ceiling = 0;
+    int count = sscanf(__ArgValue, "%u:%u", &floor, &ceiling);
+    if (count < 1 || !floor || (count == 2 && ceiling < floor)) {
+      printf("> ERROR: ABR must be Floor[:Ceiling] in Kbit/sec.\n");
+      exit(1);
+    }
+
+    abr_enabled = true;
+    abr_config.floor = floor;
+    abr_config.ceiling = count == 2 ? ceiling : 0;
+    continue;
+  }
+
+  __OnArgument("--latency-budget") {
+    uint32_t budget = 0, link_rate = 0;
+    int count = sscanf(__ArgValue, "%u:%u", &budget, &link_rate);
+    if (count < 2 || !budget || !link_rate) {
+      printf("> ERROR: Latency budget must be Ms:Link in Kbit/sec.\n");
+      exit(1);
+    }
+
+    budget_enabled = true;
+    budget_config.budget = budget;
+    budget_config.link_rate = link_rate;
+    continue;
+  }
+
+  __OnArgument("--nack") {
+    nack_window = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--refresh") {
+    uint32_t lines = 0, period = 0;
+    int count = sscanf(__ArgValue, "%u:%u", &lines, &period);
+    if (count < 1 || !lines || (count == 2 && !period)) {
+      printf("> ERROR: Refresh must be Lines[:Seconds]\n");
+      exit(1);
+    }
+
+    refresh_lines = lines;
+    refresh_period = count == 2 ? period : refresh_period;
+    continue;
+  }
+
+  __OnArgument("--ps-interval") {
+    ps_interval = atoi(__ArgValue);
+    continue;
+  }
+
+  __OnArgument("--svc-t") {
+    svc_enhance = atoi(__ArgValue);
+    if (!svc_enhance || svc_enhance > MAX_TEMPORAL_LAYER) {
+      printf("> ERROR: Enhancement frames must be 1..%d\n", MAX_TEMPORAL_LAYER);
+      exit(1);
+    }
+
+    layer_marking = true;
+    continue;
+  }
+
+  __OnArgument("--audio") {
+    const char* value = __ArgValue;
+    if (!strcmp(value, "g711a")) {
+      audio_codec = PT_G711A;
+      audio_payload = AUDIO_PAYLOAD_PCMA;
+    } else if (!strcmp(value, "g711u")) {
+      audio_codec = PT_G711U;
+      audio_payload = AUDIO_PAYLOAD_PCMU;
+    } else if (!strcmp(value, "adpcm")) {
+      audio_codec = PT_ADPCMA;
+      audio_payload = AUDIO_PAYLOAD_DVI4;
+    } else {
+      printf("> ERROR: Unsupported audio codec [%s]\n", value);
+      exit(1);
+    }
+
+    audio_enabled = true;
+    continue;
+  }
+
+  __OnArgument("--audio-frame") {
+    audio_frame = atoi(__ArgValue);
+    if (audio_frame != 10 && audio_frame != 20 && audio_frame != 30 &&
+        audio_frame != 40 && audio_frame != 60) {
+      printf("> ERROR: Audio frame must be 10, 20, 30, 40 or 60 ms\n");
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--sender-cpu") {
+    sender_cpu = atoi(__ArgValue);
+    continue;
+  }
+
   __OnArgument("-m") {
     const char* value = __ArgValue;
     if (!strcmp(value, "compact")) {
@@ -273,7 +648,12 @@ int main(int argc, const char* argv[]) {
   }
 
   __OnArgument("--slice-size") {
-    venc_slice_size = atoi(__ArgValue);
+    const char* value = __ArgValue;
+    if (!strcmp(value, "auto")) {
+      slice_adaptive = true;
+    } else {
+      venc_slice_size = atoi(value);
+    }
     continue;
   }
 
@@ -395,6 +775,25 @@ int main(int argc, const char* argv[]) {
     continue;
   }
 
+  __OnArgument("--record") {
+    record_path = __ArgValue;
+    continue;
+  }
+
+  __OnArgument("--record-size") {
+    const char* value = __ArgValue;
+    if (sscanf(value, "%dx%d", &record_width, &record_height) != 2) {
+      printf("> ERROR: Unsuported record size [%s]\n", value);
+      exit(1);
+    }
+    continue;
+  }
+
+  __OnArgument("--record-rate") {
+    record_rate = atoi(__ArgValue);
+    continue;
+  }
+
   __OnArgument("--mirror") {
     image_mirror = HI_TRUE;
     continue;
@@ -407,13 +806,97 @@ int main(int argc, const char* argv[]) {
 
   __EndParseConsoleArguments__
 
+  stream_codec = rc_codec;
+
+  // Main sink is configured by -h, -p, -m, -n, --mtu and --fec options,
+  // additional sinks start with the same settings
+  struct Sink* main_sink = &sinks[0];
+  main_sink->address.sin_family = AF_INET;
+  main_sink->address.sin_port = htons(udp_sink_port);
+  main_sink->address.sin_addr.s_addr = udp_sink_ip;
+  main_sink->mode = stream_mode;
+  main_sink->mtu = path_mtu;
+  main_sink->limit_to_mtu = limit_to_mtu;
+  main_sink->max_size = max_frame_size;
+  main_sink->fec_data_count = fec_data_count;
+  main_sink->fec_parity_count = fec_parity_count;
+  main_sink->fec_depth = fec_depth;
+
+  for (uint8_t i = 1; i < sink_count; i++) {
+    if (parseSink(&sinks[i], main_sink, sink_options[i])) {
+      return 1;
+    }
+  }
+
+  // Retransmission cache holds the NACK window at the highest rate ABR may use
+  tx_max_rate = abr_enabled ? abr_config.ceiling : venc_max_rate;
+  for (uint8_t i = 0; i < sink_count; i++) {
+    if (setupSink(&sinks[i], i)) {
+      return 1;
+    }
+  }
+
+  metrics_init(&metrics_state, stream_codec == PT_H265, sinks[0].max_size);
+
+  if (abr_enabled) {
+    uint32_t ceiling = abr_config.ceiling ? abr_config.ceiling : venc_max_rate;
+    rate_control_defaults(&abr_config, MIN2(abr_config.floor, ceiling), ceiling);
+
+    // Start from the configured rate within controller limits
+    venc_max_rate = MAX2(MIN2(venc_max_rate, ceiling), abr_config.floor);
+    abr_state.rate = venc_max_rate;
+    abr_state.good_reports = 0;
+    printf("> ABR = %d..%d Kbit/sec.\n", abr_config.floor, abr_config.ceiling);
+  }
+
   // Normalize sensor framerate
   if (sensor_framerate > 60) {
     sensor_framerate = 60;
   }
+  pace_framerate = sensor_framerate;
+
+  if (pace_percent) {
+    setPaceRate(venc_max_rate);
+    printf("> Pacing = %d%% of frame interval, %llu Kbit/sec., burst %d packets\n",
+      pace_percent, (unsigned long long)(pace_rate * 8 / 1024), pace_burst);
+  }
 
-  // Normalize GOP
+  // Normalize GOP, intra refresh replaces periodic IDR with a long GOP
   venc_gop_size = sensor_framerate / venc_gop_denom;
+  if (refresh_lines) {
+    venc_gop_size = sensor_framerate * refresh_period;
+    printf("> Intra refresh = %d lines per frame, GOP = %d frames\n",
+      refresh_lines, venc_gop_size);
+
+    // Receiver joining mid-cycle gets parameter sets before the next sweep,
+    // lines are macroblock rows of H.264 or LCU rows of H.265
+    uint32_t picture_lines = rc_codec == PT_H265 ?
+      (image_height + 63) / 64 : (image_height + 15) / 16;
+    ps_refresh_frames = (picture_lines + refresh_lines - 1) / refresh_lines;
+  }
+
+  if (budget_enabled) {
+    // ABR may raise the rate up to its ceiling, limits hold for all rates below
+    budget_config.bitrate = abr_enabled ? abr_config.ceiling : venc_max_rate;
+    budget_config.framerate = sensor_framerate;
+    budget_config.gop = venc_gop_size;
+    budget_config.payload = main_sink->max_size;
+    for (uint8_t i = 1; i < sink_count; i++) {
+      budget_config.payload = MIN2(budget_config.payload, sinks[i].max_size);
+    }
+
+    latency_budget_limits(&budget_config, &budget_limits);
+    printf("> Latency budget = %d ms at %d Kbit/sec., max frame %d bytes, "
+      "I/P ratio <= %d, IP dQp = %d, worst delay %d us\n",
+      budget_config.budget, budget_config.link_rate, budget_limits.max_frame,
+      budget_limits.max_iprop, budget_limits.ip_qp_delta,
+      latency_budget_worst_delay(&budget_config, &budget_limits));
+
+    if (!budget_limits.feasible) {
+      printf("WARN: Average frame at %d Kbit/sec. does not fit latency budget\n",
+        budget_config.bitrate);
+    }
+  }
 
   /* --- v300 IMX307 --- */
   combo_dev_attr_t* mipi_profile = 0;
@@ -475,6 +958,13 @@ int main(int argc, const char* argv[]) {
   isp_profile->stWndRect.u32Width = sensor_width;
   isp_profile->stWndRect.u32Height = sensor_height;
 
+  // Recording defaults to sensor resolution, VPSS does not upscale
+  if (record_path && (!record_width || record_width > sensor_width ||
+      record_height > sensor_height)) {
+    record_width = sensor_width;
+    record_height = sensor_height;
+  }
+
   printf(
     "> Starting\n"
     "  - CPU     : v%d\n"
@@ -494,8 +984,8 @@ int main(int argc, const char* argv[]) {
   VB_CONFIG_S vb_conf;
   memset(&vb_conf, 0x00, sizeof(vb_conf));
 
-  // Use two memory pools
-  vb_conf.u32MaxPoolCnt = 2;
+  // Use two memory pools, third one for recorded stream
+  vb_conf.u32MaxPoolCnt = record_path ? 3 : 2;
 
   // Memory pool for VI
   vb_conf.astCommPool[0].u32BlkCnt  = (goke_version == 300 && sensor_type == IMX335)
@@ -511,6 +1001,14 @@ int main(int argc, const char* argv[]) {
     image_height, PIXEL_FORMAT_YVU_SEMIPLANAR_420, DATA_BITWIDTH_8,
     COMPRESS_MODE_NONE, DEFAULT_ALIGN);
 
+  // Memory pool for recording VENC, frames wait longer in frame mode
+  if (record_path) {
+    vb_conf.astCommPool[2].u32BlkCnt = 3;
+    vb_conf.astCommPool[2].u64BlkSize = COMMON_GetPicBufferSize(record_width,
+      record_height, PIXEL_FORMAT_YVU_SEMIPLANAR_420, DATA_BITWIDTH_8,
+      COMPRESS_MODE_NONE, DEFAULT_ALIGN);
+  }
+
   // Configure video buffer
   ret = HI_MPI_VB_SetConfig(&vb_conf);
   if (ret) {
@@ -678,8 +1176,8 @@ int main(int argc, const char* argv[]) {
   memset(&grp_attr, 0x00, sizeof(grp_attr));
   grp_attr.enDynamicRange = DYNAMIC_RANGE_SDR8;
   grp_attr.enPixelFormat = PIXEL_FORMAT_YVU_SEMIPLANAR_420;
-  grp_attr.u32MaxW = MAX2(sensor_width, image_width);
-  grp_attr.u32MaxH = MAX2(sensor_height, image_height);
+  grp_attr.u32MaxW = MAX3(sensor_width, image_width, record_width);
+  grp_attr.u32MaxH = MAX3(sensor_height, image_height, record_height);
   grp_attr.bNrEn = HI_TRUE;
   grp_attr.stNrAttr.enNrType = VPSS_NR_TYPE_VIDEO;
   grp_attr.stNrAttr.enNrMotionMode = NR_MOTION_MODE_NORMAL;
@@ -773,7 +1271,7 @@ int main(int argc, const char* argv[]) {
   config.stVencAttr.u32Profile = 0; // Baseline (0), Main(1), High(1)
   config.stVencAttr.bByFrame = venc_by_frame;
   config.stGopAttr.enGopMode = VENC_GOPMODE_NORMALP;
-  config.stGopAttr.stNormalP.s32IPQpDelta = 4;
+  config.stGopAttr.stNormalP.s32IPQpDelta = budget_enabled ? budget_limits.ip_qp_delta : 4;
   config.stRcAttr.enRcMode = rc_mode;
 
   switch (rc_codec) {
@@ -869,42 +1367,10 @@ int main(int argc, const char* argv[]) {
   // Configure rate control for channel #1
   VENC_RC_PARAM_S rc_param;
   HI_MPI_VENC_GetRcParam(venc_second_ch_id, &rc_param);
-  switch (rc_mode) {
-    case VENC_RC_MODE_H264AVBR:
-      rc_param.stParamH264AVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264QVBR:
-      rc_param.stParamH264QVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264VBR:
-      rc_param.stParamH264Vbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H264CBR:
-      rc_param.stParamH264Cbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265AVBR:
-      rc_param.stParamH265AVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265QVBR:
-      rc_param.stParamH265QVbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265VBR:
-      rc_param.stParamH265Vbr.s32MaxReEncodeTimes = 0;
-      break;
-
-    case VENC_RC_MODE_H265CBR:
-      rc_param.stParamH265Cbr.s32MaxReEncodeTimes = 0;
-      break;
-  }
 
+  setFrameLimits(&rc_param, rc_mode);
   rc_param.s32FirstFrameStartQp = -1;
-  rc_param.stSceneChangeDetect.bAdaptiveInsertIDRFrame = HI_TRUE;
+  rc_param.stSceneChangeDetect.bAdaptiveInsertIDRFrame = refresh_lines ? HI_FALSE : HI_TRUE;
   rc_param.stSceneChangeDetect.bDetectSceneChange = HI_TRUE;
 
   ret = HI_MPI_VENC_SetRcParam(venc_second_ch_id, &rc_param);
@@ -913,6 +1379,23 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
+  if (budget_enabled) {
+    // Frames above budget are encoded again at a higher QP before they leave
+    VENC_SUPERFRAME_CFG_S super_frame;
+    memset(&super_frame, 0x00, sizeof(super_frame));
+    super_frame.enSuperFrmMode = SUPERFRM_REENCODE;
+    super_frame.u32SuperIFrmBitsThr = budget_limits.i_frame_bits;
+    super_frame.u32SuperPFrmBitsThr = budget_limits.p_frame_bits;
+    super_frame.u32SuperBFrmBitsThr = budget_limits.p_frame_bits;
+    super_frame.enRcPriority = VENC_RC_PRIORITY_FRAMEBITS_FIRST;
+
+    ret = HI_MPI_VENC_SetSuperFrameStrategy(venc_second_ch_id, &super_frame);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to set VENC super frame strategy = 0x%x\n", ret);
+      return ret;
+    }
+  }
+
   HI_MPI_VENC_GetRcParam(venc_second_ch_id, &rc_param);
   printf("> Scene detect = %s, Adaptive IDR = %s, Start Qp = %d, Row dQp = %d\n",
     rc_param.stSceneChangeDetect.bDetectSceneChange ? "YES" : "NO",
@@ -968,13 +1451,38 @@ int main(int argc, const char* argv[]) {
       break;
   }
 
+  // Adaptive slices start from the configured size, retuned twice a second
+  if (slice_adaptive && (!enable_slices || venc_by_frame)) {
+    printf("WARN: Adaptive slices need slices in [stream] data format\n");
+    slice_adaptive = false;
+  }
+
+  if (slice_adaptive) {
+    // Slice must fit the smallest payload of all sinks
+    uint32_t target_size = sinks[0].max_size;
+    for (uint8_t i = 1; i < sink_count; i++) {
+      target_size = MIN2(target_size, sinks[i].max_size);
+    }
+
+    // Largest LCU used by the SDK, picture height stays in range either way
+    uint32_t max_lines = rc_codec == PT_H265 ?
+      (image_height + 63) / 64 : (image_height + 15) / 16;
+    slice_control_defaults(&slice_config, target_size, max_lines, sensor_framerate / 2);
+    memset(&slice_state, 0x00, sizeof(slice_state));
+    slice_state.lines = MIN2(MAX2(venc_slice_size, 1), max_lines);
+    printf("> Adaptive slices = %d..%d lines, target %d bytes\n",
+      slice_config.min_lines, slice_config.max_lines, slice_config.target_size);
+  }
+
   VENC_REF_PARAM_S ref_param;
   HI_MPI_VENC_GetRefParam(venc_second_ch_id, &ref_param);
   printf("> Reference = EN: %d, Base: %d, Enhance: %d\n",
     ref_param.bEnablePred, ref_param.u32Base, ref_param.u32Enhance);
 
+  // Layered mode: every base frame is followed by a run of enhancement frames,
+  // only base frames are referenced across runs
   ref_param.bEnablePred = 1;
-  ref_param.u32Enhance = 0;
+  ref_param.u32Enhance = svc_enhance;
   ref_param.u32Base = 1;
 
   ret = HI_MPI_VENC_SetRefParam(venc_second_ch_id, &ref_param);
@@ -983,6 +1491,26 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
+  // Setup intra refresh, rows of intra blocks sweep the picture
+  if (refresh_lines) {
+    VENC_INTRA_REFRESH_S refresh_param;
+    ret = HI_MPI_VENC_GetIntraRefresh(venc_second_ch_id, &refresh_param);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to get VENC intra refresh = 0x%x\n", ret);
+      return ret;
+    }
+
+    refresh_param.bRefreshEnable = HI_TRUE;
+    refresh_param.enIntraRefreshMode = INTRA_REFRESH_ROW;
+    refresh_param.u32RefreshNum = refresh_lines;
+
+    ret = HI_MPI_VENC_SetIntraRefresh(venc_second_ch_id, &refresh_param);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to set VENC intra refresh = 0x%x\n", ret);
+      return ret;
+    }
+  }
+
   // Setup frame lost strategy
   if (rc_codec == PT_H265) {
     VENC_FRAMELOST_S lost_param;
@@ -1047,81 +1575,870 @@ int main(int argc, const char* argv[]) {
     return ret;
   }
 
+  // Recorded stream on VPSS / VENC channels #0
+  int record_fd = -1;
+  if (record_path) {
+    if (recorder_open(&recorder, record_path, rc_codec == PT_H265) ||
+        setupRecordChannel(vpss_group_id, vpss_first_ch_id, venc_first_ch_id, rc_codec,
+          image_mirror, image_flip)) {
+      return 1;
+    }
+
+    record_fd = HI_MPI_VENC_GetFd(venc_first_ch_id);
+    if (record_fd < 0) {
+      printf("ERROR: Unable to get VENC channel fd = 0x%x\n", record_fd);
+      return record_fd;
+    }
+  }
+
   // Start ISP service thread
   pthread_t isp_thread;
   pthread_create(&isp_thread, NULL, __ISP_THREAD__, (void*)vi_pipe_id);
 
-  // Open socket handle
+  // Open socket handle, shared by all sinks
   int socket_handle = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  struct sockaddr_in dst_addr;
-  dst_addr.sin_family = AF_INET;
-  dst_addr.sin_port = htons(udp_sink_port);
-  dst_addr.sin_addr.s_addr = udp_sink_ip;
+  for (uint8_t i = 0; i < sink_count; i++) {
+    sinks[i].socket_handle = socket_handle;
+  }
 
-  // Prepare Tx buffer
-  tx_buffer = malloc(65536);
-  printf("> Ready for streaming\n");
-  signal(SIGINT, handler);
+  if (pace_percent && pace_txtime && enableTxTime(socket_handle)) {
+    printf("WARN: SO_TXTIME is not available, pacing in userspace\n");
+    pace_txtime = false;
+  }
 
-  while (loop_running) {
-    // Process stream on encoder channel #1
-    if (!processStream(venc_second_ch_id, socket_handle,
-        (struct sockaddr*)&dst_addr, max_frame_size)) {
-      // --- Take a rest if no frames received
-      // Another way: HI_MPI_VENC_GetFd(vecn_channel_id) + epoll
-      usleep(1);
-    }
+  if (tx_mode == TX_MODE_GSO && pace_percent && pace_txtime) {
+    printf("WARN: UDP GSO is not used with SO_TXTIME pacing\n");
+    tx_mode = TX_MODE_BATCH;
+  } else if (tx_mode == TX_MODE_GSO && enableGSO(socket_handle)) {
+    tx_mode = TX_MODE_BATCH;
   }
 
-  printf("> Stop streaming\n");
+  // Wait for encoded data on VENC channel file descriptor
+  int venc_fd = HI_MPI_VENC_GetFd(venc_second_ch_id);
+  if (venc_fd < 0) {
+    printf("ERROR: Unable to get VENC channel fd = 0x%x\n", venc_fd);
+    return venc_fd;
+  }
 
-  HI_MPI_ISP_Exit(vi_pipe_id);
-  HI_MPI_VPSS_StopGrp(vpss_group_id);
-  HI_MPI_VPSS_DestroyGrp(vpss_group_id);
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    printf("ERROR: Unable to create epoll instance: %s\n", strerror(errno));
+    return 1;
+  }
 
-  HI_MPI_VI_DisableChn(vi_pipe_id, vi_channel_id);
-  HI_MPI_VI_StopPipe(vi_pipe_id);
-  HI_MPI_VI_DestroyPipe(vi_pipe_id);
-  HI_MPI_VI_DisableDev(vi_pipe_id);
+  if (addEpollSource(epoll_fd, venc_fd)) {
+    return 1;
+  }
 
-  HI_MPI_SYS_Exit();
-  HI_MPI_VB_Exit();
+  if (record_fd >= 0 && addEpollSource(epoll_fd, record_fd)) {
+    return 1;
+  }
 
-  return 0;
-}
+  // Ground station feedback
+  int feedback_fd = -1;
+  if (abr_enabled || nack_window || refresh_lines || latency_enabled) {
+    feedback_fd = openFeedbackSocket(feedback_port);
+    if (feedback_fd < 0 || addEpollSource(epoll_fd, feedback_fd)) {
+      return 1;
+    }
+  }
 
-void* __ISP_THREAD__(void* param) {
-  HI_MPI_ISP_Run((VI_PIPE)param);
-}
+  // Local runtime control
+  int control_fd = -1;
+  if (control_port) {
+    control_fd = openLocalSocket(control_port, "control commands");
+    if (control_fd < 0 || addEpollSource(epoll_fd, control_fd)) {
+      return 1;
+    }
+  }
 
-double getTimeInterval(
-  struct timespec* timestamp, struct timespec* last_meansure_timestamp) {
-  return (timestamp->tv_sec - last_meansure_timestamp->tv_sec) +
-       (timestamp->tv_nsec - last_meansure_timestamp->tv_nsec) / 1000000000.;
-}
+  // Local metrics snapshots
+  int metrics_fd = -1;
+  if (metrics_port) {
+    metrics_fd = openLocalSocket(metrics_port, "metrics requests");
+    if (metrics_fd < 0 || addEpollSource(epoll_fd, metrics_fd)) {
+      return 1;
+    }
+  }
 
-struct timespec last_timestamp = {0, 0};
-uint32_t bytes_sent = 0;
-uint32_t frames_sent = 0;
-uint64_t seq_last = 0;
-
-uint64_t jitter_sum = 0;
-uint64_t jitter_cnt = 0;
-uint32_t nal_max_size = 0;
-uint32_t single_packets = 0;
-
-uint32_t pps_count = 0;
-uint32_t sps_count = 0;
-uint32_t idr_count = 0;
-uint32_t sei_count = 0;
-uint32_t s_count = 0;
-uint32_t packets_sent = 0;
-
-int processStream(VENC_CHN channel_id, int socket_handle,
-  struct sockaddr* dst_address, uint16_t max_frame_size) {
-  // Get channel status
-  VENC_CHN_STATUS_S channel_status;
-  int ret = HI_MPI_VENC_QueryStatus(channel_id, &channel_status);
+  // Audio capture, frames are sent from this thread and bypass Tx ring
+  int audio_fd = -1;
+  if (audio_enabled) {
+    if (openAudio(audio_payload)) {
+      return 1;
+    }
+
+    audio_fd = setupAudio(audio_codec, audio_frame * AUDIO_SAMPLE_RATE / 1000);
+    if (audio_fd < 0 || addEpollSource(epoll_fd, audio_fd)) {
+      return 1;
+    }
+  }
+
+  // Start network sender thread, encoder loop only copies packs to Tx ring
+  pthread_t sender_thread;
+  if (startSender(&sender_thread, sender_cpu)) {
+    return 1;
+  }
+
+  printf("> Ready for streaming\n");
+  signal(SIGINT, handler);
+
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  while (loop_running) {
+    int count = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, 1000);
+    if (count < 0) {
+      if (errno != EINTR) {
+        printf("ERROR: Unable to wait for events: %s\n", strerror(errno));
+        break;
+      }
+      continue;
+    }
+
+    bool audio_ready = false;
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.fd == venc_fd) {
+        // Drain all packs available on encoder channel #1
+        while (processStream(venc_second_ch_id));
+      } else if (events[i].data.fd == record_fd) {
+        while (processRecord(venc_first_ch_id));
+      } else if (events[i].data.fd == feedback_fd) {
+        processFeedback(feedback_fd, venc_second_ch_id);
+      } else if (events[i].data.fd == control_fd) {
+        processControl(control_fd, venc_second_ch_id);
+      } else if (events[i].data.fd == metrics_fd) {
+        processMetrics(metrics_fd);
+      } else if (events[i].data.fd == audio_fd) {
+        audio_ready = true;
+      }
+    }
+
+    // Audio waits until video packs of the same wake-up are in Tx ring
+    if (audio_ready) {
+      while (processAudio());
+    }
+  }
+
+  printf("> Stop streaming\n");
+
+  stopSender(sender_thread);
+
+  close(epoll_fd);
+  if (feedback_fd >= 0) {
+    close(feedback_fd);
+  }
+  if (control_fd >= 0) {
+    close(control_fd);
+  }
+  if (metrics_fd >= 0) {
+    close(metrics_fd);
+  }
+  if (audio_fd >= 0) {
+    stopAudio();
+    closeAudio();
+  }
+  HI_MPI_VENC_CloseFd(venc_second_ch_id);
+  if (record_fd >= 0) {
+    HI_MPI_VENC_CloseFd(venc_first_ch_id);
+    recorder_close(&recorder);
+  }
+
+  HI_MPI_ISP_Exit(vi_pipe_id);
+  HI_MPI_VPSS_StopGrp(vpss_group_id);
+  HI_MPI_VPSS_DestroyGrp(vpss_group_id);
+
+  HI_MPI_VI_DisableChn(vi_pipe_id, vi_channel_id);
+  HI_MPI_VI_StopPipe(vi_pipe_id);
+  HI_MPI_VI_DestroyPipe(vi_pipe_id);
+  HI_MPI_VI_DisableDev(vi_pipe_id);
+
+  HI_MPI_SYS_Exit();
+  HI_MPI_VB_Exit();
+
+  return 0;
+}
+
+int setupRecordChannel(VPSS_GRP vpss_group_id, VPSS_CHN vpss_channel_id,
+  VENC_CHN venc_channel_id, PAYLOAD_TYPE_E codec, bool mirror, bool flip) {
+  // VPSS channel, no low delay, frames are encoded whole
+  VPSS_CHN_ATTR_S chn_attr;
+  memset(&chn_attr, 0x00, sizeof(chn_attr));
+  chn_attr.u32Width = record_width;
+  chn_attr.u32Height = record_height;
+  chn_attr.enChnMode = VPSS_CHN_MODE_USER;
+  chn_attr.enCompressMode = COMPRESS_MODE_NONE;
+  chn_attr.enDynamicRange = DYNAMIC_RANGE_SDR8;
+  chn_attr.enPixelFormat = PIXEL_FORMAT_YVU_SEMIPLANAR_420;
+  chn_attr.stFrameRate.s32SrcFrameRate = sensor_framerate;
+  chn_attr.stFrameRate.s32DstFrameRate =
+    record_width * record_height > 2688 * 1520 ? 20 : sensor_framerate;
+  chn_attr.u32Depth = 0;
+  chn_attr.bMirror = mirror;
+  chn_attr.bFlip = flip;
+  chn_attr.enVideoFormat = VIDEO_FORMAT_LINEAR;
+  chn_attr.stAspectRatio.enMode = ASPECT_RATIO_NONE;
+
+  int ret = HI_MPI_VPSS_SetChnAttr(vpss_group_id, vpss_channel_id, &chn_attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set record VPSS channel configuration = 0x%x\n", ret);
+    return ret;
+  }
+
+  ret = HI_MPI_VPSS_EnableChn(vpss_group_id, vpss_channel_id);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable record VPSS channel = 0x%x\n", ret);
+    return ret;
+  }
+
+  // VBR in frame mode, longer GOP than live stream as nothing is lost
+  uint32_t framerate = chn_attr.stFrameRate.s32DstFrameRate;
+  VENC_CHN_ATTR_S config;
+  memset(&config, 0x00, sizeof(config));
+  config.stVencAttr.enType = codec;
+  config.stVencAttr.u32MaxPicWidth = record_width;
+  config.stVencAttr.u32MaxPicHeight = record_height;
+  config.stVencAttr.u32PicWidth = record_width;
+  config.stVencAttr.u32PicHeight = record_height;
+  config.stVencAttr.u32BufSize = ALIGN_UP(record_width * record_height * 3 / 4, 64);
+  config.stVencAttr.u32Profile = 1;
+  config.stVencAttr.bByFrame = HI_TRUE;
+  config.stGopAttr.enGopMode = VENC_GOPMODE_NORMALP;
+  config.stGopAttr.stNormalP.s32IPQpDelta = 2;
+
+  if (codec == PT_H265) {
+    config.stVencAttr.stAttrH265e.bRcnRefShareBuf = HI_TRUE;
+    config.stRcAttr.enRcMode = VENC_RC_MODE_H265VBR;
+    config.stRcAttr.stH265Vbr.u32SrcFrameRate = framerate;
+    config.stRcAttr.stH265Vbr.fr32DstFrameRate = framerate;
+    config.stRcAttr.stH265Vbr.u32StatTime = 2;
+    config.stRcAttr.stH265Vbr.u32Gop = framerate * 2;
+    config.stRcAttr.stH265Vbr.u32MaxBitRate = record_rate;
+  } else {
+    config.stVencAttr.stAttrH264e.bRcnRefShareBuf = HI_TRUE;
+    config.stRcAttr.enRcMode = VENC_RC_MODE_H264VBR;
+    config.stRcAttr.stH264Vbr.u32SrcFrameRate = framerate;
+    config.stRcAttr.stH264Vbr.fr32DstFrameRate = framerate;
+    config.stRcAttr.stH264Vbr.u32StatTime = 2;
+    config.stRcAttr.stH264Vbr.u32Gop = framerate * 2;
+    config.stRcAttr.stH264Vbr.u32MaxBitRate = record_rate;
+  }
+
+  ret = HI_MPI_VENC_CreateChn(venc_channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create record VENC channel = 0x%x\n", ret);
+    return ret;
+  }
+
+  MPP_CHN_S vpss_src;
+  MPP_CHN_S venc_dst;
+
+  vpss_src.enModId = HI_ID_VPSS;
+  vpss_src.s32DevId = vpss_group_id;
+  vpss_src.s32ChnId = vpss_channel_id;
+
+  venc_dst.enModId = HI_ID_VENC;
+  venc_dst.s32DevId = 0;
+  venc_dst.s32ChnId = venc_channel_id;
+
+  HI_MPI_SYS_Bind(&vpss_src, &venc_dst);
+
+  VENC_RECV_PIC_PARAM_S recv_param;
+  recv_param.s32RecvPicNum = -1;
+  ret = HI_MPI_VENC_StartRecvFrame(venc_channel_id, &recv_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to start record Rx frames = 0x%x\n", ret);
+    return ret;
+  }
+
+  printf("> Recording %d x %d @ %d, %d Kbit/sec.\n",
+    record_width, record_height, framerate, record_rate);
+  return 0;
+}
+
+int openFeedbackSocket(uint16_t port) {
+  int socket_handle = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+  if (socket_handle < 0) {
+    printf("ERROR: Unable to create feedback socket: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+
+  if (bind(socket_handle, (struct sockaddr*)&address, sizeof(address))) {
+    printf("ERROR: Unable to bind feedback port %d: %s\n", port, strerror(errno));
+    close(socket_handle);
+    return -1;
+  }
+
+  printf("> Listening for feedback on port %d\n", port);
+  return socket_handle;
+}
+
+int setBitrate(VENC_CHN channel_id, uint32_t rate) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  switch (config.stRcAttr.enRcMode) {
+    case VENC_RC_MODE_H264CBR:
+      config.stRcAttr.stH264Cbr.u32BitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H264VBR:
+      config.stRcAttr.stH264Vbr.u32MaxBitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H264AVBR:
+      config.stRcAttr.stH264AVbr.u32MaxBitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H264QVBR:
+      config.stRcAttr.stH264QVbr.u32TargetBitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H265CBR:
+      config.stRcAttr.stH265Cbr.u32BitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H265VBR:
+      config.stRcAttr.stH265Vbr.u32MaxBitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H265AVBR:
+      config.stRcAttr.stH265AVbr.u32MaxBitRate = rate;
+      break;
+
+    case VENC_RC_MODE_H265QVBR:
+      config.stRcAttr.stH265QVbr.u32TargetBitRate = rate;
+      break;
+
+    default:
+      printf("WARN: Bitrate can not be changed in this RC mode\n");
+      return 1;
+  }
+
+  // Frame limits depend on encoder rate, the largest frame does not
+  if (budget_enabled) {
+    budget_config.bitrate = rate;
+    latency_budget_limits(&budget_config, &budget_limits);
+    config.stGopAttr.stNormalP.s32IPQpDelta = budget_limits.ip_qp_delta;
+  }
+
+  ret = HI_MPI_VENC_SetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  if (budget_enabled) {
+    VENC_RC_PARAM_S rc_param;
+    ret = HI_MPI_VENC_GetRcParam(channel_id, &rc_param);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to get VENC RC options = 0x%x\n", ret);
+      return ret;
+    }
+
+    setFrameLimits(&rc_param, config.stRcAttr.enRcMode);
+    ret = HI_MPI_VENC_SetRcParam(channel_id, &rc_param);
+    if (ret != HI_SUCCESS) {
+      printf("ERROR: Unable to set VENC RC options = 0x%x\n", ret);
+      return ret;
+    }
+  }
+
+  // Pacing follows encoder rate
+  if (pace_percent) {
+    setPaceRate(rate);
+  }
+
+  return 0;
+}
+
+void processReport(struct ReceiverReport* report, VENC_CHN channel_id) {
+  struct RateControlInput input;
+  input.expected = be32toh(report->expected);
+  input.lost = be32toh(report->lost);
+  input.jitter = be32toh(report->jitter);
+  input.goodput = be32toh(report->goodput);
+
+  struct RateControlState state = rate_control_step(&abr_config, abr_state, &input);
+  if (state.rate != abr_state.rate) {
+    printf("> ABR: Loss %.1f%%, Jitter %d us, Goodput %d Kbit/sec. -> Rate %d Kbit/sec.\n",
+      input.expected ? input.lost * 100. / input.expected : 0., input.jitter,
+      input.goodput, state.rate);
+
+    if (setBitrate(channel_id, state.rate)) {
+      // Keep previous rate, next report retries
+      state.rate = abr_state.rate;
+    }
+  }
+
+  abr_state = state;
+}
+
+void requestKeyframe(VENC_CHN channel_id) {
+  // Several receivers may ask for the same keyframe
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t time = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+  if (keyframe_time && time - keyframe_time < KEYFRAME_MIN_INTERVAL) {
+    return;
+  }
+
+  int ret = HI_MPI_VENC_RequestIDR(channel_id, HI_TRUE);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to request IDR = 0x%x\n", ret);
+    return;
+  }
+
+  keyframe_time = time;
+  __atomic_fetch_add(&keyframe_requests, 1, __ATOMIC_RELAXED);
+}
+
+void answerPing(int feedback_fd, struct ClockPing* ping, uint64_t receive_time,
+  struct sockaddr_in* source) {
+  struct ClockPong pong;
+  pong.header.magic = htobe16(FEEDBACK_MAGIC);
+  pong.header.type = FEEDBACK_PONG;
+  pong.header.reserved = 0;
+  pong.origin = ping->origin;
+  pong.receive = htobe64(receive_time);
+
+  HI_U64 transmit_time = 0;
+  HI_MPI_SYS_GetCurPTS(&transmit_time);
+  pong.transmit = htobe64(transmit_time);
+
+  sendto(feedback_fd, &pong, sizeof(pong), 0,
+    (struct sockaddr*)source, sizeof(*source));
+}
+
+void insertLatencyRecord(VENC_CHN channel_id, VENC_STREAM_S* stream) {
+  for (uint32_t i = 0; i < stream->u32PackCount; i++) {
+    if (!stream->pstPack[i].bFrameEnd) {
+      continue;
+    }
+
+    HI_U64 encoded_time = 0;
+    HI_MPI_SYS_GetCurPTS(&encoded_time);
+
+    struct LatencyRecord record;
+    record.magic = htobe32(LATENCY_MAGIC);
+    record.frame = htobe32(latency_frame++);
+    record.capture = htobe64(stream->pstPack[i].u64PTS);
+    record.encoded = htobe64(encoded_time);
+
+    int ret = HI_MPI_VENC_InsertUserData(channel_id, (HI_U8*)&record, sizeof(record));
+    if (ret != HI_SUCCESS) {
+      printf("WARN: Unable to insert latency SEI = 0x%x\n", ret);
+    }
+    return;
+  }
+}
+
+void processFeedback(int feedback_fd, VENC_CHN channel_id) {
+  uint8_t buffer[1500];
+  struct sockaddr_in source;
+  while (true) {
+    socklen_t source_size = sizeof(source);
+    int size = recvfrom(feedback_fd, buffer, sizeof(buffer), 0,
+      (struct sockaddr*)&source, &source_size);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    // Same clock as frame PTS, for clock offset probes
+    HI_U64 receive_time = 0;
+    HI_MPI_SYS_GetCurPTS(&receive_time);
+
+    struct FeedbackHeader* header = (struct FeedbackHeader*)buffer;
+    if (size < sizeof(struct FeedbackHeader) ||
+        be16toh(header->magic) != FEEDBACK_MAGIC) {
+      continue;
+    }
+
+    switch (header->type) {
+      case FEEDBACK_REPORT:
+        if (abr_enabled && size >= sizeof(struct ReceiverReport)) {
+          processReport((struct ReceiverReport*)buffer, channel_id);
+        }
+        break;
+
+      case FEEDBACK_NACK:
+        if (nack_window) {
+          queueNack((struct NackMessage*)buffer, size, &source);
+        }
+        break;
+
+      case FEEDBACK_KEYFRAME:
+        requestKeyframe(channel_id);
+        break;
+
+      case FEEDBACK_PARAMETER_SETS:
+        requestParameterSets();
+        break;
+
+      case FEEDBACK_PING:
+        if (latency_enabled && size >= sizeof(struct ClockPing)) {
+          answerPing(feedback_fd, (struct ClockPing*)buffer, receive_time, &source);
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+
+// Runtime control
+// Text commands from local tools, one per datagram, e.g.
+//   echo "bitrate 4096" | nc -u -w1 127.0.0.1 5002
+// Every command is answered with "OK" or "ERROR" and the time it took
+// to apply, so a caller can tell how long the encoder was reconfigured.
+
+int openLocalSocket(uint16_t port, const char* purpose) {
+  int socket_handle = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+  if (socket_handle < 0) {
+    printf("ERROR: Unable to create socket for %s: %s\n", purpose, strerror(errno));
+    return -1;
+  }
+
+  // Local tools only
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(socket_handle, (struct sockaddr*)&address, sizeof(address))) {
+    printf("ERROR: Unable to bind port %d for %s: %s\n", port, purpose, strerror(errno));
+    close(socket_handle);
+    return -1;
+  }
+
+  printf("> Listening for %s on port %d\n", purpose, port);
+  return socket_handle;
+}
+
+int setGOP(VENC_CHN channel_id, uint32_t gop) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  switch (config.stRcAttr.enRcMode) {
+    case VENC_RC_MODE_H264CBR:
+      config.stRcAttr.stH264Cbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H264VBR:
+      config.stRcAttr.stH264Vbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H264AVBR:
+      config.stRcAttr.stH264AVbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H264QVBR:
+      config.stRcAttr.stH264QVbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H265CBR:
+      config.stRcAttr.stH265Cbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H265VBR:
+      config.stRcAttr.stH265Vbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H265AVBR:
+      config.stRcAttr.stH265AVbr.u32Gop = gop;
+      break;
+
+    case VENC_RC_MODE_H265QVBR:
+      config.stRcAttr.stH265QVbr.u32Gop = gop;
+      break;
+
+    default:
+      printf("WARN: GOP can not be changed in this RC mode\n");
+      return 1;
+  }
+
+  ret = HI_MPI_VENC_SetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VENC channel attributes = 0x%x\n", ret);
+  }
+
+  return ret;
+}
+
+int setQpRange(VENC_CHN channel_id, uint32_t min_qp, uint32_t max_qp) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  VENC_RC_PARAM_S rc_param;
+  ret = HI_MPI_VENC_GetRcParam(channel_id, &rc_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC RC options = 0x%x\n", ret);
+    return ret;
+  }
+
+  // Same bounds for I and P frames
+  struct RcLimits limits;
+  if (getRcLimits(&rc_param, config.stRcAttr.enRcMode, &limits)) {
+    printf("WARN: QP range can not be changed in this RC mode\n");
+    return 1;
+  }
+
+  // Latency budget limits stay in force, its QP cap included
+  setFrameLimits(&rc_param, config.stRcAttr.enRcMode);
+  if (budget_enabled) {
+    max_qp = MIN2(max_qp, budget_limits.max_qp);
+    min_qp = MIN2(min_qp, max_qp);
+  }
+
+  *limits.min_qp = min_qp;
+  *limits.max_qp = max_qp;
+  *limits.min_i_qp = min_qp;
+  *limits.max_i_qp = max_qp;
+
+  ret = HI_MPI_VENC_SetRcParam(channel_id, &rc_param);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VENC RC options = 0x%x\n", ret);
+  }
+
+  return ret;
+}
+
+int setRoi(VENC_CHN channel_id, bool enable, int32_t qp) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  // Same centered region as --roi
+  uint32_t width = config.stVencAttr.u32PicWidth;
+  uint32_t height = config.stVencAttr.u32PicHeight;
+
+  VENC_ROI_ATTR_S roi_config;
+  roi_config.bEnable = enable ? HI_TRUE : HI_FALSE;
+  roi_config.u32Index = 0;
+  roi_config.stRect.s32X = ALIGN_UP(width / 4, 16);
+  roi_config.stRect.s32Y = ALIGN_UP(height / 4, 16);
+  roi_config.stRect.u32Width = ALIGN_UP(width / 2, 16);
+  roi_config.stRect.u32Height = ALIGN_UP(height / 2, 16);
+  roi_config.bAbsQp = HI_TRUE;
+  roi_config.s32Qp = qp;
+
+  ret = HI_MPI_VENC_SetRoiAttr(channel_id, &roi_config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to setup VENC ROI = 0x%x\n", ret);
+  }
+
+  return ret;
+}
+
+int setSliceSize(VENC_CHN channel_id, uint32_t lines) {
+  VENC_CHN_ATTR_S config;
+  int ret = HI_MPI_VENC_GetChnAttr(channel_id, &config);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get VENC channel attributes = 0x%x\n", ret);
+    return ret;
+  }
+
+  if (config.stVencAttr.bByFrame) {
+    printf("WARN: Slices are not available in [frame] data format\n");
+    return 1;
+  }
+
+  switch (config.stVencAttr.enType) {
+    case PT_H264: {
+      VENC_H264_SLICE_SPLIT_S avc_param;
+      HI_MPI_VENC_GetH264SliceSplit(channel_id, &avc_param);
+      avc_param.bSplitEnable = lines ? 1 : 0;
+      avc_param.u32MbLineNum = lines ? lines : avc_param.u32MbLineNum;
+      ret = HI_MPI_VENC_SetH264SliceSplit(channel_id, &avc_param);
+      break;
+    }
+
+    case PT_H265: {
+      VENC_H265_SLICE_SPLIT_S hevc_param;
+      HI_MPI_VENC_GetH265SliceSplit(channel_id, &hevc_param);
+      hevc_param.bSplitEnable = lines ? 1 : 0;
+      hevc_param.u32LcuLineNum = lines ? lines : hevc_param.u32LcuLineNum;
+      ret = HI_MPI_VENC_SetH265SliceSplit(channel_id, &hevc_param);
+      break;
+    }
+
+    default:
+      return 1;
+  }
+
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set VENC slice size = 0x%x\n", ret);
+  }
+
+  return ret;
+}
+
+int setExposureLimit(uint32_t max_time) {
+  ISP_EXPOSURE_ATTR_S attr;
+  int ret = HI_MPI_ISP_GetExposureAttr(0, &attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to get exposure\n");
+    return ret;
+  }
+
+  attr.stAuto.stExpTimeRange.u32Max = max_time;
+  ret = HI_MPI_ISP_SetExposureAttr(0, &attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set exposure\n");
+  }
+
+  return ret;
+}
+
+int applyControl(const char* command, VENC_CHN channel_id) {
+  char name[16];
+  char option[16] = "";
+  uint32_t value = 0, extra = 0;
+
+  int count = sscanf(command, "%15s %15s %u", name, option, &extra);
+  if (count < 2) {
+    return -1;
+  }
+
+  bool has_value = sscanf(option, "%u", &value) == 1;
+
+  if (!strcmp(name, "bitrate") && has_value && value) {
+    int ret = setBitrate(channel_id, value);
+    if (!ret && abr_enabled) {
+      // ABR continues from the new rate
+      abr_state.rate = value;
+      abr_state.good_reports = 0;
+    }
+    return ret;
+  }
+
+  if (!strcmp(name, "gop") && has_value && value) {
+    return setGOP(channel_id, value);
+  }
+
+  if (!strcmp(name, "qp") && has_value && count == 3 && value <= extra && extra <= 51) {
+    return setQpRange(channel_id, value, extra);
+  }
+
+  if (!strcmp(name, "roi")) {
+    if (!strcmp(option, "off")) {
+      return setRoi(channel_id, false, 0);
+    }
+    return has_value && value <= 51 ? setRoi(channel_id, true, value) : -1;
+  }
+
+  if (!strcmp(name, "exposure") && has_value && value) {
+    return setExposureLimit(value);
+  }
+
+  if (!strcmp(name, "slice")) {
+    // Adaptive slices continue from the current size
+    if (!strcmp(option, "auto")) {
+      slice_adaptive = slice_config.target_size != 0;
+      return slice_adaptive ? setSliceSize(channel_id, slice_state.lines) : -1;
+    }
+
+    if (!has_value) {
+      return -1;
+    }
+
+    // Manual size stops adaptive slices
+    slice_adaptive = false;
+    slice_state.lines = value ? value : slice_state.lines;
+    return setSliceSize(channel_id, value);
+  }
+
+  return -1;
+}
+
+void processControl(int control_fd, VENC_CHN channel_id) {
+  char buffer[128];
+  struct sockaddr_in source;
+  while (true) {
+    socklen_t source_size = sizeof(source);
+    int size = recvfrom(control_fd, buffer, sizeof(buffer) - 1, 0,
+      (struct sockaddr*)&source, &source_size);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    buffer[size] = 0;
+    buffer[strcspn(buffer, "\r\n")] = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = applyControl(buffer, channel_id);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint32_t apply_time = (end.tv_sec - start.tv_sec) * 1000000 +
+      (end.tv_nsec - start.tv_nsec) / 1000;
+
+    char reply[192];
+    if (ret < 0) {
+      size = snprintf(reply, sizeof(reply), "ERROR Unknown command [%s]\n", buffer);
+    } else if (ret) {
+      size = snprintf(reply, sizeof(reply), "ERROR [%s] = 0x%x | Time %u us\n",
+        buffer, ret, apply_time);
+    } else {
+      size = snprintf(reply, sizeof(reply), "OK [%s] | Time %u us\n",
+        buffer, apply_time);
+      printf("> Control: %s applied in %u us\n", buffer, apply_time);
+    }
+
+    sendto(control_fd, reply, MIN2(size, sizeof(reply) - 1), 0,
+      (struct sockaddr*)&source, source_size);
+  }
+}
+
+int addEpollSource(int epoll_fd, int fd) {
+  struct epoll_event event;
+  memset(&event, 0x00, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    printf("ERROR: Unable to add fd %d to epoll: %s\n", fd, strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+void* __ISP_THREAD__(void* param) {
+  HI_MPI_ISP_Run((VI_PIPE)param);
+}
+
+int processStream(VENC_CHN channel_id) {
+  // Get channel status
+  VENC_CHN_STATUS_S channel_status;
+  int ret = HI_MPI_VENC_QueryStatus(channel_id, &channel_status);
   if (ret != HI_SUCCESS) {
     printf("WARN: Unable to query VENC status = 0x%x\n", ret);
     usleep(100000);
@@ -1154,188 +2471,287 @@ int processStream(VENC_CHN channel_id, int socket_handle,
     return 0;
   }
 
-  // Send encoded packets
+  // Timing of a completed frame goes with the next one
+  if (latency_enabled) {
+    insertLatencyRecord(channel_id, &stream);
+  }
+
+  bool independent = false;
+  uint8_t layer = getTemporalLayer(&stream, &independent);
+  bool slices_due = slice_adaptive && countSlices(&stream);
+
+  // Copy encoded packets into Tx ring
+  uint32_t pushed = 0;
   for (uint32_t i = 0; i < stream.u32PackCount; i++) {
-    sendPacket(stream.pstPack[i].pu8Addr + stream.pstPack[i].u32Offset,
-      stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset,
-      socket_handle, dst_address, max_frame_size);
+    if (pushPack(stream.pstPack[i].pu8Addr + stream.pstPack[i].u32Offset,
+        stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset,
+        stream.pstPack[i].u64PTS, stream.pstPack[i].bFrameEnd,
+        i + 1 == stream.u32PackCount, layer, independent)) {
+      // Sender is behind, drop the rest of the stream and of its frame
+      __atomic_fetch_add(&tx_ring_overflows, stream.u32PackCount - i,
+        __ATOMIC_RELAXED);
+      cutFrame(stream.pstPack[stream.u32PackCount - 1].bFrameEnd);
+      break;
+    }
+    pushed++;
   }
 
   // Release stream
   HI_MPI_VENC_ReleaseStream(channel_id, &stream);
 
-  // Print rate stats
-  struct timespec current_timestamp;
-  if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &current_timestamp)) {
-    double interval = getTimeInterval(&current_timestamp, &last_timestamp);
-    if (interval > 1) {
-      printf("> Rate: %.2f Mbit/sec. (%.1f pps) | Frames: %d, NotFrag: "
-           "%d | AVG Size: %d, MAX Size: %d | S: %d, IDR: %d, SEI: %d, "
-           "PPS: %d, SPS: %d | Packets: %d\n",
-        ((double)bytes_sent * 8) / interval / 1024 / 1024,
-        (double)frames_sent / interval, /* jitter_sum / jitter_cnt,*/
-        frames_sent, single_packets, bytes_sent / frames_sent,
-        nal_max_size, s_count, idr_count, sei_count, pps_count,
-        sps_count, packets_sent);
-
-      bytes_sent = 0;
-      frames_sent = 0;
-      jitter_sum = 0;
-      jitter_cnt = 0;
-      nal_max_size = 0;
-      s_count = 0;
-      idr_count = 0;
-      pps_count = 0;
-      sps_count = 0;
-      sei_count = 0;
-      single_packets = 0;
-      packets_sent = 0;
-      last_timestamp = current_timestamp;
-    }
+  if (slices_due) {
+    adaptSliceSize(channel_id);
+  }
+
+  if (pushed) {
+    uint64_t event_value = 1;
+    write(tx_ring_event, &event_value, sizeof(event_value));
   }
 
   return 1;
 }
 
-uint32_t sequence_id = 0;
-uint32_t frame_id = 0;
-uint16_t rtp_sequence = 0;
+/**
+ * @brief Temporal layer of the frame in stream, 0 for base layer frames
+ *   and position in the run for enhancement frames
+ */
+uint8_t getTemporalLayer(VENC_STREAM_S* stream, bool* independent) {
+  static uint8_t layer = 0;
+  static bool frame_open = false;
+
+  H264E_REF_TYPE_E ref_type = stream_codec == PT_H265 ?
+    stream->stH265Info.enRefType : stream->stH264Info.enRefType;
+  *independent = ref_type == BASE_IDRSLICE;
+
+  // In stream mode a frame may take several streams
+  if (!frame_open) {
+    bool enhance = ref_type == ENHANCE_PSLICE_REFBYENHANCE ||
+      ref_type == ENHANCE_PSLICE_NOTFORREF;
+    layer = enhance ? MIN2(layer + 1, MAX_TEMPORAL_LAYER) : 0;
+  }
 
-void transmit(int socket_handle, uint8_t* tx_buffer, uint32_t tx_size,
-  struct sockaddr* dst_address) {
+  frame_open = stream->u32PackCount &&
+    !stream->pstPack[stream->u32PackCount - 1].bFrameEnd;
+  return layer;
+}
 
-  switch (stream_mode) {
-    // Compact mode
-    case 0:
-      sendto(socket_handle, tx_buffer, tx_size, 0, dst_address, sizeof(struct sockaddr_in));
-      break;
+/**
+ * @brief Account picture slices of stream for adaptive slices
+ * @return true if slice size is due to be retuned
+ */
+bool countSlices(VENC_STREAM_S* stream) {
+  bool due = false;
+  for (uint32_t i = 0; i < stream->u32PackCount; i++) {
+    VENC_PACK_S* pack = &stream->pstPack[i];
+    if (pack->u32Len < pack->u32Offset + 5) {
+      continue;
+    }
 
-    // RTP mode
-    case 1:
-      struct RTPHeader rtp_header;
-      rtp_header.version = 0x80;
-      rtp_header.sequence = htobe16(rtp_sequence++);
-      rtp_header.payload_type = 0x60;
-      rtp_header.timestamp = 0;
-      rtp_header.ssrc_id = 0xDEADBEEF;
-
-      struct iovec iov[2];
-      iov[0].iov_base = &rtp_header;
-      iov[0].iov_len = sizeof(struct RTPHeader);
-      iov[1].iov_base = tx_buffer;
-      iov[1].iov_len = tx_size;
-
-      struct msghdr msg;
-      msg.msg_iovlen = 2;
-      msg.msg_iov = iov;
-      msg.msg_name = dst_address;
-      msg.msg_namelen = sizeof(struct sockaddr_in);
-
-      sendmsg(socket_handle, &msg, 0);
-      break;
+    // Parameter sets and SEI are not slices
+    uint8_t header = pack->pu8Addr[pack->u32Offset + 4];
+    bool picture = stream_codec == PT_H265 ? ((header >> 1) & 0x3F) < 32 :
+      (header & 0x1F) >= 1 && (header & 0x1F) <= 5;
+    if (picture) {
+      due |= slice_control_add(&slice_config, &slice_state,
+        pack->u32Len - pack->u32Offset - 4, pack->bFrameEnd);
+    }
   }
+
+  return due;
 }
 
-void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
-    struct sockaddr* dst_address, uint32_t max_size) {
-  uint8_t prefix = 4;
-  pack_data += prefix;
-  pack_size -= prefix;
+/**
+ * @brief Retune slice size after a complete window of frames
+ */
+void adaptSliceSize(VENC_CHN channel_id) {
+  uint32_t slices = slice_state.slices;
+  uint32_t oversized = slice_state.oversized;
+  struct SliceControlState state = slice_control_step(&slice_config, slice_state);
+  if (state.lines != slice_state.lines) {
+    printf("> Slices: %d of %d over %d bytes -> %d lines\n",
+      oversized, slices, slice_config.target_size, state.lines);
+
+    if (setSliceSize(channel_id, state.lines)) {
+      // Keep previous size, next window retries
+      state.lines = slice_state.lines;
+    }
+  }
 
-  frame_id++;
-  frames_sent++;
+  slice_state = state;
+}
 
-  if (pack_size > nal_max_size) {
-    nal_max_size = pack_size;
+bool isKeyframe(VENC_STREAM_S* stream) {
+  if (!stream->u32PackCount || stream->pstPack[0].u32Len < stream->pstPack[0].u32Offset + 5) {
+    return false;
   }
 
-  if (pack_size <= max_size) {
-    single_packets++;
+  // Parameter sets lead IDR frames, NAL header follows 4 byte start code
+  uint8_t header = stream->pstPack[0].pu8Addr[stream->pstPack[0].u32Offset + 4];
+  if (stream_codec == PT_H265) {
+    uint8_t nal_type = (header >> 1) & 0x3F;
+    return nal_type == 32 || (nal_type >= 16 && nal_type <= 21);
   }
 
-  // Get NAL type
-  uint8_t nal_type = pack_data[0] & 0x1F;
-  switch (nal_type) {
-    case 1:
-      s_count++;
-      break;
+  uint8_t nal_type = header & 0x1F;
+  return nal_type == 7 || nal_type == 5;
+}
 
-    case 5:
-      idr_count++;
-      break;
+int processRecord(VENC_CHN channel_id) {
+  VENC_CHN_STATUS_S channel_status;
+  int ret = HI_MPI_VENC_QueryStatus(channel_id, &channel_status);
+  if (ret != HI_SUCCESS || !channel_status.u32CurPacks) {
+    return 0;
+  }
 
-    case 6:
-      sei_count++;
-      break;
+  // Frame mode returns all NALs of a frame at once
+  VENC_PACK_S packet_descriptor[32];
+  VENC_STREAM_S stream;
+  memset(&stream, 0x00, sizeof(stream));
+  stream.pstPack = packet_descriptor;
+  stream.u32PackCount = MIN2(channel_status.u32CurPacks, 32);
 
-    case 7:
-      sps_count++;
-      break;
+  ret = HI_MPI_VENC_GetStream(channel_id, &stream, 0);
+  if (ret != HI_SUCCESS) {
+    printf("WARN: Failed to get record stream = 0x%x\n", ret);
+    return 0;
+  }
 
-    case 8:
-      pps_count++;
-      break;
+  uint32_t frame_size = 0;
+  for (uint32_t i = 0; i < stream.u32PackCount; i++) {
+    frame_size += stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset;
+  }
 
-    default:
-      break;
+  // Copy with start codes, file is a plain Annex B stream
+  uint8_t* frame = recorder_reserve(&recorder, frame_size, isKeyframe(&stream));
+  if (frame) {
+    for (uint32_t i = 0; i < stream.u32PackCount; i++) {
+      uint32_t size = stream.pstPack[i].u32Len - stream.pstPack[i].u32Offset;
+      memcpy(frame, stream.pstPack[i].pu8Addr + stream.pstPack[i].u32Offset, size);
+      frame += size;
+    }
+    recorder_commit(&recorder, frame_size);
   }
 
-  if (pack_size > max_size + prefix) {
-    uint8_t nal_type_avc = pack_data[0] & 0x1F;
-    uint8_t nal_type_hevc = (pack_data[0] >> 1) & 0x3F;
-    uint8_t nal_bits_avc = pack_data[0] & 0xE0;
-    uint8_t nal_bits_hevc = pack_data[0] & 0x81;
+  HI_MPI_VENC_ReleaseStream(channel_id, &stream);
+  return 1;
+}
 
-    bool start_bit = true;
-    uint8_t tx_size = 2;
+int setupAudio(PAYLOAD_TYPE_E codec, uint32_t samples) {
+  // Mono 8 kHz from inner codec, short frames and few of them buffered
+  AIO_ATTR_S aio_attr;
+  memset(&aio_attr, 0x00, sizeof(aio_attr));
+  aio_attr.enSamplerate = AUDIO_SAMPLE_RATE_8000;
+  aio_attr.enBitwidth = AUDIO_BIT_WIDTH_16;
+  aio_attr.enWorkmode = AIO_MODE_I2S_MASTER;
+  aio_attr.enSoundmode = AUDIO_SOUND_MODE_MONO;
+  aio_attr.u32EXFlag = 0;
+  aio_attr.u32FrmNum = 4;
+  aio_attr.u32PtNumPerFrm = samples;
+  aio_attr.u32ChnCnt = 1;
+  aio_attr.u32ClkSel = 0;
+  aio_attr.enI2sType = AIO_I2STYPE_INNERCODEC;
+
+  int ret = HI_MPI_AI_SetPubAttr(audio_device_id, &aio_attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to set AI configuration = 0x%x\n", ret);
+    return -1;
+  }
 
-    while (pack_size) {
-      uint32_t chunk_size = pack_size > max_size ? max_size : pack_size;
-      if (nal_type_avc == 1 || nal_type_avc == 5) {
-        tx_buffer[0] = nal_bits_avc | 28;
-        tx_buffer[1] = nal_type_avc;
+  ret = HI_MPI_AI_Enable(audio_device_id);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable AI device = 0x%x\n", ret);
+    return -1;
+  }
 
-        if (start_bit) {
-          pack_data++;
-          pack_size--;
-          tx_buffer[1] = 0x80 | nal_type_avc;
-          start_bit = false;
-        }
+  ret = HI_MPI_AI_EnableChn(audio_device_id, audio_channel_id);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to enable AI channel = 0x%x\n", ret);
+    return -1;
+  }
 
-        if (chunk_size == pack_size) {
-          tx_buffer[1] |= 0x40;
-        }
-      }
+  AENC_ATTR_G711_S g711_attr;
+  AENC_ATTR_ADPCM_S adpcm_attr;
+  memset(&g711_attr, 0x00, sizeof(g711_attr));
+  adpcm_attr.enADPCMType = ADPCM_TYPE_DVI4;
 
-      if (nal_type_hevc == 1 || nal_type_hevc == 19) {
-        tx_buffer[0] = nal_bits_hevc | 49 << 1;
-        tx_buffer[1] = 1;
-        tx_buffer[2] = nal_type_hevc;
-        tx_size = 3;
-
-        if (start_bit) {
-          pack_data += 2;
-          pack_size -= 2;
-          tx_buffer[2] = 0x80 | nal_type_hevc;
-          start_bit = false;
-        }
+  AENC_CHN_ATTR_S aenc_attr;
+  memset(&aenc_attr, 0x00, sizeof(aenc_attr));
+  aenc_attr.enType = codec;
+  aenc_attr.u32PtNumPerFrm = samples;
+  aenc_attr.u32BufSize = 4;
+  aenc_attr.pValue = codec == PT_ADPCMA ? (HI_VOID*)&adpcm_attr : (HI_VOID*)&g711_attr;
 
-        if (chunk_size == pack_size) {
-          tx_buffer[2] |= 0x40;
-        }
-      }
+  ret = HI_MPI_AENC_CreateChn(audio_channel_id, &aenc_attr);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to create AENC channel = 0x%x\n", ret);
+    return -1;
+  }
 
-      memcpy(tx_buffer + tx_size, pack_data, chunk_size + tx_size);
-      transmit(socket_handle, tx_buffer, chunk_size + tx_size, dst_address);
+  MPP_CHN_S ai_src;
+  MPP_CHN_S aenc_dst;
 
-      packets_sent++;
-      bytes_sent += chunk_size + tx_size;
+  ai_src.enModId = HI_ID_AI;
+  ai_src.s32DevId = audio_device_id;
+  ai_src.s32ChnId = audio_channel_id;
 
-      pack_data += chunk_size;
-      pack_size -= chunk_size;
-    }
-  } else {
-    transmit(socket_handle, pack_data, pack_size, dst_address);
-    packets_sent++;
+  aenc_dst.enModId = HI_ID_AENC;
+  aenc_dst.s32DevId = 0;
+  aenc_dst.s32ChnId = audio_channel_id;
+
+  ret = HI_MPI_SYS_Bind(&ai_src, &aenc_dst);
+  if (ret != HI_SUCCESS) {
+    printf("ERROR: Unable to bind AI to AENC = 0x%x\n", ret);
+    return -1;
+  }
+
+  int audio_fd = HI_MPI_AENC_GetFd(audio_channel_id);
+  if (audio_fd < 0) {
+    printf("ERROR: Unable to get AENC channel fd = 0x%x\n", audio_fd);
+    return -1;
   }
+
+  printf("> Audio = %s, %d ms frames\n", codec == PT_G711A ? "G.711 A-law" :
+    codec == PT_G711U ? "G.711 u-law" : "ADPCM DVI4", samples * 1000 / AUDIO_SAMPLE_RATE);
+  return audio_fd;
+}
+
+int processAudio() {
+  AUDIO_STREAM_S stream;
+  int ret = HI_MPI_AENC_GetStream(audio_channel_id, &stream, 0);
+  if (ret != HI_SUCCESS) {
+    return 0;
+  }
+
+  // Frame header is only meaningful to HiSilicon decoders, RTP carries size
+  uint8_t* data = stream.pStream;
+  uint32_t size = stream.u32Len;
+  if (size > AUDIO_HISI_HEADER && data[0] == 0x00 && data[1] == 0x01) {
+    data += AUDIO_HISI_HEADER;
+    size -= AUDIO_HISI_HEADER;
+  }
+
+  if (size <= AUDIO_MAX_FRAME) {
+    sendAudio(data, size, stream.u64TimeStamp);
+  }
+
+  HI_MPI_AENC_ReleaseStream(audio_channel_id, &stream);
+  return 1;
+}
+
+void stopAudio() {
+  MPP_CHN_S ai_src;
+  MPP_CHN_S aenc_dst;
+
+  ai_src.enModId = HI_ID_AI;
+  ai_src.s32DevId = audio_device_id;
+  ai_src.s32ChnId = audio_channel_id;
+
+  aenc_dst.enModId = HI_ID_AENC;
+  aenc_dst.s32DevId = 0;
+  aenc_dst.s32ChnId = audio_channel_id;
+
+  HI_MPI_SYS_UnBind(&ai_src, &aenc_dst);
+  HI_MPI_AENC_DestroyChn(audio_channel_id);
+  HI_MPI_AI_DisableChn(audio_device_id, audio_channel_id);
+  HI_MPI_AI_Disable(audio_device_id);
 }
@@ -1,7 +1,10 @@
 #pragma once
+#define _GNU_SOURCE
 #define _POSIX_TIMERS
 #define _REENTRANT
+#include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,9 +16,17 @@
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
 
 #include "hi_buffer.h"
 #include "hi_comm_adec.h"
@@ -51,11 +62,75 @@
 #include "mpi_vo.h"
 #include "mpi_vpss.h"
 
+#include "audio.h"
+#include "congestion.h"
+#include "fec.h"
+#include "feedback.h"
+#include "latency_budget.h"
+#include "metrics.h"
+#include "packet_ring.h"
+#include "rate_control.h"
+#include "recorder.h"
+#include "slice_control.h"
+
 typedef enum SensorType {
   IMX307 = 0,
   IMX335 = 1
 } SensorType;
 
+// Maximum number of stream destinations
+#define MAX_SINKS 4
+
+// Maximum number of events handled per epoll_wait call
+#define MAX_EPOLL_EVENTS 8
+
+// Maximum number of datagrams sent by a single sendmmsg call
+#define TX_BATCH_SIZE 128
+
+// Transmit modes: sendmsg per datagram, sendmmsg per batch, UDP GSO
+#define TX_MODE_PLAIN 0
+#define TX_MODE_BATCH 1
+#define TX_MODE_GSO 2
+
+// UDP GSO limits, segments per send and total payload
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_SIZE (65535 - 20 - 8)
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// Datagrams sent closer than this are counted as one burst
+#define PACE_BURST_GAP_NS 20000
+
+// Transmit ring between encoder and sender threads
+#define TX_RING_PACKS 256
+#define TX_RING_SIZE (1024 * 1024)
+
+// Retransmission cache, bounds of slots per sink sized from NACK window and
+// max cached datagram size
+#define NACK_MIN_SLOTS 64
+#define NACK_MAX_SLOTS 32768
+#define NACK_MAX_DATAGRAM 1500
+
+// Retransmission requests passed from feedback to sender thread
+#define NACK_QUEUE_SIZE 64
+
+// Keyframe requests closer than this are served by a single IDR, ms
+#define KEYFRAME_MIN_INTERVAL 500
+
+// Parameter set cache: VPS, SPS, PPS, largest cached set with start code
+#define PS_CACHE_SETS 3
+#define PS_CACHE_SIZE 256
+
+// Maximum number of NAL units in one STAP-A / AP packet
+#define AGGREGATE_MAX_NALS 4
+
+// Per-datagram vectors: RTP header, layer extension, aggregation header,
+// size + NAL pairs
+#define TX_MAX_VECTORS (3 + AGGREGATE_MAX_NALS * 2)
+#define TX_HEADER_SIZE (2 + AGGREGATE_MAX_NALS * 2)
+
 #pragma pack(push, 1)
 struct RTPHeader {
   uint8_t version;
@@ -64,13 +139,255 @@ struct RTPHeader {
   uint32_t timestamp;
   uint32_t ssrc_id;
 };
+
+// RTP frame marking extension (RFC 9626, long form for scalable streams)
+// in a one-byte header extension block (RFC 8285)
+struct RTPFrameMarking {
+  uint16_t profile;           // 0xBEDE
+  uint16_t length;            // 32-bit words following
+  uint8_t id_length;          // Extension ID, data size - 1
+  uint8_t flags;              // S, E, I, D, B bits and temporal layer ID
+  uint8_t layer_id;           // Spatial / quality layer, always 0
+  uint8_t tl0_index;          // Running index of base layer frames
+};
 #pragma pack(pop)
 
+// Extension ID of frame marking, receivers map it with a=extmap
+#define RTP_FRAME_MARKING_ID 1
+
+// Frame marking flags
+#define FRAME_MARKING_START 0x80
+#define FRAME_MARKING_END 0x40
+#define FRAME_MARKING_INDEPENDENT 0x20
+#define FRAME_MARKING_DISCARDABLE 0x10
+
+// Highest temporal layer ID, 3 bits in frame marking
+#define MAX_TEMPORAL_LAYER 7
+
+// Tx ring fill to start dropping enhancement layer frames at, percent
+#define LAYER_DROP_FILL 50
+
+// Pack copied into Tx ring
+struct TxPack {
+  uint32_t offset;
+  uint32_t size;
+  uint64_t pts;
+  bool frame_end;
+  bool flush;         // Last pack of a VENC stream, send the batch
+  uint8_t layer;      // Temporal layer, 0 - base
+  bool independent;   // IDR frame
+};
+
+// FEC block being accumulated by the sender
+struct FECBlock {
+  uint16_t base_sequence;
+  uint8_t data_count;
+  uint16_t symbol_size;
+  uint8_t parity[FEC_MAX_PARITY][FEC_MAX_SYMBOL];
+};
+
+// Sent datagram kept for retransmission
+struct NackSlot {
+  uint16_t sequence;
+  uint16_t size;
+  uint64_t sent;              // First transmission time, ns
+  uint64_t deadline;          // Playout deadline of its frame, ns
+  uint8_t data[NACK_MAX_DATAGRAM];
+};
+
+// Retransmission request for a sink
+struct NackRequest {
+  uint8_t sink;
+  uint16_t sequence;
+  uint16_t bitmask;
+};
+
+// Stream destination, every sink packetizes the same packs on its own
+struct Sink {
+  int socket_handle;
+  struct sockaddr_in address;
+  uint8_t mode;               // 0 - compact, 1 - RTP
+  uint32_t mtu;
+  bool limit_to_mtu;          // Payload size is derived from MTU
+  uint32_t max_size;          // Max payload size per datagram
+  uint8_t fec_data_count;
+  uint8_t fec_parity_count;
+  uint8_t fec_depth;
+
+  // AF_PACKET transmit ring instead of UDP socket
+  char packet_interface[16];
+  enum PacketLink packet_link;
+  struct PacketRing* packet_ring;
+
+  // Congestion manager, kernel queue is sampled at every frame start
+  struct CongestionState congestion;
+  uint32_t send_buffer;       // SO_SNDBUF, bytes
+  bool frame_open;            // Packs of current frame already seen
+  bool blocked;               // Socket returned EAGAIN during current frame
+
+  // Tx batch
+  struct mmsghdr messages[TX_BATCH_SIZE];
+  struct iovec vectors[TX_BATCH_SIZE][TX_MAX_VECTORS];
+  struct RTPHeader rtp_headers[TX_BATCH_SIZE];
+  struct RTPFrameMarking frame_markings[TX_BATCH_SIZE];
+  bool frame_started;         // Datagram of current frame already sent
+
+  // Last datagram of current frame while still in the batch, marked after
+  // the fact when the frame-final NAL is shed
+  int32_t frame_last;         // Batch index, -1 if none
+  struct FECBlock* frame_last_block;
+  uint8_t frame_last_index;   // Position in its FEC block
+  int32_t frame_last_parity;  // First parity buffer of its block, -1 if open
+  uint8_t nal_headers[TX_BATCH_SIZE][TX_HEADER_SIZE];
+  uint32_t header_used;
+  uint32_t batch_count;
+
+  // Send pacing
+  uint64_t pace_arrival;
+  uint64_t departures[TX_BATCH_SIZE];
+  uint8_t control[TX_BATCH_SIZE][CMSG_SPACE(sizeof(uint64_t))];
+
+  // Batch regrouped for UDP GSO, equal size datagrams share one message
+  struct mmsghdr gso_messages[TX_BATCH_SIZE];
+  struct iovec gso_vectors[TX_BATCH_SIZE * TX_MAX_VECTORS];
+  uint8_t gso_control[TX_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+  uint8_t gso_segments[TX_BATCH_SIZE];
+
+  // RTP and FEC state
+  uint16_t rtp_sequence;
+  uint16_t fec_sequence;
+  uint8_t fec_block_index;
+  struct FECBlock* fec_blocks;
+
+  // Parity of blocks closed during current batch, FEC header and symbol
+  // per datagram, referenced by the batch until it is sent
+  uint8_t* fec_parity_out;
+  uint32_t fec_parity_stride;
+  uint32_t fec_parity_used;
+
+  // Retransmission cache, RTP mode only
+  struct NackSlot* nack_cache;
+  uint32_t nack_slots;        // Power of two, covers NACK window at max rate
+  uint32_t nack_timestamp;
+  uint64_t nack_frame_start;
+
+  // NALs waiting for aggregation
+  uint8_t* aggregate_data[AGGREGATE_MAX_NALS];
+  uint32_t aggregate_sizes[AGGREGATE_MAX_NALS];
+  uint32_t aggregate_count;
+  uint32_t aggregate_size;
+
+  // Counters
+  uint32_t bytes_sent;
+  uint32_t packets_sent;
+  uint32_t errors;
+};
+
+// Transmit path state, defined in transport.c
+extern uint8_t stream_mode;
+extern PAYLOAD_TYPE_E stream_codec;
+extern uint8_t pace_percent;
+extern uint8_t pace_burst;
+extern bool pace_txtime;
+extern uint8_t tx_mode;
+extern struct Sink sinks[MAX_SINKS];
+extern uint8_t sink_count;
+extern uint64_t pace_rate;
+extern uint32_t tx_max_rate;
+extern uint64_t pace_burst_ns;
+extern uint32_t pace_framerate;
+extern clockid_t pace_clock;
+extern uint16_t metrics_port;
+extern struct MetricsState metrics_state;
+extern struct MetricsSnapshot metrics_published;
+extern pthread_mutex_t metrics_lock;
+extern uint32_t nack_window;
+extern uint32_t keyframe_requests;
+extern uint32_t tx_ring_overflows;
+extern bool layer_marking;
+extern uint32_t ps_interval;
+extern uint32_t ps_refresh_frames;
+extern uint32_t layer_frames_dropped;
+extern uint64_t packets_total;
+extern uint64_t bytes_total;
+extern int tx_ring_event;
+extern bool loop_running;
+
 void* __ISP_THREAD__(void* param);
-int processStream(VENC_CHN channel_id, int socket_handle,
-  struct sockaddr* dst_address, uint16_t max_frame_size);
-void sendPacket(uint8_t* pack_data, uint32_t pack_size, int socket_handle,
-  struct sockaddr* dst_address, uint32_t max_size);
+void* __SENDER_THREAD__(void* param);
+int startSender(pthread_t* thread, int cpu);
+void stopSender(pthread_t thread);
+bool isTxRingEmpty();
+bool isLayerDropped(uint8_t layer, uint32_t packs);
+int pushPack(uint8_t* data, uint32_t size, uint64_t pts, bool frame_end, bool flush,
+  uint8_t layer, bool independent);
+void cutFrame(bool frame_end);
+double getTimeInterval(struct timespec* timestamp, struct timespec* last_meansure_timestamp);
+uint64_t getNanoseconds(clockid_t clock);
+void queueNack(struct NackMessage* message, int size, struct sockaddr_in* source);
+int addEpollSource(int epoll_fd, int fd);
+int openFeedbackSocket(uint16_t port);
+void processFeedback(int feedback_fd, VENC_CHN channel_id);
+void requestKeyframe(VENC_CHN channel_id);
+void answerPing(int feedback_fd, struct ClockPing* ping, uint64_t receive_time,
+  struct sockaddr_in* source);
+void insertLatencyRecord(VENC_CHN channel_id, VENC_STREAM_S* stream);
+int openLocalSocket(uint16_t port, const char* purpose);
+void processControl(int control_fd, VENC_CHN channel_id);
+int applyControl(const char* command, VENC_CHN channel_id);
+int setGOP(VENC_CHN channel_id, uint32_t gop);
+int setQpRange(VENC_CHN channel_id, uint32_t min_qp, uint32_t max_qp);
+int setRoi(VENC_CHN channel_id, bool enable, int32_t qp);
+int setSliceSize(VENC_CHN channel_id, uint32_t lines);
+int setExposureLimit(uint32_t max_time);
+void serveNacks();
+int setBitrate(VENC_CHN channel_id, uint32_t rate);
+int enableTxTime(int socket_handle);
+int parseTxMode(const char* value);
+int enableGSO(int socket_handle);
+int sendSegments(struct Sink* sink, uint32_t offset, uint32_t count);
+int parseFEC(const char* value, uint8_t* data_count, uint8_t* parity_count);
+int parsePacketInterface(struct Sink* sink, const char* value);
+int parseSink(struct Sink* sink, struct Sink* defaults, const char* options);
+uint32_t getRtpHeaderSize(struct Sink* sink);
+int setupSink(struct Sink* sink, uint8_t index);
+int processStream(VENC_CHN channel_id);
+uint8_t getTemporalLayer(VENC_STREAM_S* stream, bool* independent);
+int setupRecordChannel(VPSS_GRP vpss_group_id, VPSS_CHN vpss_channel_id,
+  VENC_CHN venc_channel_id, PAYLOAD_TYPE_E codec, bool mirror, bool flip);
+bool countSlices(VENC_STREAM_S* stream);
+void adaptSliceSize(VENC_CHN channel_id);
+bool isKeyframe(VENC_STREAM_S* stream);
+int processRecord(VENC_CHN channel_id);
+void printStats();
+void printSnapshot(struct MetricsSnapshot* snapshot);
+void processMetrics(int metrics_fd);
+void countPack(uint8_t* pack_data, uint32_t pack_size, uint64_t pts, bool frame_end);
+void sendPacket(struct Sink* sink, uint8_t* pack_data, uint32_t pack_size,
+  bool frame_end);
+void markFrameEnd(struct Sink* sink);
+void endFrame(struct Sink* sink);
+void flushAggregate(struct Sink* sink, bool marker);
+int queueRing(struct Sink* sink, uint32_t offset, uint32_t count);
+void setPaceRate(uint32_t bitrate);
+void paceFrame(uint32_t index, uint32_t head);
+void flushPackets(struct Sink* sink);
+uint32_t getQueueFill(struct Sink* sink);
+bool waitWritable(struct Sink* sink);
+void kickSink(struct Sink* sink);
+void cacheDatagram(struct Sink* sink);
+void finishBurst();
+void requestParameterSets();
+void updateParameterSets(struct TxPack* pack, enum CongestionClass nal_class,
+  bool frame_start);
+int openAudio(uint8_t payload_type);
+void closeAudio();
+void sendAudio(uint8_t* data, uint32_t size, uint64_t pts);
+int setupAudio(PAYLOAD_TYPE_E codec, uint32_t samples);
+int processAudio();
+void stopAudio();
+void openCycleCounter();
+void measureCpu(struct MetricsSnapshot* snapshot);
 HI_S32 getGOPAttributes(VENC_GOP_MODE_E enGopMode, VENC_GOP_ATTR_S* pstGopAttr);
 
 int mipi_set_hs_mode(int device, lane_divide_mode_t mode);
@@ -0,0 +1,171 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+
+void metrics_init(struct MetricsState* state, bool hevc, uint32_t single_size) {
+  memset(state, 0x00, sizeof(*state));
+  state->hevc = hevc;
+  state->single_size = single_size;
+}
+
+static enum MetricsNal metrics_classify(bool hevc, uint8_t header) {
+  if (hevc) {
+    uint8_t type = (header >> 1) & 0x3F;
+    if (type >= 16 && type <= 21) {
+      return METRICS_NAL_IDR;
+    }
+
+    switch (type) {
+      case 32: return METRICS_NAL_VPS;
+      case 33: return METRICS_NAL_SPS;
+      case 34: return METRICS_NAL_PPS;
+      case 39:
+      case 40: return METRICS_NAL_SEI;
+      default: return type < 32 ? METRICS_NAL_SLICE : METRICS_NAL_OTHER;
+    }
+  }
+
+  switch (header & 0x1F) {
+    case 1: return METRICS_NAL_SLICE;
+    case 5: return METRICS_NAL_IDR;
+    case 6: return METRICS_NAL_SEI;
+    case 7: return METRICS_NAL_SPS;
+    case 8: return METRICS_NAL_PPS;
+    default: return METRICS_NAL_OTHER;
+  }
+}
+
+void metrics_pack(struct MetricsState* state, const uint8_t* nal, uint32_t size,
+  uint64_t pts, bool frame_end) {
+  struct MetricsSnapshot* current = &state->current;
+  current->bytes += size;
+  current->nals++;
+
+  if (size > current->nal_max_size) {
+    current->nal_max_size = size;
+  }
+
+  if (size <= state->single_size) {
+    current->nals_single++;
+  }
+
+  if (size) {
+    current->nal_counts[metrics_classify(state->hevc, nal[0])]++;
+  }
+
+  state->frame_size += size;
+  if (!frame_end) {
+    return;
+  }
+
+  // Frame size histogram
+  uint32_t bin = 0;
+  while (bin + 1 < METRICS_SIZE_BINS && state->frame_size >= (1024u << bin)) {
+    bin++;
+  }
+  current->frame_sizes[bin]++;
+  current->frames++;
+
+  if (state->frame_size > current->frame_max_size) {
+    current->frame_max_size = state->frame_size;
+  }
+  state->frame_size = 0;
+
+  // Frame interval histogram and jitter from capture PTS
+  if (state->frame_pts && pts > state->frame_pts) {
+    int64_t interval = pts - state->frame_pts;
+    bin = interval / METRICS_INTERVAL_STEP;
+    current->frame_intervals[bin < METRICS_INTERVAL_BINS ? bin : METRICS_INTERVAL_BINS - 1]++;
+
+    if (interval > current->frame_interval_max) {
+      current->frame_interval_max = interval;
+    }
+
+    if (state->frame_interval) {
+      int64_t delta = interval - state->frame_interval;
+      if (delta < 0) {
+        delta = -delta;
+      }
+      state->jitter += ((int64_t)delta - state->jitter) / 16;
+    }
+    state->frame_interval = interval;
+  }
+  state->frame_pts = pts;
+}
+
+void metrics_finish(struct MetricsState* state, struct MetricsSnapshot* snapshot,
+  uint32_t interval) {
+  *snapshot = state->current;
+  snapshot->version = METRICS_VERSION;
+  snapshot->codec = state->hevc ? 265 : 264;
+  snapshot->sequence = state->sequence++;
+  snapshot->interval = interval;
+  snapshot->jitter = state->jitter;
+
+  memset(&state->current, 0x00, sizeof(state->current));
+}
+
+static uint32_t metrics_array(char* buffer, uint32_t size, const char* name,
+  const uint32_t* values, uint32_t count) {
+  uint32_t length = snprintf(buffer, size, "\"%s\":[", name);
+  for (uint32_t i = 0; i < count && length < size; i++) {
+    length += snprintf(buffer + length, size - length, "%s%u", i ? "," : "", values[i]);
+  }
+
+  if (length < size) {
+    length += snprintf(buffer + length, size - length, "],");
+  }
+  return length;
+}
+
+uint32_t metrics_json(const struct MetricsSnapshot* snapshot, char* buffer,
+  uint32_t size) {
+  const struct MetricsSnapshot* s = snapshot;
+  uint32_t length = snprintf(buffer, size,
+    "{\"version\":%u,\"codec\":%u,\"sequence\":%u,\"interval\":%u,"
+    "\"bytes\":%llu,\"nals\":%u,\"nals_single\":%u,\"nal_max_size\":%u,"
+    "\"idr\":%u,\"slice\":%u,\"sei\":%u,\"vps\":%u,\"sps\":%u,\"pps\":%u,\"other\":%u,"
+    "\"frames\":%u,\"frame_max_size\":%u,\"frame_interval_max\":%u,\"jitter\":%u,",
+    s->version, s->codec, s->sequence, s->interval,
+    (unsigned long long)s->bytes, s->nals, s->nals_single, s->nal_max_size,
+    s->nal_counts[METRICS_NAL_IDR], s->nal_counts[METRICS_NAL_SLICE],
+    s->nal_counts[METRICS_NAL_SEI], s->nal_counts[METRICS_NAL_VPS],
+    s->nal_counts[METRICS_NAL_SPS], s->nal_counts[METRICS_NAL_PPS],
+    s->nal_counts[METRICS_NAL_OTHER],
+    s->frames, s->frame_max_size, s->frame_interval_max, s->jitter);
+
+  if (length < size) {
+    length += metrics_array(buffer + length, size - length, "frame_sizes",
+      s->frame_sizes, METRICS_SIZE_BINS);
+  }
+
+  if (length < size) {
+    length += metrics_array(buffer + length, size - length, "frame_intervals",
+      s->frame_intervals, METRICS_INTERVAL_BINS);
+  }
+
+  if (length < size) {
+    length += metrics_array(buffer + length, size - length, "shed",
+      s->shed, CONGESTION_CLASSES);
+  }
+
+  if (length < size) {
+    length += snprintf(buffer + length, size - length,
+      "\"packets\":%u,\"packets_aggregated\":%u,\"packets_fec\":%u,"
+      "\"packets_dropped\":%u,\"nals_fragmented\":%u,\"nals_oversized\":%u,"
+      "\"syscalls\":%u,\"bursts\":%u,\"burst_max\":%u,\"burst_gap\":%u,"
+      "\"ring_fill_max\":%u,\"ring_overflows\":%u,\"retransmitted\":%u,"
+      "\"nacks_late\":%u,\"nacks_missing\":%u,\"keyframe_requests\":%u,"
+      "\"parameter_sets_resent\":%u,"
+      "\"cpu_per_packet\":%u,\"cycles_per_packet\":%u,\"layer_dropped\":%u,"
+      "\"queue_fill_max\":%u,\"audio_frames\":%u,\"audio_dropped\":%u}\n",
+      s->packets, s->packets_aggregated, s->packets_fec, s->packets_dropped,
+      s->nals_fragmented, s->nals_oversized, s->syscalls, s->bursts,
+      s->burst_max, s->burst_gap, s->ring_fill_max, s->ring_overflows,
+      s->retransmitted, s->nacks_late, s->nacks_missing, s->keyframe_requests,
+      s->parameter_sets_resent, s->cpu_per_packet, s->cycles_per_packet, s->layer_dropped, s->queue_fill_max,
+      s->audio_frames, s->audio_dropped);
+  }
+
+  return length < size ? length : size - 1;
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "congestion.h"
+
+/*
+ * Stream metrics.
+ *
+ * Sender thread accounts every pack, counters cover one interval and are
+ * published as a flat snapshot, which local monitoring tools read either
+ * as is (binary, host byte order) or rendered as JSON.
+ */
+
+#define METRICS_VERSION 6
+
+// Frame size histogram, bin i counts frames below (1 KB << i), last bin the rest
+#define METRICS_SIZE_BINS 12
+
+// Frame interval histogram, bins are METRICS_INTERVAL_STEP us wide, last bin the rest
+#define METRICS_INTERVAL_BINS 16
+#define METRICS_INTERVAL_STEP 4000
+
+// NAL unit classes, same for H.264 and H.265
+enum MetricsNal {
+  METRICS_NAL_IDR,            // IDR, H.265 IRAP
+  METRICS_NAL_SLICE,          // Other picture slices
+  METRICS_NAL_SEI,
+  METRICS_NAL_VPS,
+  METRICS_NAL_SPS,
+  METRICS_NAL_PPS,
+  METRICS_NAL_OTHER,
+  METRICS_NAL_CLASSES
+};
+
+#pragma pack(push, 1)
+struct MetricsSnapshot {
+  uint16_t version;           // METRICS_VERSION
+  uint16_t codec;             // 264 or 265
+  uint32_t sequence;          // Snapshot number
+  uint32_t interval;          // Interval covered, ms
+
+  // Encoded stream
+  uint64_t bytes;
+  uint32_t nals;
+  uint32_t nals_single;       // NALs fitting into one packet
+  uint32_t nal_max_size;
+  uint32_t nal_counts[METRICS_NAL_CLASSES];
+  uint32_t frames;
+  uint32_t frame_max_size;
+  uint32_t frame_sizes[METRICS_SIZE_BINS];
+  uint32_t frame_intervals[METRICS_INTERVAL_BINS];
+  uint32_t frame_interval_max; // us
+  uint32_t jitter;            // Frame interval jitter (RFC 3550 estimator), us
+
+  // Transmission
+  uint32_t packets;
+  uint32_t packets_aggregated;
+  uint32_t packets_fec;
+  uint32_t packets_dropped;
+  uint32_t nals_fragmented;
+  uint32_t nals_oversized;
+  uint32_t syscalls;
+  uint32_t bursts;
+  uint32_t burst_max;
+  uint32_t burst_gap;         // Average gap between bursts, ns
+  uint32_t ring_fill_max;     // Percent
+  uint32_t ring_overflows;
+  uint32_t retransmitted;
+  uint32_t nacks_late;
+  uint32_t nacks_missing;
+  uint32_t keyframe_requests;
+  uint32_t parameter_sets_resent; // Cached parameter sets sent ahead of a frame
+  uint32_t cpu_per_packet;    // Sender thread CPU time per datagram, ns
+  uint32_t cycles_per_packet; // Sender thread CPU cycles per datagram, 0 if unknown
+  uint32_t layer_dropped;     // Enhancement layer frames dropped by sender
+  uint32_t queue_fill_max;    // Kernel send queue, percent
+  uint32_t shed[CONGESTION_CLASSES]; // NALs dropped by congestion manager per class
+
+  // Audio
+  uint32_t audio_frames;      // Encoded audio frames sent
+  uint32_t audio_dropped;     // Audio frames not sent to every sink
+};
+#pragma pack(pop)
+
+// Accounting state, owned by one thread
+struct MetricsState {
+  struct MetricsSnapshot current;
+  bool hevc;
+  uint32_t single_size;       // Largest NAL sent in one packet
+  uint32_t frame_size;        // Size of frame being accounted
+  uint64_t frame_pts;         // PTS of previous frame, us
+  int64_t frame_interval;     // Previous frame interval, us
+  uint32_t jitter;            // Kept across intervals, us
+  uint32_t sequence;
+};
+
+/**
+ * @brief Reset accounting state
+ * @param state - State
+ * @param hevc - Stream is H.265
+ * @param single_size - Largest NAL sent in one packet
+ */
+void metrics_init(struct MetricsState* state, bool hevc, uint32_t single_size);
+
+/**
+ * @brief Account encoded pack
+ * @param state - State
+ * @param nal - NAL data without start code
+ * @param size - NAL size
+ * @param pts - Pack PTS, us
+ * @param frame_end - Last pack of the frame
+ */
+void metrics_pack(struct MetricsState* state, const uint8_t* nal, uint32_t size,
+  uint64_t pts, bool frame_end);
+
+/**
+ * @brief Finish interval and start a new one
+ * @param state - State
+ * @param snapshot - Output snapshot, transmission counters are left for caller
+ * @param interval - Interval length, ms
+ */
+void metrics_finish(struct MetricsState* state, struct MetricsSnapshot* snapshot,
+  uint32_t interval);
+
+/**
+ * @brief Render snapshot as JSON object
+ * @param snapshot - Snapshot
+ * @param buffer - Output text
+ * @param size - Buffer size
+ * @return Text length, truncated to buffer size
+ */
+uint32_t metrics_json(const struct MetricsSnapshot* snapshot, char* buffer,
+  uint32_t size);
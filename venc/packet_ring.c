@@ -0,0 +1,292 @@
+#include "packet_ring.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define PACKET_RING_BLOCK_FRAMES 32
+#define PACKET_RING_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+static const uint8_t radiotap_header[] = {
+  0x00, 0x00, 0x0D, 0x00,     // Version, padding, length 13
+  0x00, 0x80, 0x08, 0x00,     // Present: TX flags, MCS
+  0x08, 0x00,                 // TX flags: no ACK
+  0x07, 0x00,                 // MCS known: bandwidth, index, guard interval; 20 MHz, long GI
+  PACKET_RING_RADIOTAP_MCS
+};
+
+static const uint8_t llc_snap_header[] = { 0xAA, 0xAA, 0x03, 0x00, 0x00, 0x00, 0x08, 0x00 };
+
+static uint16_t packet_ring_checksum(const uint8_t* data, uint32_t size) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i + 1 < size; i += 2) {
+    sum += data[i] << 8 | data[i + 1];
+  }
+
+  while (sum >> 16) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return ~sum;
+}
+
+static int packet_ring_interface(int socket_handle, const char* interface,
+  unsigned long request, struct ifreq* ifr) {
+  memset(ifr, 0x00, sizeof(*ifr));
+  strncpy(ifr->ifr_name, interface, IFNAMSIZ - 1);
+  return ioctl(socket_handle, request, ifr);
+}
+
+/**
+ * @brief Build link, IPv4 and UDP header template
+ */
+static int packet_ring_template(struct PacketRing* ring, const char* interface,
+  enum PacketLink link, const struct sockaddr_in* destination) {
+  struct ifreq ifr;
+  if (packet_ring_interface(ring->socket_handle, interface, SIOCGIFHWADDR, &ifr)) {
+    printf("ERROR: Unable to get address of [%s]: %s\n", interface, strerror(errno));
+    return 1;
+  }
+
+  uint8_t source_mac[6];
+  memcpy(source_mac, ifr.ifr_hwaddr.sa_data, sizeof(source_mac));
+
+  // Interface may have no address, e.g. in monitor mode
+  uint32_t source_ip = 0;
+  if (!packet_ring_interface(ring->socket_handle, interface, SIOCGIFADDR, &ifr)) {
+    source_ip = ((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr;
+  }
+
+  // Destination from neighbour table, broadcast if it is not resolved yet
+  uint8_t destination_mac[6];
+  memset(destination_mac, 0xFF, sizeof(destination_mac));
+
+  struct arpreq arp;
+  memset(&arp, 0x00, sizeof(arp));
+  memcpy(&arp.arp_pa, destination, sizeof(*destination));
+  strncpy(arp.arp_dev, interface, sizeof(arp.arp_dev) - 1);
+  if (link == PACKET_LINK_ETHERNET &&
+      !ioctl(ring->socket_handle, SIOCGARP, &arp) && (arp.arp_flags & ATF_COM)) {
+    memcpy(destination_mac, arp.arp_ha.sa_data, sizeof(destination_mac));
+  }
+
+  uint8_t* header = ring->header;
+  uint32_t size = 0;
+
+  if (link == PACKET_LINK_RADIOTAP) {
+    memcpy(header, radiotap_header, sizeof(radiotap_header));
+    size += sizeof(radiotap_header);
+
+    // 802.11 data frame, From/To DS clear, sequence is set by driver
+    uint8_t* frame = header + size;
+    memset(frame, 0x00, 24);
+    frame[0] = 0x08;
+    memcpy(frame + 4, destination_mac, 6);
+    memcpy(frame + 10, source_mac, 6);
+    memcpy(frame + 16, source_mac, 6);
+    size += 24;
+
+    memcpy(header + size, llc_snap_header, sizeof(llc_snap_header));
+    size += sizeof(llc_snap_header);
+  } else {
+    memcpy(header, destination_mac, 6);
+    memcpy(header + 6, source_mac, 6);
+    header[12] = ETHERTYPE_IP >> 8;
+    header[13] = ETHERTYPE_IP & 0xFF;
+    size += 14;
+  }
+
+  // IPv4, don't fragment, length, identification and checksum per datagram
+  ring->ip_offset = size;
+  uint8_t* ip = header + size;
+  memset(ip, 0x00, 20);
+  ip[0] = 0x45;
+  ip[6] = 0x40;
+  ip[8] = 64;
+  ip[9] = IPPROTO_UDP;
+  memcpy(ip + 12, &source_ip, 4);
+  memcpy(ip + 16, &destination->sin_addr.s_addr, 4);
+  size += 20;
+
+  // UDP from the destination port, checksum is optional over IPv4
+  uint8_t* udp = header + size;
+  memset(udp, 0x00, 8);
+  memcpy(udp, &destination->sin_port, 2);
+  memcpy(udp + 2, &destination->sin_port, 2);
+  size += 8;
+
+  ring->header_size = size;
+
+  printf("> Packet ring on %s, %s, %02x:%02x:%02x:%02x:%02x:%02x -> "
+    "%02x:%02x:%02x:%02x:%02x:%02x\n", interface,
+    link == PACKET_LINK_RADIOTAP ? "radiotap" : "ethernet",
+    source_mac[0], source_mac[1], source_mac[2], source_mac[3], source_mac[4], source_mac[5],
+    destination_mac[0], destination_mac[1], destination_mac[2],
+    destination_mac[3], destination_mac[4], destination_mac[5]);
+  return 0;
+}
+
+int packet_ring_open(struct PacketRing* ring, const char* interface,
+  enum PacketLink link, const struct sockaddr_in* destination) {
+  memset(ring, 0x00, sizeof(*ring));
+
+  // Protocol 0, socket only transmits
+  ring->socket_handle = socket(AF_PACKET, SOCK_RAW, 0);
+  if (ring->socket_handle < 0) {
+    printf("ERROR: Unable to create packet socket: %s\n", strerror(errno));
+    return 1;
+  }
+
+  int version = TPACKET_V2;
+  if (setsockopt(ring->socket_handle, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+    printf("ERROR: Unable to set TPACKET_V2: %s\n", strerror(errno));
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  // Malformed frames are skipped instead of stopping the ring
+  int enable = 1;
+  setsockopt(ring->socket_handle, SOL_PACKET, PACKET_LOSS, &enable, sizeof(enable));
+
+  // Frames go straight to the driver, pacing is done before the kick
+  setsockopt(ring->socket_handle, SOL_PACKET, PACKET_QDISC_BYPASS, &enable, sizeof(enable));
+
+  struct tpacket_req request;
+  request.tp_block_size = PACKET_RING_FRAME_SIZE * PACKET_RING_BLOCK_FRAMES;
+  request.tp_block_nr = PACKET_RING_FRAMES / PACKET_RING_BLOCK_FRAMES;
+  request.tp_frame_size = PACKET_RING_FRAME_SIZE;
+  request.tp_frame_nr = PACKET_RING_FRAMES;
+  if (setsockopt(ring->socket_handle, SOL_PACKET, PACKET_TX_RING, &request, sizeof(request))) {
+    printf("ERROR: Unable to create TX ring: %s\n", strerror(errno));
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  ring->frames = mmap(NULL, PACKET_RING_FRAME_SIZE * PACKET_RING_FRAMES,
+    PROT_READ | PROT_WRITE, MAP_SHARED, ring->socket_handle, 0);
+  if (ring->frames == MAP_FAILED) {
+    printf("ERROR: Unable to map TX ring: %s\n", strerror(errno));
+    ring->frames = NULL;
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  struct ifreq ifr;
+  if (packet_ring_interface(ring->socket_handle, interface, SIOCGIFINDEX, &ifr)) {
+    printf("ERROR: Unknown interface [%s]: %s\n", interface, strerror(errno));
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  struct sockaddr_ll address;
+  memset(&address, 0x00, sizeof(address));
+  address.sll_family = AF_PACKET;
+  address.sll_ifindex = ifr.ifr_ifindex;
+  if (bind(ring->socket_handle, (struct sockaddr*)&address, sizeof(address))) {
+    printf("ERROR: Unable to bind packet socket to [%s]: %s\n", interface, strerror(errno));
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  if (packet_ring_template(ring, interface, link, destination)) {
+    packet_ring_close(ring);
+    return 1;
+  }
+
+  return 0;
+}
+
+int packet_ring_queue(struct PacketRing* ring, const struct iovec* vectors,
+  uint32_t count) {
+  uint8_t* frame = ring->frames + ring->frame_index * PACKET_RING_FRAME_SIZE;
+  struct tpacket2_hdr* status = (struct tpacket2_hdr*)frame;
+  if (__atomic_load_n(&status->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+    return 1;
+  }
+
+  uint32_t payload_size = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    payload_size += vectors[i].iov_len;
+  }
+
+  if (PACKET_RING_DATA_OFFSET + ring->header_size + payload_size > PACKET_RING_FRAME_SIZE) {
+    ring->dropped++;
+    return -1;
+  }
+
+  uint8_t* data = frame + PACKET_RING_DATA_OFFSET;
+  memcpy(data, ring->header, ring->header_size);
+
+  uint8_t* payload = data + ring->header_size;
+  for (uint32_t i = 0; i < count; i++) {
+    memcpy(payload, vectors[i].iov_base, vectors[i].iov_len);
+    payload += vectors[i].iov_len;
+  }
+
+  uint8_t* ip = data + ring->ip_offset;
+  uint16_t ip_size = 28 + payload_size;
+  uint16_t udp_size = 8 + payload_size;
+  ip[2] = ip_size >> 8;
+  ip[3] = ip_size & 0xFF;
+  ip[4] = ring->ip_id >> 8;
+  ip[5] = ring->ip_id & 0xFF;
+  ring->ip_id++;
+
+  uint16_t checksum = packet_ring_checksum(ip, 20);
+  ip[10] = checksum >> 8;
+  ip[11] = checksum & 0xFF;
+  ip[24] = udp_size >> 8;
+  ip[25] = udp_size & 0xFF;
+
+  status->tp_len = ring->header_size + payload_size;
+  __atomic_store_n(&status->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  ring->frame_index = (ring->frame_index + 1) % PACKET_RING_FRAMES;
+  ring->queued++;
+  return 0;
+}
+
+int packet_ring_kick(struct PacketRing* ring, bool wait) {
+  // Waiting also covers frames kicked earlier and still in flight
+  if (!ring->queued && !wait) {
+    return 0;
+  }
+
+  ring->queued = 0;
+  if (sendto(ring->socket_handle, NULL, 0, wait ? 0 : MSG_DONTWAIT, NULL, 0) < 0 &&
+      errno != EAGAIN) {
+    ring->dropped++;
+  }
+  return 1;
+}
+
+uint32_t packet_ring_pending(struct PacketRing* ring) {
+  uint32_t pending = 0;
+  for (uint32_t i = 0; i < PACKET_RING_FRAMES; i++) {
+    struct tpacket2_hdr* status =
+      (struct tpacket2_hdr*)(ring->frames + i * PACKET_RING_FRAME_SIZE);
+    if (__atomic_load_n(&status->tp_status, __ATOMIC_RELAXED) != TP_STATUS_AVAILABLE) {
+      pending++;
+    }
+  }
+  return pending;
+}
+
+void packet_ring_close(struct PacketRing* ring) {
+  if (ring->frames) {
+    munmap(ring->frames, PACKET_RING_FRAME_SIZE * PACKET_RING_FRAMES);
+    ring->frames = NULL;
+  }
+
+  if (ring->socket_handle >= 0) {
+    close(ring->socket_handle);
+    ring->socket_handle = -1;
+  }
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * AF_PACKET transmit ring (PACKET_MMAP, TPACKET_V2).
+ *
+ * Complete frames, link + IPv4 + UDP headers followed by the datagram, are
+ * written straight into memory shared with the kernel. Queued frames are
+ * sent by a single sendto kick, so the UDP socket layer, routing and
+ * neighbour lookup are skipped for every datagram. Headers come from a
+ * template built once when the ring is opened.
+ */
+
+#define PACKET_RING_FRAME_SIZE 2048
+#define PACKET_RING_FRAMES 512
+
+// Largest link header: radiotap + 802.11 data header + LLC/SNAP
+#define PACKET_RING_MAX_HEADER 64
+
+// MCS index used for injected 802.11 frames
+#define PACKET_RING_RADIOTAP_MCS 1
+
+enum PacketLink {
+  PACKET_LINK_ETHERNET,
+  PACKET_LINK_RADIOTAP        // Monitor mode interface, 802.11 data frames
+};
+
+struct PacketRing {
+  int socket_handle;
+  uint8_t* frames;            // Ring shared with kernel
+  uint32_t frame_index;       // Next frame to fill
+  uint32_t queued;            // Frames filled since last kick
+
+  // Link, IPv4 and UDP header template
+  uint8_t header[PACKET_RING_MAX_HEADER + 28];
+  uint32_t header_size;
+  uint32_t ip_offset;
+  uint16_t ip_id;
+
+  uint32_t dropped;           // Frames rejected by kernel or not fitting
+};
+
+/**
+ * @brief Open ring on interface, headers are built for destination
+ * @param ring - Ring
+ * @param interface - Network interface name
+ * @param link - Link layer framing
+ * @param destination - Destination address and port
+ * @return 0 on success
+ */
+int packet_ring_open(struct PacketRing* ring, const char* interface,
+  enum PacketLink link, const struct sockaddr_in* destination);
+
+/**
+ * @brief Copy datagram into next free frame
+ * @param ring - Ring
+ * @param vectors - Datagram parts, UDP payload only
+ * @param count - Number of parts
+ * @return 0 on success, 1 if ring is full, -1 if datagram does not fit a frame
+ */
+int packet_ring_queue(struct PacketRing* ring, const struct iovec* vectors,
+  uint32_t count);
+
+/**
+ * @brief Ask kernel to send all queued frames
+ * @param ring - Ring
+ * @param wait - Block until all frames in the ring are sent
+ * @return 1 if a syscall was made, 0 if there was nothing to do
+ */
+int packet_ring_kick(struct PacketRing* ring, bool wait);
+
+/**
+ * @brief Count frames queued or still being sent by kernel
+ * @param ring - Ring
+ * @return Number of frames not available for queueing
+ */
+uint32_t packet_ring_pending(struct PacketRing* ring);
+
+/**
+ * @brief Close ring
+ * @param ring - Ring
+ */
+void packet_ring_close(struct PacketRing* ring);
@@ -0,0 +1,59 @@
+#include "rate_control.h"
+
+void rate_control_defaults(struct RateControlConfig* config,
+  uint32_t floor, uint32_t ceiling) {
+  config->floor = floor;
+  config->ceiling = ceiling;
+  config->loss_high = 50;
+  config->loss_low = 10;
+  config->jitter_high = 20000;
+  config->increase_step = 10;
+  config->decrease_factor = 85;
+  config->hold_reports = 5;
+  config->min_change = 5;
+}
+
+struct RateControlState rate_control_step(const struct RateControlConfig* config,
+  struct RateControlState state, const struct RateControlInput* input) {
+  // Nothing was received, keep rate until the link reports again
+  if (!input->expected) {
+    return state;
+  }
+
+  uint32_t loss = (uint64_t)input->lost * 1000 / input->expected;
+  uint32_t rate = state.rate;
+
+  if (loss >= config->loss_high || input->jitter >= config->jitter_high) {
+    // Back off below what actually got through
+    uint32_t base = input->goodput && input->goodput < rate ? input->goodput : rate;
+    rate = (uint64_t)base * config->decrease_factor / 100;
+    state.good_reports = 0;
+  } else if (loss <= config->loss_low && input->jitter < config->jitter_high / 2) {
+    // Probe up after the link stays clean for a while
+    if (++state.good_reports >= config->hold_reports) {
+      uint32_t step = (uint64_t)rate * config->increase_step / 100;
+      rate += step ? step : 1;
+      state.good_reports = 0;
+    }
+  } else {
+    state.good_reports = 0;
+  }
+
+  if (rate < config->floor) {
+    rate = config->floor;
+  }
+
+  if (rate > config->ceiling) {
+    rate = config->ceiling;
+  }
+
+  // Do not reconfigure encoder for small changes, unless a limit is reached
+  uint32_t change = rate > state.rate ? rate - state.rate : state.rate - rate;
+  if ((uint64_t)change * 100 < (uint64_t)state.rate * config->min_change &&
+      rate != config->floor && rate != config->ceiling) {
+    rate = state.rate;
+  }
+
+  state.rate = rate;
+  return state;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Loss driven bitrate controller.
+ *
+ * Rate backs off below the measured goodput when loss or jitter cross their
+ * high thresholds and probes up in small steps only after several reports in
+ * a row stay below the low thresholds. Reports in between hold the rate, so
+ * the controller does not oscillate around a single threshold.
+ *
+ * All rates are in Kbit/s of 1024 bit, the unit of encoder bitrate settings.
+ */
+
+// Controller settings
+struct RateControlConfig {
+  uint32_t floor;             // Lowest rate, Kbit/s
+  uint32_t ceiling;           // Highest rate, Kbit/s
+  uint32_t loss_high;         // Loss to back off at, 1/1000
+  uint32_t loss_low;          // Loss to probe up below, 1/1000
+  uint32_t jitter_high;       // Jitter to back off at, us
+  uint32_t increase_step;     // Rate increase, percent of current rate
+  uint32_t decrease_factor;   // Rate after back off, percent of goodput
+  uint32_t hold_reports;      // Good reports in a row needed to probe up
+  uint32_t min_change;        // Smaller changes are ignored, percent
+};
+
+// Controller state, carried from one report to the next
+struct RateControlState {
+  uint32_t rate;              // Current rate, Kbit/s
+  uint32_t good_reports;      // Good reports in a row
+};
+
+// Receiver report values in host byte order
+struct RateControlInput {
+  uint32_t expected;
+  uint32_t lost;
+  uint32_t jitter;
+  uint32_t goodput;
+};
+
+/**
+ * @brief Fill controller settings with defaults
+ * @param config - Settings
+ * @param floor - Lowest rate, Kbit/s
+ * @param ceiling - Highest rate, Kbit/s
+ */
+void rate_control_defaults(struct RateControlConfig* config,
+  uint32_t floor, uint32_t ceiling);
+
+/**
+ * @brief Compute controller state after a receiver report, has no side effects
+ * @param config - Settings
+ * @param state - State before report
+ * @param input - Receiver report
+ * @return State after report
+ */
+struct RateControlState rate_control_step(const struct RateControlConfig* config,
+  struct RateControlState state, const struct RateControlInput* input);
@@ -0,0 +1,140 @@
+#include "rate_control.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Host test of the bitrate controller.
+ *
+ * Reports are fed one by one the way processReport() does and the rate is
+ * checked after each of them: back off to 85% of goodput on loss or jitter,
+ * +10% only after 5 clean reports in a row, and changes under 5% ignored
+ * unless they reach the floor or the ceiling.
+ */
+
+static struct RateControlConfig config;
+
+static struct RateControlState report(struct RateControlState state,
+  uint32_t lost, uint32_t jitter, uint32_t goodput) {
+  struct RateControlInput input;
+  input.expected = 1000;
+  input.lost = lost;
+  input.jitter = jitter;
+  input.goodput = goodput;
+  return rate_control_step(&config, state, &input);
+}
+
+static void expect_rate(const char* name, struct RateControlState state, uint32_t rate) {
+  if (state.rate != rate) {
+    printf("FAIL: %s, rate %u instead of %u\n", name, state.rate, rate);
+    exit(1);
+  }
+}
+
+static void test_back_off() {
+  struct RateControlState state = { 8000, 0 };
+
+  // Loss above threshold backs off below what got through
+  expect_rate("loss back off", report(state, 60, 0, 6000), 5100);
+
+  // High jitter alone backs off as well
+  expect_rate("jitter back off", report(state, 0, 25000, 6000), 5100);
+
+  // Goodput above current rate is no reason to back off less
+  expect_rate("goodput over rate", report(state, 60, 0, 9000), 6800);
+
+  // No goodput measured, back off from current rate
+  expect_rate("no goodput", report(state, 60, 0, 0), 6800);
+
+  // Back off never goes below the floor
+  expect_rate("floor", report(state, 500, 0, 1000), config.floor);
+
+  // Back off forgets clean reports collected so far
+  for (uint32_t i = 0; i < config.hold_reports - 1; i++) {
+    state = report(state, 0, 0, 8000);
+  }
+  state = report(state, 60, 0, 8000);
+  if (state.good_reports) {
+    printf("FAIL: back off kept %u good reports\n", state.good_reports);
+    exit(1);
+  }
+
+  // Nothing received, nothing changes
+  struct RateControlInput empty = { 0, 0, 0, 0 };
+  expect_rate("empty report", rate_control_step(&config, state, &empty), state.rate);
+}
+
+static void test_probe() {
+  struct RateControlState state = { 4000, 0 };
+
+  // Rate holds for 4 clean reports and goes up by 10% on the 5th
+  for (uint32_t i = 0; i < config.hold_reports - 1; i++) {
+    state = report(state, 0, 0, 4000);
+    expect_rate("probe hold", state, 4000);
+  }
+
+  state = report(state, 0, 0, 4000);
+  expect_rate("probe", state, 4400);
+
+  // Count starts over after a probe
+  for (uint32_t i = 0; i < config.hold_reports - 1; i++) {
+    state = report(state, 0, 0, 4400);
+    expect_rate("probe hold after probe", state, 4400);
+  }
+  state = report(state, 0, 0, 4400);
+  expect_rate("second probe", state, 4840);
+
+  // Report between thresholds holds rate and resets the count
+  for (uint32_t i = 0; i < config.hold_reports - 1; i++) {
+    state = report(state, 0, 0, 4840);
+  }
+  state = report(state, 30, 0, 4840);
+  state = report(state, 0, 0, 4840);
+  expect_rate("probe after moderate loss", state, 4840);
+
+  // Probe never goes above the ceiling
+  state.rate = config.ceiling;
+  for (uint32_t i = 0; i < config.hold_reports; i++) {
+    state = report(state, 0, 0, config.ceiling);
+  }
+  expect_rate("ceiling", state, config.ceiling);
+}
+
+static void test_hysteresis() {
+  struct RateControlConfig defaults = config;
+
+  // Probe of 4% is under the 5% hysteresis and is ignored
+  config.increase_step = 4;
+  struct RateControlState state = { 4000, 0 };
+  for (uint32_t i = 0; i < config.hold_reports; i++) {
+    state = report(state, 0, 0, 4000);
+  }
+  expect_rate("small probe", state, 4000);
+
+  // Small change reaching the ceiling is still applied
+  state.rate = config.ceiling - 100;
+  for (uint32_t i = 0; i < config.hold_reports; i++) {
+    state = report(state, 0, 0, state.rate);
+  }
+  expect_rate("small probe to ceiling", state, config.ceiling);
+
+  // Back off of 3% is ignored, one of 5% is applied
+  config = defaults;
+  config.decrease_factor = 97;
+  state.rate = 4000;
+  expect_rate("small back off", report(state, 60, 0, 4000), 4000);
+
+  config.decrease_factor = 95;
+  expect_rate("back off at hysteresis", report(state, 60, 0, 4000), 3800);
+
+  config = defaults;
+}
+
+int main() {
+  rate_control_defaults(&config, 1000, 12000);
+
+  test_back_off();
+  test_probe();
+  test_hysteresis();
+  printf("> Rate control tests passed\n");
+  return 0;
+}
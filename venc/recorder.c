@@ -0,0 +1,200 @@
+#include "recorder.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void recorder_file(struct Recorder* recorder) {
+  if (recorder->file >= 0) {
+    fsync(recorder->file);
+    close(recorder->file);
+  }
+
+  char name[160];
+  snprintf(name, sizeof(name), "%s_%03u.%s", recorder->path,
+    recorder->file_index++, recorder->extension);
+
+  recorder->file = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (recorder->file < 0) {
+    printf("ERROR: Unable to open record file [%s]: %s\n", name, strerror(errno));
+    return;
+  }
+
+  printf("> Recording to [%s]\n", name);
+}
+
+static void recorder_write(struct Recorder* recorder, struct RecordChunk* chunk) {
+  if (chunk->new_file) {
+    recorder_file(recorder);
+  }
+
+  if (recorder->file < 0) {
+    recorder->write_errors++;
+    return;
+  }
+
+  uint32_t offset = 0;
+  while (offset < chunk->size) {
+    int ret = write(recorder->file, chunk->data + offset, chunk->size - offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Card is full or gone, keep going in case the next file works
+      printf("ERROR: Unable to write record file: %s\n", strerror(errno));
+      recorder->write_errors++;
+      return;
+    }
+
+    offset += ret;
+    recorder->bytes_written += ret;
+  }
+}
+
+static void* recorder_thread(void* param) {
+  struct Recorder* recorder = param;
+
+  while (true) {
+    pthread_mutex_lock(&recorder->lock);
+    struct RecordChunk* chunk = &recorder->chunks[recorder->write_index];
+    while (recorder->running && chunk->state != RECORD_CHUNK_READY) {
+      pthread_cond_wait(&recorder->ready, &recorder->lock);
+    }
+
+    // Stopped and everything is written
+    if (chunk->state != RECORD_CHUNK_READY) {
+      pthread_mutex_unlock(&recorder->lock);
+      break;
+    }
+    pthread_mutex_unlock(&recorder->lock);
+
+    recorder_write(recorder, chunk);
+
+    pthread_mutex_lock(&recorder->lock);
+    chunk->size = 0;
+    chunk->new_file = false;
+    chunk->state = RECORD_CHUNK_FREE;
+    pthread_mutex_unlock(&recorder->lock);
+
+    recorder->write_index = (recorder->write_index + 1) % RECORD_CHUNKS;
+  }
+
+  return NULL;
+}
+
+int recorder_open(struct Recorder* recorder, const char* path, bool hevc) {
+  memset(recorder, 0x00, sizeof(*recorder));
+  strncpy(recorder->path, path, sizeof(recorder->path) - 1);
+  recorder->extension = hevc ? "h265" : "h264";
+  recorder->file = -1;
+
+  for (uint32_t i = 0; i < RECORD_CHUNKS; i++) {
+    recorder->chunks[i].data = malloc(RECORD_CHUNK_SIZE);
+    if (!recorder->chunks[i].data) {
+      printf("ERROR: Unable to allocate record buffer\n");
+      return 1;
+    }
+  }
+
+  recorder->chunks[0].state = RECORD_CHUNK_FILLING;
+  recorder->chunks[0].new_file = true;
+  recorder->running = true;
+
+  pthread_mutex_init(&recorder->lock, NULL);
+  pthread_cond_init(&recorder->ready, NULL);
+  pthread_create(&recorder->thread, NULL, recorder_thread, recorder);
+  return 0;
+}
+
+/**
+ * @brief Hand filled chunk to writer and start the next one
+ * @return false if writer still holds the next chunk
+ */
+static bool recorder_next(struct Recorder* recorder) {
+  pthread_mutex_lock(&recorder->lock);
+
+  struct RecordChunk* chunk = &recorder->chunks[recorder->fill_index];
+  if (chunk->state == RECORD_CHUNK_FILLING && chunk->size) {
+    chunk->state = RECORD_CHUNK_READY;
+    recorder->fill_index = (recorder->fill_index + 1) % RECORD_CHUNKS;
+    pthread_cond_signal(&recorder->ready);
+  }
+
+  chunk = &recorder->chunks[recorder->fill_index];
+  if (chunk->state == RECORD_CHUNK_FREE) {
+    chunk->state = RECORD_CHUNK_FILLING;
+    chunk->size = 0;
+    chunk->new_file = false;
+  }
+
+  bool available = chunk->state == RECORD_CHUNK_FILLING;
+  pthread_mutex_unlock(&recorder->lock);
+  return available;
+}
+
+uint8_t* recorder_reserve(struct Recorder* recorder, uint32_t size, bool keyframe) {
+  if ((recorder->waiting_keyframe && !keyframe) || size > RECORD_CHUNK_SIZE) {
+    recorder->frames_dropped++;
+    return NULL;
+  }
+
+  bool split = keyframe && recorder->file_size > RECORD_FILE_LIMIT;
+  struct RecordChunk* chunk = &recorder->chunks[recorder->fill_index];
+
+  // Only the encoder loop moves a chunk out of filling state, no lock needed
+  if (chunk->state != RECORD_CHUNK_FILLING || chunk->size + size > RECORD_CHUNK_SIZE || split) {
+    if (!recorder_next(recorder)) {
+      // Card is behind, resume on a keyframe
+      recorder->frames_dropped++;
+      recorder->waiting_keyframe = true;
+      return NULL;
+    }
+
+    chunk = &recorder->chunks[recorder->fill_index];
+    if (split) {
+      chunk->new_file = true;
+      recorder->file_size = 0;
+    }
+  }
+
+  recorder->waiting_keyframe = false;
+  return chunk->data + chunk->size;
+}
+
+void recorder_commit(struct Recorder* recorder, uint32_t size) {
+  recorder->chunks[recorder->fill_index].size += size;
+  recorder->file_size += size;
+  recorder->frames++;
+}
+
+void recorder_close(struct Recorder* recorder) {
+  if (!recorder->running) {
+    return;
+  }
+
+  // Hand over the last partial chunk
+  recorder_next(recorder);
+
+  pthread_mutex_lock(&recorder->lock);
+  recorder->running = false;
+  pthread_cond_signal(&recorder->ready);
+  pthread_mutex_unlock(&recorder->lock);
+  pthread_join(recorder->thread, NULL);
+
+  if (recorder->file >= 0) {
+    fsync(recorder->file);
+    close(recorder->file);
+    recorder->file = -1;
+  }
+
+  printf("> Recorded %u frames (%u dropped), %.1f MB in %u files, %u write errors\n",
+    recorder->frames, recorder->frames_dropped,
+    recorder->bytes_written / 1048576., recorder->file_index, recorder->write_errors);
+
+  for (uint32_t i = 0; i < RECORD_CHUNKS; i++) {
+    free(recorder->chunks[i].data);
+  }
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Buffered recorder for local storage.
+ *
+ * Encoder loop copies whole frames into large chunks and never touches the
+ * file. A writer thread writes every filled chunk with one write call, so
+ * slow SD card writes only stall the writer. When all chunks are waiting
+ * for the card, frames are dropped until the next keyframe so the recorded
+ * stream stays decodable. Files are split on keyframes.
+ */
+
+#define RECORD_CHUNKS 4
+#define RECORD_CHUNK_SIZE (1024 * 1024)
+
+// Files are split below FAT32 limit
+#define RECORD_FILE_LIMIT (1024ULL * 1024 * 1024)
+
+enum RecordChunkState {
+  RECORD_CHUNK_FREE,
+  RECORD_CHUNK_FILLING,
+  RECORD_CHUNK_READY
+};
+
+struct RecordChunk {
+  uint8_t* data;
+  uint32_t size;
+  bool new_file;              // Chunk starts a new file
+  enum RecordChunkState state;
+};
+
+struct Recorder {
+  char path[128];             // File name prefix
+  const char* extension;
+  struct RecordChunk chunks[RECORD_CHUNKS];
+  uint32_t fill_index;        // Chunk being filled by encoder loop
+  uint32_t write_index;       // Next chunk for writer
+  uint64_t file_size;         // Bytes queued for current file
+  bool waiting_keyframe;
+  bool running;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+
+  // Writer side
+  int file;
+  uint32_t file_index;
+
+  // Counters
+  uint32_t frames;
+  uint32_t frames_dropped;
+  uint64_t bytes_written;
+  uint32_t write_errors;
+};
+
+/**
+ * @brief Allocate chunks and start writer thread
+ * @param recorder - Recorder
+ * @param path - File name prefix, e.g. /mnt/mmcblk0p1/flight
+ * @param hevc - Stream is H.265
+ * @return 0 on success
+ */
+int recorder_open(struct Recorder* recorder, const char* path, bool hevc);
+
+/**
+ * @brief Reserve space for a whole frame
+ * @param recorder - Recorder
+ * @param size - Frame size
+ * @param keyframe - Frame starts with parameter sets and IDR
+ * @return Frame buffer, NULL if the frame is dropped
+ */
+uint8_t* recorder_reserve(struct Recorder* recorder, uint32_t size, bool keyframe);
+
+/**
+ * @brief Finish frame copied into reserved space
+ * @param recorder - Recorder
+ * @param size - Frame size, same as reserved
+ */
+void recorder_commit(struct Recorder* recorder, uint32_t size);
+
+/**
+ * @brief Write what is buffered, stop writer thread and close file
+ * @param recorder - Recorder
+ */
+void recorder_close(struct Recorder* recorder);
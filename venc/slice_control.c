@@ -0,0 +1,57 @@
+#include "slice_control.h"
+
+void slice_control_defaults(struct SliceControlConfig* config,
+  uint32_t target_size, uint32_t max_lines, uint32_t window) {
+  config->target_size = target_size;
+  config->min_lines = 1;
+  config->max_lines = max_lines;
+  config->fit_percent = 90;
+  config->grow_percent = 60;
+  config->window = window ? window : 1;
+}
+
+bool slice_control_add(const struct SliceControlConfig* config,
+  struct SliceControlState* state, uint32_t size, bool frame_end) {
+  state->slices++;
+  if (size > config->target_size) {
+    state->oversized++;
+    state->oversized_bytes += size;
+  }
+
+  if (size > state->largest) {
+    state->largest = size;
+  }
+
+  if (frame_end) {
+    state->frames++;
+  }
+
+  return state->frames >= config->window;
+}
+
+struct SliceControlState slice_control_step(const struct SliceControlConfig* config,
+  struct SliceControlState state) {
+  uint32_t lines = state.lines;
+
+  if ((uint64_t)state.oversized * 100 > (uint64_t)state.slices * (100 - config->fit_percent)) {
+    // Shrink by how far an average oversized slice overshoots, at least one line
+    uint32_t average = state.oversized_bytes / state.oversized;
+    uint32_t shrunk = (uint64_t)lines * config->target_size / average;
+    lines = shrunk < lines ? shrunk : lines - 1;
+  } else if ((uint64_t)state.largest * 100 < (uint64_t)config->target_size * config->grow_percent) {
+    // All slices leave room, fewer slices save headers
+    lines++;
+  }
+
+  if (lines < config->min_lines) {
+    lines = config->min_lines;
+  }
+
+  if (lines > config->max_lines) {
+    lines = config->max_lines;
+  }
+
+  struct SliceControlState next = {0};
+  next.lines = lines;
+  return next;
+}
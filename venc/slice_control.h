@@ -0,0 +1,63 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Adaptive slice size controller.
+ *
+ * Slice sizes are collected over a window of frames. If too many slices do
+ * not fit into one datagram, lines per slice are cut in proportion to how
+ * far the oversized slices overshoot. If even the largest slice leaves a lot
+ * of room, lines grow by one, so slices are never larger than needed but
+ * header overhead stays low when the picture is simple.
+ */
+
+// Controller settings
+struct SliceControlConfig {
+  uint32_t target_size;       // Largest slice fitting one datagram, bytes
+  uint32_t min_lines;         // Fewest lines per slice
+  uint32_t max_lines;         // Picture height in lines, one slice per frame
+  uint32_t fit_percent;       // Share of slices that must fit, percent
+  uint32_t grow_percent;      // Largest slice to grow below, percent of target
+  uint32_t window;            // Frames per decision
+};
+
+// Controller state, slices are counted until the window is complete
+struct SliceControlState {
+  uint32_t lines;             // Current lines per slice
+  uint32_t frames;
+  uint32_t slices;
+  uint32_t oversized;         // Slices larger than target
+  uint64_t oversized_bytes;   // Total size of oversized slices
+  uint32_t largest;           // Largest slice, bytes
+};
+
+/**
+ * @brief Fill controller settings with defaults
+ * @param config - Settings
+ * @param target_size - Largest slice fitting one datagram, bytes
+ * @param max_lines - Picture height in lines
+ * @param window - Frames per decision
+ */
+void slice_control_defaults(struct SliceControlConfig* config,
+  uint32_t target_size, uint32_t max_lines, uint32_t window);
+
+/**
+ * @brief Account encoded slice
+ * @param config - Settings
+ * @param state - State
+ * @param size - Slice NAL size without start code
+ * @param frame_end - Last slice of frame
+ * @return true if window is complete and slice_control_step is due
+ */
+bool slice_control_add(const struct SliceControlConfig* config,
+  struct SliceControlState* state, uint32_t size, bool frame_end);
+
+/**
+ * @brief Compute lines per slice after a complete window, has no side effects
+ * @param config - Settings
+ * @param state - State with complete window
+ * @return State with new lines and empty window
+ */
+struct SliceControlState slice_control_step(const struct SliceControlConfig* config,
+  struct SliceControlState state);
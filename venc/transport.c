@@ -0,0 +1,1931 @@
+#include "main.h"
+
+/*
+ * Transmit path: sinks, Tx ring, packetizer, FEC, pacing, retransmission and
+ * stream stats. Nothing here touches MPI, encoded packs come in through
+ * pushPack(), so the same code runs behind the encoder and behind the file
+ * source on a host.
+ */
+
+uint8_t stream_mode = 0;
+PAYLOAD_TYPE_E stream_codec = PT_H264;
+uint8_t pace_percent = 0;
+uint8_t pace_burst = 4;
+bool pace_txtime = false;
+uint8_t tx_mode = TX_MODE_BATCH;
+struct Sink sinks[MAX_SINKS];
+uint8_t sink_count = 1;
+uint64_t pace_rate = 0;
+uint32_t tx_max_rate = 0;
+uint64_t pace_burst_ns = 0;
+uint64_t pace_frame_rate = 0;
+uint32_t pace_framerate = 60;
+clockid_t pace_clock = CLOCK_MONOTONIC;
+uint16_t metrics_port = 0;
+struct MetricsState metrics_state;
+struct MetricsSnapshot metrics_published;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t nack_window = 0;
+uint32_t keyframe_requests = 0;
+struct NackRequest nack_requests[NACK_QUEUE_SIZE];
+uint32_t nack_head = 0;
+uint32_t nack_tail = 0;
+int tx_ring_event = -1;
+bool loop_running = true;
+
+int parseFEC(const char* value, uint8_t* data_count, uint8_t* parity_count) {
+  uint32_t data = 0, total = 0;
+  if (sscanf(value, "%u:%u", &data, &total) != 2 || !data ||
+      data > FEC_MAX_DATA || total <= data || total - data > FEC_MAX_PARITY) {
+    printf("> ERROR: FEC must be K:N with K <= %d and N - K <= %d\n",
+      FEC_MAX_DATA, FEC_MAX_PARITY);
+    return 1;
+  }
+
+  *data_count = data;
+  *parity_count = total - data;
+  return 0;
+}
+
+int parsePacketInterface(struct Sink* sink, const char* value) {
+  char buffer[32];
+  strncpy(buffer, value, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = 0;
+
+  sink->packet_link = PACKET_LINK_ETHERNET;
+  char* link = strchr(buffer, ':');
+  if (link) {
+    *link++ = 0;
+    if (!strcmp(link, "radiotap")) {
+      sink->packet_link = PACKET_LINK_RADIOTAP;
+    } else if (strcmp(link, "ethernet")) {
+      printf("> ERROR: Packet link must be ethernet or radiotap, got '%s'\n", link);
+      return 1;
+    }
+  }
+
+  if (!buffer[0] || strlen(buffer) >= sizeof(sink->packet_interface)) {
+    printf("> ERROR: Invalid packet interface '%s'\n", buffer);
+    return 1;
+  }
+
+  strcpy(sink->packet_interface, buffer);
+  return 0;
+}
+
+int parseSink(struct Sink* sink, struct Sink* defaults, const char* options) {
+  char buffer[128];
+  strncpy(buffer, options, sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = 0;
+
+  sink->address.sin_family = AF_INET;
+  sink->mode = defaults->mode;
+  sink->mtu = defaults->mtu;
+  sink->limit_to_mtu = defaults->limit_to_mtu;
+  sink->max_size = defaults->max_size;
+  sink->fec_data_count = defaults->fec_data_count;
+  sink->fec_parity_count = defaults->fec_parity_count;
+  sink->fec_depth = defaults->fec_depth;
+  strcpy(sink->packet_interface, defaults->packet_interface);
+  sink->packet_link = defaults->packet_link;
+
+  char* context = NULL;
+  char* address = strtok_r(buffer, ",", &context);
+  char* port = address ? strchr(address, ':') : NULL;
+  if (!port) {
+    printf("> ERROR: Sink must start with IP:Port, got '%s'\n", options);
+    return 1;
+  }
+
+  *port++ = 0;
+  sink->address.sin_addr.s_addr = inet_addr(address);
+  sink->address.sin_port = htons(atoi(port));
+
+  char* option;
+  while ((option = strtok_r(NULL, ",", &context))) {
+    if (!strcmp(option, "compact")) {
+      sink->mode = 0;
+    } else if (!strcmp(option, "rtp")) {
+      sink->mode = 1;
+    } else if (!strncmp(option, "mtu=", 4)) {
+      sink->mtu = atoi(option + 4);
+      sink->limit_to_mtu = true;
+    } else if (!strcmp(option, "fec=off")) {
+      sink->fec_data_count = 0;
+    } else if (!strncmp(option, "fec=", 4)) {
+      if (parseFEC(option + 4, &sink->fec_data_count, &sink->fec_parity_count)) {
+        return 1;
+      }
+    } else if (!strncmp(option, "depth=", 6)) {
+      sink->fec_depth = atoi(option + 6);
+    } else if (!strcmp(option, "packet=off")) {
+      sink->packet_interface[0] = 0;
+    } else if (!strncmp(option, "packet=", 7)) {
+      if (parsePacketInterface(sink, option + 7)) {
+        return 1;
+      }
+    } else {
+      printf("> ERROR: Unknown sink option '%s'\n", option);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Size of RTP header and extensions in every data datagram
+ */
+uint32_t getRtpHeaderSize(struct Sink* sink) {
+  if (sink->mode != 1) {
+    return 0;
+  }
+
+  return sizeof(struct RTPHeader) + (layer_marking ? sizeof(struct RTPFrameMarking) : 0);
+}
+
+int setupSink(struct Sink* sink, uint8_t index) {
+  congestion_init(&sink->congestion);
+  sink->frame_last = -1;
+
+  // Fit every datagram into path MTU (IPv4 + UDP + optional RTP headers)
+  if (sink->limit_to_mtu) {
+    sink->max_size = sink->mtu - 28 - getRtpHeaderSize(sink);
+  }
+
+  printf("> Sink #%d %s:%d, %s, MTU = %d, max payload size = %d\n", index,
+    inet_ntoa(sink->address.sin_addr), ntohs(sink->address.sin_port),
+    sink->mode == 1 ? "RTP" : "compact", sink->mtu, sink->max_size);
+
+  if (sink->packet_interface[0]) {
+    if (pace_percent && pace_txtime) {
+      printf("> ERROR: SO_TXTIME pacing is not supported by packet ring\n");
+      return 1;
+    }
+
+    sink->packet_ring = calloc(1, sizeof(struct PacketRing));
+    if (!sink->packet_ring) {
+      printf("ERROR: Unable to allocate packet ring\n");
+      return 1;
+    }
+
+    if (packet_ring_open(sink->packet_ring, sink->packet_interface,
+        sink->packet_link, &sink->address)) {
+      return 1;
+    }
+  }
+
+  // Retransmission cache is allocated once, sending never allocates
+  if (nack_window && sink->mode == 1) {
+    // Full datagrams of the window at the highest rate and a short last
+    // datagram of every frame in it
+    uint64_t window_bytes = (uint64_t)tx_max_rate * 128 * nack_window / 1000;
+    uint64_t packets = window_bytes / sink->max_size +
+      (uint64_t)pace_framerate * nack_window / 1000 + 1;
+    sink->nack_slots = NACK_MIN_SLOTS;
+    while (sink->nack_slots < packets && sink->nack_slots < NACK_MAX_SLOTS) {
+      sink->nack_slots <<= 1;
+    }
+
+    if (packets > sink->nack_slots) {
+      printf("WARN: Retransmission cache covers %d of %llu packets in NACK window\n",
+        sink->nack_slots, (unsigned long long)packets);
+    }
+
+    sink->nack_cache = calloc(sink->nack_slots, sizeof(struct NackSlot));
+    if (!sink->nack_cache) {
+      printf("ERROR: Unable to allocate retransmission cache\n");
+      return 1;
+    }
+    printf("> Sink #%d NACK window = %d ms, %d cached packets\n", index, nack_window,
+      sink->nack_slots);
+  }
+
+  if (!sink->fec_data_count) {
+    return 0;
+  }
+
+  if (sink->mode != 1) {
+    printf("> ERROR: FEC requires RTP streaming mode\n");
+    return 1;
+  }
+
+  if (sink->max_size + getRtpHeaderSize(sink) + 2 > FEC_MAX_SYMBOL) {
+    printf("> ERROR: Payload size is too large for FEC\n");
+    return 1;
+  }
+
+  if (!sink->fec_depth || sink->fec_depth > FEC_MAX_DEPTH) {
+    printf("> ERROR: FEC interleave depth must be 1..%d\n", FEC_MAX_DEPTH);
+    return 1;
+  }
+
+  sink->fec_blocks = calloc(sink->fec_depth, sizeof(struct FECBlock));
+  sink->fec_parity_stride = sizeof(struct FECHeader) + sink->max_size +
+    getRtpHeaderSize(sink) + 2;
+  sink->fec_parity_out = malloc(TX_BATCH_SIZE * sink->fec_parity_stride);
+  if (!sink->fec_blocks || !sink->fec_parity_out) {
+    printf("ERROR: Unable to allocate FEC blocks\n");
+    return 1;
+  }
+
+  fec_init();
+  printf("> Sink #%d FEC = %d:%d, interleave depth = %d\n", index,
+    sink->fec_data_count, sink->fec_data_count + sink->fec_parity_count,
+    sink->fec_depth);
+  return 0;
+}
+
+int enableTxTime(int socket_handle) {
+#ifdef SO_TXTIME
+  // Departure times are taken from the clock of ETF qdisc
+  struct sock_txtime config;
+  memset(&config, 0x00, sizeof(config));
+  config.clockid = CLOCK_TAI;
+
+  if (setsockopt(socket_handle, SOL_SOCKET, SO_TXTIME, &config, sizeof(config))) {
+    printf("ERROR: Unable to enable SO_TXTIME: %s\n", strerror(errno));
+    return 1;
+  }
+
+  pace_clock = CLOCK_TAI;
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+int parseTxMode(const char* value) {
+  if (!strcmp(value, "plain")) {
+    tx_mode = TX_MODE_PLAIN;
+  } else if (!strcmp(value, "batch")) {
+    tx_mode = TX_MODE_BATCH;
+  } else if (!strcmp(value, "gso")) {
+    tx_mode = TX_MODE_GSO;
+  } else {
+    printf("> ERROR: Transmit mode must be plain, batch or gso, got '%s'\n", value);
+    return 1;
+  }
+  return 0;
+}
+
+int enableGSO(int socket_handle) {
+  // Segment size is given per message, probe that kernel knows the option
+  int size = 0;
+  if (setsockopt(socket_handle, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size))) {
+    printf("WARN: UDP GSO is not supported (%s), using sendmmsg batches\n",
+      strerror(errno));
+    return 1;
+  }
+
+  return 0;
+}
+
+void queueNack(struct NackMessage* message, int size, struct sockaddr_in* source) {
+  // Requests are served by the sink streaming to the requesting host
+  uint8_t sink_index = 0;
+  while (sink_index < sink_count &&
+      sinks[sink_index].address.sin_addr.s_addr != source->sin_addr.s_addr) {
+    sink_index++;
+  }
+
+  if (sink_index == sink_count || !sinks[sink_index].nack_cache) {
+    return;
+  }
+
+  uint32_t count = (size - sizeof(struct FeedbackHeader)) / sizeof(struct NackEntry);
+  for (uint32_t i = 0; i < count && i < NACK_MAX_ENTRIES; i++) {
+    uint32_t tail = __atomic_load_n(&nack_tail, __ATOMIC_ACQUIRE);
+    if (nack_head - tail == NACK_QUEUE_SIZE) {
+      break;
+    }
+
+    struct NackRequest* request = &nack_requests[nack_head % NACK_QUEUE_SIZE];
+    request->sink = sink_index;
+    request->sequence = be16toh(message->entries[i].sequence);
+    request->bitmask = be16toh(message->entries[i].bitmask);
+    __atomic_store_n(&nack_head, nack_head + 1, __ATOMIC_RELEASE);
+  }
+
+  // Wake up sender thread
+  uint64_t event_value = 1;
+  write(tx_ring_event, &event_value, sizeof(event_value));
+}
+
+double getTimeInterval(
+  struct timespec* timestamp, struct timespec* last_meansure_timestamp) {
+  return (timestamp->tv_sec - last_meansure_timestamp->tv_sec) +
+       (timestamp->tv_nsec - last_meansure_timestamp->tv_nsec) / 1000000000.;
+}
+
+struct timespec last_timestamp = {0, 0};
+uint32_t packets_sent = 0;
+uint64_t packets_total = 0;
+uint64_t bytes_total = 0;
+uint32_t packets_dropped = 0;
+uint32_t aggregated_packets = 0;
+uint32_t fec_packets_sent = 0;
+uint32_t nals_fragmented = 0;
+uint32_t nals_oversized = 0;
+uint32_t syscalls_sent = 0;
+uint32_t pace_burst_max = 0;
+uint32_t pace_burst_count = 0;
+uint64_t pace_gap_sum = 0;
+uint32_t pace_gap_count = 0;
+uint32_t tx_ring_fill_max = 0;
+uint32_t tx_ring_overflows = 0;
+uint32_t layer_frames_dropped = 0;
+uint32_t packets_retransmitted = 0;
+uint32_t nacks_late = 0;
+uint32_t nacks_missing = 0;
+
+// Sender thread CPU use at the previous stats line
+int cycle_counter = -1;
+uint64_t cpu_last_time = 0;
+uint64_t cpu_last_cycles = 0;
+uint64_t cpu_last_packets = 0;
+
+uint32_t sequence_id = 0;
+uint32_t frame_id = 0;
+uint32_t rtp_timestamp = 0;
+
+// Temporal layer of the pack being sent, marked in RTP mode
+bool layer_marking = false;
+uint8_t tx_layer = 0;
+bool tx_independent = false;
+uint8_t tl0_index = 0;
+
+// Transmit ring
+// Encoder thread copies every pack into the ring and releases VENC stream
+// right away, sender thread packetizes and sends from ring memory. Ring is
+// lock-free with one producer and one consumer: producer owns head and data
+// write position, consumer owns tail and releases packs only after the batch
+// referencing them is sent.
+struct TxPack tx_ring_packs[TX_RING_PACKS];
+uint8_t tx_ring_data[TX_RING_SIZE];
+uint32_t tx_ring_head = 0;
+uint32_t tx_ring_tail = 0;
+uint32_t tx_ring_write = 0;
+uint32_t tx_ring_used = 0;
+
+// Parameter set cache
+// Latest VPS / SPS / PPS seen by the sender are re-sent ahead of a frame on
+// a timer, on receiver request, once per intra refresh cycle and before an
+// IDR which came without them, so late joining receivers do not wait for
+// the next IDR. Sets are only replaced when encoder settings change, batches
+// still referencing re-sent sets are flushed before that.
+uint32_t ps_interval = 1000;
+uint32_t ps_refresh_frames = 0;
+uint32_t parameter_sets_requested = 0;
+uint32_t parameter_sets_resent = 0;
+uint8_t ps_cache[PS_CACHE_SETS][PS_CACHE_SIZE];
+uint32_t ps_cache_sizes[PS_CACHE_SETS];
+uint64_t ps_last_time = 0;
+uint32_t ps_frames = 0;
+bool ps_in_frame = false;
+bool ps_pending = false;      // Unsent batch references cached sets
+
+// Audio
+// Encoded audio frames leave from the encoder thread on a socket of their
+// own, one RTP packet per frame, straight to every RTP sink. They never
+// enter the Tx ring, so a video burst does not delay audio, and the small
+// packets do not count into the video kernel send queue, so they do not
+// trigger shedding or pacing of video either.
+int audio_socket = -1;
+uint8_t audio_payload_type = AUDIO_PAYLOAD_PCMA;
+uint16_t audio_sequence = 0;
+bool audio_started = false;
+uint32_t audio_frames_sent = 0;
+uint32_t audio_frames_dropped = 0;
+
+// Enhancement layer dropping, producer side
+bool tx_frame_open = false;
+bool tx_frame_dropped = false;
+bool tx_frame_cut = false;      // Rest of a frame cut by overflow is dropped
+uint8_t tx_drop_layer = 0;
+
+/**
+ * @brief Decide whether the frame starting with this pack is dropped
+ * @param layer - Temporal layer of the frame
+ * @param packs - Packs in Tx ring
+ */
+bool isLayerDropped(uint8_t layer, uint32_t packs) {
+  // Base layer frame ends the run of enhancement frames referencing each other
+  if (!layer) {
+    tx_drop_layer = 0;
+    return false;
+  }
+
+  // Frames later in the run reference this one, drop them as well
+  if (!tx_drop_layer) {
+    uint32_t fill = MAX2(__atomic_load_n(&tx_ring_used, __ATOMIC_RELAXED) * 100 / TX_RING_SIZE,
+      packs * 100 / TX_RING_PACKS);
+    if (fill >= LAYER_DROP_FILL) {
+      tx_drop_layer = layer;
+    }
+  }
+
+  return tx_drop_layer && layer >= tx_drop_layer;
+}
+
+/**
+ * @brief Copy pack into Tx ring, producer side
+ * @param layer - Temporal layer, enhancement frames are dropped first when
+ *   the sender falls behind
+ * @param independent - Pack belongs to an IDR frame
+ * @return 0 on success or if the frame is dropped, 1 if ring is full
+ */
+int pushPack(uint8_t* data, uint32_t size, uint64_t pts, bool frame_end, bool flush,
+  uint8_t layer, bool independent) {
+  uint32_t head = tx_ring_head;
+  uint32_t tail = __atomic_load_n(&tx_ring_tail, __ATOMIC_ACQUIRE);
+
+  // Tail of a cut frame would reach receivers as a frame of its own
+  if (tx_frame_cut) {
+    tx_frame_cut = !frame_end;
+    __atomic_fetch_add(&tx_ring_overflows, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  // Whole frames are dropped, decision is made on the first pack
+  if (!tx_frame_open) {
+    tx_frame_dropped = isLayerDropped(layer, head - tail);
+    if (tx_frame_dropped) {
+      __atomic_fetch_add(&layer_frames_dropped, 1, __ATOMIC_RELAXED);
+      tx_frame_open = !frame_end && !flush;
+      return 0;
+    }
+  } else if (tx_frame_dropped) {
+    tx_frame_open = !frame_end && !flush;
+    return 0;
+  }
+
+  // Last slot is kept for the pack ending a frame cut by cutFrame()
+  if (head - tail >= TX_RING_PACKS - 1 || size >= TX_RING_SIZE) {
+    return 1;
+  }
+
+  // Oldest data still used by sender
+  uint32_t offset = tx_ring_write;
+  if (head == tail) {
+    offset = 0;
+  } else {
+    uint32_t read = tx_ring_packs[tail % TX_RING_PACKS].offset;
+    if (offset >= read) {
+      if (offset + size > TX_RING_SIZE) {
+        // Wrap around, keep a gap to tell full ring from empty one
+        if (size >= read) {
+          return 1;
+        }
+        offset = 0;
+      }
+    } else if (offset + size >= read) {
+      return 1;
+    }
+  }
+
+  memcpy(tx_ring_data + offset, data, size);
+  tx_ring_write = offset + size;
+  tx_frame_open = !frame_end && !flush;
+
+  struct TxPack* pack = &tx_ring_packs[head % TX_RING_PACKS];
+  pack->offset = offset;
+  pack->size = size;
+  pack->pts = pts;
+  pack->frame_end = frame_end;
+  pack->flush = flush;
+  pack->layer = layer;
+  pack->independent = independent;
+
+  __atomic_fetch_add(&tx_ring_used, size, __ATOMIC_RELAXED);
+  __atomic_store_n(&tx_ring_head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * @brief Give up the rest of the current stream after pushPack() failed,
+ *   packs of the frame already in Tx ring are ended with an empty pack so
+ *   the sender completes and sends them
+ * @param frame_end - Dropped packs include the end of the frame, otherwise
+ *   packs of later streams are dropped up to it
+ */
+void cutFrame(bool frame_end) {
+  if (tx_frame_open && !tx_frame_dropped) {
+    uint32_t head = tx_ring_head;
+    struct TxPack* last = &tx_ring_packs[(head - 1) % TX_RING_PACKS];
+    struct TxPack* pack = &tx_ring_packs[head % TX_RING_PACKS];
+    pack->offset = tx_ring_write;
+    pack->size = 0;
+    pack->pts = last->pts;
+    pack->frame_end = true;
+    pack->flush = true;
+    pack->layer = last->layer;
+    pack->independent = last->independent;
+    __atomic_store_n(&tx_ring_head, head + 1, __ATOMIC_RELEASE);
+  }
+
+  tx_frame_open = false;
+  tx_frame_cut = !frame_end;
+}
+
+void* __SENDER_THREAD__(void* param) {
+  (void)param;
+  uint32_t tail = tx_ring_tail;
+  bool frame_open = false;
+  openCycleCounter();
+
+  while (loop_running) {
+    serveNacks();
+
+    uint32_t head = __atomic_load_n(&tx_ring_head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      // Ring is empty, wait for encoder
+      uint64_t event_value;
+      read(tx_ring_event, &event_value, sizeof(event_value));
+      continue;
+    }
+
+    uint32_t fill = __atomic_load_n(&tx_ring_used, __ATOMIC_RELAXED) * 100 / TX_RING_SIZE;
+    if (fill > tx_ring_fill_max) {
+      tx_ring_fill_max = fill;
+    }
+
+    // Packetize packs up to the end of a stream
+    uint32_t released_size = 0;
+    while (tail != head) {
+      struct TxPack* pack = &tx_ring_packs[tail++ % TX_RING_PACKS];
+      released_size += pack->size;
+
+      // Empty pack ends a frame cut short by Tx ring overflow
+      if (!pack->size) {
+        frame_open = false;
+        for (uint8_t i = 0; i < sink_count; i++) {
+          if (sinks[i].frame_open) {
+            endFrame(&sinks[i]);
+          }
+        }
+        break;
+      }
+
+      // RTP timestamp uses 90 kHz clock, PTS is in microseconds
+      rtp_timestamp = pack->pts * 9 / 100;
+
+      // Index of base layer frames lets receivers tell which ones a frame
+      // depends on
+      bool frame_start = !frame_open;
+      if (frame_start && !pack->layer) {
+        tl0_index++;
+      }
+      if (frame_start && pace_percent) {
+        paceFrame(tail - 1, head);
+      }
+      frame_open = !pack->frame_end;
+      tx_layer = pack->layer;
+      tx_independent = pack->independent;
+      countPack(tx_ring_data + pack->offset, pack->size, pack->pts, pack->frame_end);
+
+      enum CongestionClass nal_class = congestion_classify(
+        tx_ring_data + pack->offset + 4, stream_codec == PT_H265, pack->layer);
+      updateParameterSets(pack, nal_class, frame_start);
+
+      // Packetize once per sink, payload is shared by all sinks
+      for (uint8_t i = 0; i < sink_count; i++) {
+        struct Sink* sink = &sinks[i];
+        if (!sink->frame_open) {
+          congestion_frame(&sink->congestion, getQueueFill(sink), sink->blocked);
+          sink->blocked = false;
+          sink->frame_last = -1;
+        }
+        sink->frame_open = !pack->frame_end;
+
+        // Sink is congested, drop the whole NAL before it takes sequence numbers
+        if (!congestion_admit(&sink->congestion, nal_class, pack->layer)) {
+          if (pack->frame_end) {
+            endFrame(sink);
+          }
+          continue;
+        }
+
+        sendPacket(sink, tx_ring_data + pack->offset, pack->size,
+          pack->frame_end);
+      }
+
+      if (pack->flush) {
+        break;
+      }
+    }
+
+    // Send all fragments with one syscall per sink, packs are referenced until here
+    for (uint8_t i = 0; i < sink_count; i++) {
+      flushAggregate(&sinks[i], false);
+      flushPackets(&sinks[i]);
+      kickSink(&sinks[i]);
+    }
+    ps_pending = false;
+
+    __atomic_fetch_sub(&tx_ring_used, released_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&tx_ring_tail, tail, __ATOMIC_RELEASE);
+
+    printStats();
+  }
+
+  return NULL;
+}
+
+int startSender(pthread_t* thread, int cpu) {
+  tx_ring_event = eventfd(0, 0);
+  if (tx_ring_event < 0) {
+    printf("ERROR: Unable to create Tx ring event: %s\n", strerror(errno));
+    return 1;
+  }
+
+  pthread_create(thread, NULL, __SENDER_THREAD__, NULL);
+
+  if (cpu >= 0) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    int ret = pthread_setaffinity_np(*thread, sizeof(cpu_set), &cpu_set);
+    if (ret) {
+      printf("WARN: Unable to pin sender thread to CPU %d: %s\n",
+        cpu, strerror(ret));
+    }
+  }
+
+  return 0;
+}
+
+bool isTxRingEmpty() {
+  return __atomic_load_n(&tx_ring_tail, __ATOMIC_ACQUIRE) ==
+    __atomic_load_n(&tx_ring_head, __ATOMIC_RELAXED);
+}
+
+void stopSender(pthread_t thread) {
+  // Wake up sender thread to let it exit
+  uint64_t event_value = 1;
+  write(tx_ring_event, &event_value, sizeof(event_value));
+  pthread_join(thread, NULL);
+  close(tx_ring_event);
+}
+
+/**
+ * @brief Ask sender to re-send parameter sets ahead of the next frame
+ */
+void requestParameterSets() {
+  __atomic_store_n(&parameter_sets_requested, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Cache parameter set pack, or re-send cached sets ahead of pack
+ * @param pack - Pack about to be packetized
+ * @param nal_class - Class of pack NAL
+ * @param frame_start - Pack is the first one of a frame
+ */
+void updateParameterSets(struct TxPack* pack, enum CongestionClass nal_class,
+  bool frame_start) {
+  uint8_t* data = tx_ring_data + pack->offset;
+  uint64_t now = 0;
+  if (frame_start) {
+    ps_in_frame = false;
+    ps_frames++;
+    now = getNanoseconds(CLOCK_MONOTONIC);
+  }
+
+  if (nal_class == CONGESTION_PARAMETER_SETS) {
+    // VPS, SPS and PPS of H.265 or SPS and PPS of H.264
+    uint8_t set = stream_codec == PT_H265 ? ((data[4] >> 1) & 0x3F) - 32 :
+      (data[4] & 0x1F) - 6;
+    if (set < PS_CACHE_SETS && pack->size <= PS_CACHE_SIZE &&
+        (ps_cache_sizes[set] != pack->size || memcmp(ps_cache[set], data, pack->size))) {
+      // Sets re-sent earlier in this batch are still referenced, send them first
+      if (ps_pending) {
+        for (uint8_t i = 0; i < sink_count; i++) {
+          flushAggregate(&sinks[i], false);
+          flushPackets(&sinks[i]);
+        }
+        ps_pending = false;
+      }
+
+      memcpy(ps_cache[set], data, pack->size);
+      ps_cache_sizes[set] = pack->size;
+    }
+
+    ps_in_frame = true;
+    ps_last_time = now ? now : getNanoseconds(CLOCK_MONOTONIC);
+    ps_frames = 0;
+    return;
+  }
+
+  // Nothing to send until encoder produced a complete set
+  if (ps_in_frame || !ps_cache_sizes[1] || !ps_cache_sizes[2]) {
+    return;
+  }
+
+  bool due = nal_class == CONGESTION_IDR;
+  if (frame_start) {
+    due |= __atomic_exchange_n(&parameter_sets_requested, 0, __ATOMIC_RELAXED);
+    due |= ps_interval && now - ps_last_time >= (uint64_t)ps_interval * 1000000;
+    due |= ps_refresh_frames && ps_frames >= ps_refresh_frames;
+  }
+
+  if (!due) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < sink_count; i++) {
+    for (uint8_t set = 0; set < PS_CACHE_SETS; set++) {
+      if (ps_cache_sizes[set]) {
+        sendPacket(&sinks[i], ps_cache[set], ps_cache_sizes[set], false);
+      }
+    }
+  }
+
+  parameter_sets_resent++;
+  ps_pending = true;
+  ps_in_frame = true;
+  ps_last_time = now ? now : getNanoseconds(CLOCK_MONOTONIC);
+  ps_frames = 0;
+}
+
+/**
+ * @brief Open audio socket, audio goes to every RTP sink on a UDP socket
+ * @param payload_type - Static RTP payload type of the codec
+ * @return 0 on success
+ */
+int openAudio(uint8_t payload_type) {
+  bool has_rtp = false;
+  for (uint8_t i = 0; i < sink_count; i++) {
+    if (sinks[i].mode != 1) {
+      continue;
+    }
+
+    if (sinks[i].packet_ring) {
+      printf("WARN: Sink #%d sends through packet ring, no audio\n", i);
+      continue;
+    }
+
+    has_rtp = true;
+  }
+
+  if (!has_rtp) {
+    printf("> ERROR: Audio requires RTP streaming mode\n");
+    return 1;
+  }
+
+  audio_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (audio_socket < 0) {
+    printf("ERROR: Unable to open audio socket: %s\n", strerror(errno));
+    return 1;
+  }
+
+  audio_payload_type = payload_type;
+  return 0;
+}
+
+/**
+ * @brief Close audio socket
+ */
+void closeAudio() {
+  if (audio_socket >= 0) {
+    close(audio_socket);
+    audio_socket = -1;
+  }
+}
+
+/**
+ * @brief Send encoded audio frame to every RTP sink as one packet
+ * @param data - Frame without HiSilicon frame header
+ * @param size - Frame size
+ * @param pts - Frame PTS, us, same clock as video PTS
+ */
+void sendAudio(uint8_t* data, uint32_t size, uint64_t pts) {
+  struct RTPHeader header;
+  header.version = 0x80;
+  header.payload_type = audio_payload_type | (audio_started ? 0 : 0x80);
+  header.sequence = htobe16(audio_sequence++);
+  header.timestamp = htobe32(pts * AUDIO_SAMPLE_RATE / 1000000);
+  header.ssrc_id = htobe32(AUDIO_SSRC);
+  audio_started = true;
+
+  struct iovec vectors[2] = {
+    {.iov_base = &header, .iov_len = sizeof(header)},
+    {.iov_base = data, .iov_len = size}
+  };
+
+  bool dropped = false;
+  for (uint8_t i = 0; i < sink_count; i++) {
+    struct Sink* sink = &sinks[i];
+    if (sink->mode != 1 || sink->packet_ring) {
+      continue;
+    }
+
+    struct msghdr message;
+    memset(&message, 0x00, sizeof(message));
+    message.msg_name = &sink->address;
+    message.msg_namelen = sizeof(sink->address);
+    message.msg_iov = vectors;
+    message.msg_iovlen = 2;
+
+    // Late audio is worse than lost audio, never wait for the socket
+    if (sendmsg(audio_socket, &message, MSG_DONTWAIT) < 0) {
+      dropped = true;
+    }
+  }
+
+  __atomic_add_fetch(dropped ? &audio_frames_dropped : &audio_frames_sent, 1,
+    __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Count CPU cycles of the calling thread, kernel included
+ */
+void openCycleCounter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0x00, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+
+  // User space only cycles would hide the syscall cost being measured
+  cycle_counter = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  if (cycle_counter < 0) {
+    printf("> Cycle counter is not available (%s), CPU use is shown as time\n",
+      strerror(errno));
+  }
+}
+
+/**
+ * @brief Sender thread CPU time and cycles per datagram since last call
+ */
+void measureCpu(struct MetricsSnapshot* snapshot) {
+  uint64_t time = getNanoseconds(CLOCK_THREAD_CPUTIME_ID);
+  uint64_t cycles = 0;
+  if (cycle_counter >= 0 && read(cycle_counter, &cycles, sizeof(cycles)) != sizeof(cycles)) {
+    cycles = 0;
+  }
+
+  uint64_t packets = packets_total - cpu_last_packets;
+  snapshot->cpu_per_packet = packets ? (time - cpu_last_time) / packets : 0;
+  snapshot->cycles_per_packet = packets && cycles ? (cycles - cpu_last_cycles) / packets : 0;
+
+  cpu_last_time = time;
+  cpu_last_cycles = cycles;
+  cpu_last_packets = packets_total;
+}
+
+void printStats() {
+  // Collect stats once per second
+  struct timespec current_timestamp;
+  if (!clock_gettime(CLOCK_MONOTONIC_COARSE, &current_timestamp)) {
+    double interval = getTimeInterval(&current_timestamp, &last_timestamp);
+    if (interval > 1) {
+      struct MetricsSnapshot snapshot;
+      metrics_finish(&metrics_state, &snapshot, interval * 1000);
+      snapshot.packets = packets_sent;
+      snapshot.packets_aggregated = aggregated_packets;
+      snapshot.packets_fec = fec_packets_sent;
+      snapshot.packets_dropped = packets_dropped;
+      snapshot.nals_fragmented = nals_fragmented;
+      snapshot.nals_oversized = nals_oversized;
+      snapshot.syscalls = syscalls_sent;
+      snapshot.bursts = pace_burst_count;
+      snapshot.burst_max = pace_burst_max;
+      snapshot.burst_gap = pace_gap_count ? pace_gap_sum / pace_gap_count : 0;
+      snapshot.ring_fill_max = tx_ring_fill_max;
+      snapshot.ring_overflows = __atomic_exchange_n(&tx_ring_overflows, 0, __ATOMIC_RELAXED);
+      snapshot.layer_dropped = __atomic_exchange_n(&layer_frames_dropped, 0, __ATOMIC_RELAXED);
+      snapshot.parameter_sets_resent = parameter_sets_resent;
+      snapshot.queue_fill_max = 0;
+      memset(snapshot.shed, 0x00, sizeof(snapshot.shed));
+      for (uint8_t i = 0; i < sink_count; i++) {
+        struct CongestionState* congestion = &sinks[i].congestion;
+        snapshot.queue_fill_max = MAX2(snapshot.queue_fill_max, congestion->fill_max);
+        for (uint8_t j = 0; j < CONGESTION_CLASSES; j++) {
+          snapshot.shed[j] += congestion->dropped[j];
+          congestion->dropped[j] = 0;
+        }
+        congestion->fill_max = 0;
+      }
+      snapshot.retransmitted = packets_retransmitted;
+      snapshot.nacks_late = nacks_late;
+      snapshot.nacks_missing = nacks_missing;
+      snapshot.keyframe_requests = __atomic_exchange_n(&keyframe_requests, 0, __ATOMIC_RELAXED);
+      snapshot.audio_frames = __atomic_exchange_n(&audio_frames_sent, 0, __ATOMIC_RELAXED);
+      snapshot.audio_dropped = __atomic_exchange_n(&audio_frames_dropped, 0, __ATOMIC_RELAXED);
+      measureCpu(&snapshot);
+
+      pthread_mutex_lock(&metrics_lock);
+      metrics_published = snapshot;
+      pthread_mutex_unlock(&metrics_lock);
+
+      // Monitoring reads snapshots instead
+      if (!metrics_port) {
+        printSnapshot(&snapshot);
+      }
+
+      // Per-sink counters
+      for (uint8_t i = 0; sink_count > 1 && i < sink_count; i++) {
+        struct Sink* sink = &sinks[i];
+        if (!metrics_port) {
+          printf("  Sink #%d %s:%d | Rate: %.2f Mbit/sec. | Packets: %d, Errors: %d\n",
+            i, inet_ntoa(sink->address.sin_addr), ntohs(sink->address.sin_port),
+            ((double)sink->bytes_sent * 8) / interval / 1024 / 1024,
+            sink->packets_sent, sink->errors);
+        }
+
+        sink->bytes_sent = 0;
+        sink->packets_sent = 0;
+        sink->errors = 0;
+      }
+
+      packets_sent = 0;
+      packets_dropped = 0;
+      aggregated_packets = 0;
+      fec_packets_sent = 0;
+      nals_fragmented = 0;
+      nals_oversized = 0;
+      syscalls_sent = 0;
+      pace_burst_max = 0;
+      pace_burst_count = 0;
+      pace_gap_sum = 0;
+      pace_gap_count = 0;
+      tx_ring_fill_max = 0;
+      packets_retransmitted = 0;
+      nacks_late = 0;
+      nacks_missing = 0;
+      parameter_sets_resent = 0;
+      last_timestamp = current_timestamp;
+    }
+  }
+}
+
+void printSnapshot(struct MetricsSnapshot* s) {
+  double interval = s->interval / 1000.;
+  printf("> Rate: %.2f Mbit/sec. (%.1f fps) | NALs: %d, NotFrag: "
+       "%d | AVG Size: %d, MAX Size: %d | S: %d, IDR: %d, SEI: %d, "
+       "VPS: %d, PPS: %d, SPS: %d | MAX Frame: %d, MAX Interval: %d us, Jitter: %d us | "
+       "Packets: %d, Aggregated: %d, FEC: %d, Dropped: %d | "
+       "Fragmented: %d, Over MTU: %d | Syscalls: %d (%.2f per frame) | "
+       "Bursts: %d, MAX Burst: %d, AVG Gap: %.1f us | "
+       "Ring: %d%%, Overflow: %d, Layer drops: %d | "
+       "Queue: %d%%, Shed PS: %d, IDR: %d, Ref: %d, Non-ref: %d | Retransmitted: %d, Late: %d, Missing: %d | "
+       "IDR requests: %d, PS resent: %d | CPU per packet: %d ns, %d cycles | "
+       "Audio: %d, dropped %d\n",
+    ((double)s->bytes * 8) / interval / 1024 / 1024,
+    (double)s->frames / interval,
+    s->nals, s->nals_single, s->nals ? (uint32_t)(s->bytes / s->nals) : 0,
+    s->nal_max_size, s->nal_counts[METRICS_NAL_SLICE], s->nal_counts[METRICS_NAL_IDR],
+    s->nal_counts[METRICS_NAL_SEI], s->nal_counts[METRICS_NAL_VPS],
+    s->nal_counts[METRICS_NAL_PPS], s->nal_counts[METRICS_NAL_SPS],
+    s->frame_max_size, s->frame_interval_max, s->jitter,
+    s->packets, s->packets_aggregated, s->packets_fec, s->packets_dropped,
+    s->nals_fragmented, s->nals_oversized, s->syscalls,
+    s->frames ? (double)s->syscalls / s->frames : 0.,
+    s->bursts, s->burst_max, s->burst_gap / 1000.,
+    s->ring_fill_max, s->ring_overflows, s->layer_dropped,
+    s->queue_fill_max, s->shed[CONGESTION_PARAMETER_SETS], s->shed[CONGESTION_IDR],
+    s->shed[CONGESTION_REFERENCE], s->shed[CONGESTION_NON_REFERENCE],
+    s->retransmitted, s->nacks_late, s->nacks_missing, s->keyframe_requests,
+    s->parameter_sets_resent, s->cpu_per_packet, s->cycles_per_packet,
+    s->audio_frames, s->audio_dropped);
+}
+
+void processMetrics(int metrics_fd) {
+  char request[16];
+  struct sockaddr_in source;
+  while (true) {
+    socklen_t source_size = sizeof(source);
+    int size = recvfrom(metrics_fd, request, sizeof(request) - 1, 0,
+      (struct sockaddr*)&source, &source_size);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    request[size] = 0;
+
+    struct MetricsSnapshot snapshot;
+    pthread_mutex_lock(&metrics_lock);
+    snapshot = metrics_published;
+    pthread_mutex_unlock(&metrics_lock);
+
+    // "json" asks for text, anything else for binary snapshot
+    if (!strncmp(request, "json", 4)) {
+      char reply[2048];
+      uint32_t length = metrics_json(&snapshot, reply, sizeof(reply));
+      sendto(metrics_fd, reply, length, 0, (struct sockaddr*)&source, source_size);
+    } else {
+      sendto(metrics_fd, &snapshot, sizeof(snapshot), 0,
+        (struct sockaddr*)&source, source_size);
+    }
+  }
+}
+
+
+// Batched transmission
+// All fragments of the packs returned by one HI_MPI_VENC_GetStream call are
+// collected in the batch of every sink and flushed with a single sendmmsg
+// call per sink. Payload vectors point straight into Tx ring memory, only
+// the RTP, FU and aggregation headers are stored in the batch itself.
+// Sinks with a packet ring copy the batch into AF_PACKET ring frames instead
+// and the kernel is kicked once after the whole frame is queued.
+
+// Send pacing
+// Departure times follow a token bucket in its virtual time form: a packet
+// may leave once the theoretical arrival time of the bucket, less the burst
+// tolerance, has passed. Packets either wait in userspace before sendmmsg or
+// carry their departure time to the ETF qdisc with SO_TXTIME.
+
+// Measured bursts of the batch being sent
+uint64_t pace_last_departure = 0;
+uint32_t pace_burst_size = 0;
+
+uint64_t getNanoseconds(clockid_t clock) {
+  struct timespec timestamp;
+  clock_gettime(clock, &timestamp);
+  return (uint64_t)timestamp.tv_sec * 1000000000 + timestamp.tv_nsec;
+}
+
+uint32_t getDatagramSize(struct Sink* sink, uint32_t index) {
+  struct msghdr* msg = &sink->messages[index].msg_hdr;
+  uint32_t size = 0;
+  for (uint32_t i = 0; i < msg->msg_iovlen; i++) {
+    size += msg->msg_iov[i].iov_len;
+  }
+  return size;
+}
+
+/**
+ * @brief Derive pacing rate and burst allowance from encoder bitrate
+ * @param bitrate - Encoder max bitrate, Kbit/sec.
+ */
+void setPaceRate(uint32_t bitrate) {
+  // Average frame leaves within the configured share of frame interval
+  uint64_t rate = (uint64_t)bitrate * 1024 / 8 * 100 / pace_percent;
+  __atomic_store_n(&pace_rate, rate, __ATOMIC_RELAXED);
+  __atomic_store_n(&pace_burst_ns,
+    (uint64_t)pace_burst * sinks[0].mtu * 1000000000 / rate, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Derive pacing rate of the frame starting at a Tx ring pack
+ * @param index - Ring index of the first pack of the frame
+ * @param head - Ring head, packs before it are queued
+ */
+void paceFrame(uint32_t index, uint32_t head) {
+  uint64_t frame_size = 0;
+  while (index != head) {
+    struct TxPack* pack = &tx_ring_packs[index++ % TX_RING_PACKS];
+    frame_size += pack->size;
+    if (pack->frame_end || pack->flush) {
+      break;
+    }
+  }
+
+  // Never spread a frame over more than the configured share of frame
+  // interval, large IDR frames are sent faster than the average rate
+  pace_frame_rate = frame_size * pace_framerate * 100 / pace_percent;
+  uint64_t rate = __atomic_load_n(&pace_rate, __ATOMIC_RELAXED);
+  if (pace_frame_rate < rate) {
+    pace_frame_rate = rate;
+  }
+}
+
+/**
+ * @brief Assign departure times to all datagrams of the Tx batch, at the
+ *   rate of the current frame
+ */
+void paceBatch(struct Sink* sink) {
+  uint64_t now = getNanoseconds(pace_clock);
+  uint64_t rate = pace_frame_rate;
+  if (!rate) {
+    rate = __atomic_load_n(&pace_rate, __ATOMIC_RELAXED);
+  }
+  uint64_t burst_ns = __atomic_load_n(&pace_burst_ns, __ATOMIC_RELAXED);
+
+  for (uint32_t i = 0; i < sink->batch_count; i++) {
+    uint64_t departure = now;
+    if (sink->pace_arrival > now + burst_ns) {
+      departure = sink->pace_arrival - burst_ns;
+    }
+
+    if (sink->pace_arrival < departure) {
+      sink->pace_arrival = departure;
+    }
+    sink->pace_arrival += getDatagramSize(sink, i) * 1000000000ULL / rate;
+    sink->departures[i] = departure;
+
+#ifdef SO_TXTIME
+    if (pace_txtime) {
+      struct msghdr* msg = &sink->messages[i].msg_hdr;
+      msg->msg_control = sink->control[i];
+      msg->msg_controllen = sizeof(sink->control[i]);
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(cmsg), &departure, sizeof(uint64_t));
+    }
+#endif
+  }
+}
+
+/**
+ * @brief Account departure of a datagram in burst and gap stats
+ */
+void measureDeparture(uint64_t departure) {
+  if (pace_burst_size) {
+    uint64_t gap = departure - pace_last_departure;
+    pace_gap_sum += gap;
+    pace_gap_count++;
+
+    // Datagrams closer than this leave back to back
+    if (gap < PACE_BURST_GAP_NS) {
+      pace_burst_size++;
+      pace_last_departure = departure;
+      return;
+    }
+
+    finishBurst();
+  }
+
+  pace_burst_size = 1;
+  pace_last_departure = departure;
+}
+
+void finishBurst() {
+  if (!pace_burst_size) {
+    return;
+  }
+
+  pace_burst_count++;
+  if (pace_burst_size > pace_burst_max) {
+    pace_burst_max = pace_burst_size;
+  }
+  pace_burst_size = 0;
+}
+
+void flushPackets(struct Sink* sink) {
+  if (pace_percent && sink->batch_count) {
+    paceBatch(sink);
+  }
+
+  uint32_t offset = 0;
+  while (offset < sink->batch_count) {
+    uint32_t count = sink->batch_count - offset;
+    uint64_t now = getNanoseconds(pace_clock);
+
+    if (pace_percent && !pace_txtime) {
+      // Wait for the next datagram, then send all which are due
+      if (sink->departures[offset] > now) {
+        struct timespec wakeup;
+        wakeup.tv_sec = sink->departures[offset] / 1000000000;
+        wakeup.tv_nsec = sink->departures[offset] % 1000000000;
+        clock_nanosleep(pace_clock, TIMER_ABSTIME, &wakeup, NULL);
+        now = getNanoseconds(pace_clock);
+      }
+
+      count = 1;
+      while (offset + count < sink->batch_count &&
+          sink->departures[offset + count] <= now) {
+        count++;
+      }
+    }
+
+    int ret;
+    if (sink->packet_ring) {
+      ret = queueRing(sink, offset, count);
+
+      // Paced groups leave now, otherwise the whole frame leaves with one kick
+      if (pace_percent) {
+        kickSink(sink);
+      }
+    } else if (tx_mode == TX_MODE_GSO) {
+      ret = sendSegments(sink, offset, count);
+    } else if (tx_mode == TX_MODE_PLAIN) {
+      ret = sendmsg(sink->socket_handle, &sink->messages[offset].msg_hdr,
+        MSG_DONTWAIT) < 0 ? -1 : 1;
+      syscalls_sent++;
+    } else {
+      ret = sendmmsg(sink->socket_handle, sink->messages + offset, count, MSG_DONTWAIT);
+      syscalls_sent++;
+    }
+
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // Socket buffer is full, next frame is shed by the congestion manager.
+      // Datagrams of this one already have sequence numbers, wait for space
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        sink->blocked = true;
+        if (errno != ENOBUFS && waitWritable(sink)) {
+          continue;
+        }
+      }
+
+      // Drop the rest of the batch, socket did not drain in time or link is down
+      packets_dropped += sink->batch_count - offset;
+      sink->errors += sink->batch_count - offset;
+      break;
+    }
+
+    for (int i = 0; i < ret; i++) {
+      measureDeparture(pace_percent && pace_txtime ? sink->departures[offset + i] : now);
+      sink->bytes_sent += getDatagramSize(sink, offset + i);
+      bytes_total += getDatagramSize(sink, offset + i);
+    }
+
+    sink->packets_sent += ret;
+    packets_total += ret;
+    offset += ret;
+  }
+
+  finishBurst();
+  sink->batch_count = 0;
+  sink->fec_parity_used = 0;
+  sink->frame_last = -1;
+}
+
+/**
+ * @brief Send datagrams of the Tx batch with UDP GSO
+ *
+ * Runs of equal size datagrams, e.g. FU fragments of one NAL or parity of
+ * one FEC block, are passed as one buffer with UDP_SEGMENT set to their
+ * size and split by the kernel. Only the last datagram of a run may be
+ * shorter. All runs still go out with one sendmmsg call.
+ * @return Number of datagrams sent, -1 on error
+ */
+int sendSegments(struct Sink* sink, uint32_t offset, uint32_t count) {
+  uint32_t message_count = 0;
+  uint32_t vector_count = 0;
+  uint32_t end = offset + count;
+
+  for (uint32_t i = offset; i < end; message_count++) {
+    struct msghdr* gso = &sink->gso_messages[message_count].msg_hdr;
+    memset(gso, 0x00, sizeof(struct msghdr));
+    gso->msg_name = &sink->address;
+    gso->msg_namelen = sizeof(struct sockaddr_in);
+    gso->msg_iov = sink->gso_vectors + vector_count;
+
+    uint32_t segment_size = getDatagramSize(sink, i);
+    uint32_t segments = 0;
+    uint32_t total_size = 0;
+    while (i < end && segments < GSO_MAX_SEGMENTS) {
+      uint32_t size = getDatagramSize(sink, i);
+      if (size > segment_size || total_size + size > GSO_MAX_SIZE) {
+        break;
+      }
+
+      struct msghdr* msg = &sink->messages[i].msg_hdr;
+      memcpy(gso->msg_iov + gso->msg_iovlen, msg->msg_iov,
+        msg->msg_iovlen * sizeof(struct iovec));
+      gso->msg_iovlen += msg->msg_iovlen;
+      vector_count += msg->msg_iovlen;
+      total_size += size;
+      segments++;
+      i++;
+
+      if (size < segment_size) {
+        break;
+      }
+    }
+
+    sink->gso_segments[message_count] = segments;
+    if (segments > 1) {
+      gso->msg_control = sink->gso_control[message_count];
+      gso->msg_controllen = sizeof(sink->gso_control[message_count]);
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(gso);
+      cmsg->cmsg_level = IPPROTO_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t value = segment_size;
+      memcpy(CMSG_DATA(cmsg), &value, sizeof(value));
+    }
+  }
+
+  int ret = sendmmsg(sink->socket_handle, sink->gso_messages, message_count, MSG_DONTWAIT);
+  syscalls_sent++;
+
+  if (ret < 0) {
+    // Interface or kernel can't segment, stay with plain batches from now on
+    if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+      printf("WARN: UDP GSO send failed (%s), using sendmmsg batches\n", strerror(errno));
+      tx_mode = TX_MODE_BATCH;
+      ret = sendmmsg(sink->socket_handle, sink->messages + offset, count, MSG_DONTWAIT);
+      syscalls_sent++;
+    }
+    return ret;
+  }
+
+  uint32_t sent = 0;
+  for (int i = 0; i < ret; i++) {
+    sent += sink->gso_segments[i];
+  }
+  return sent;
+}
+
+/**
+ * @brief Copy datagrams of the Tx batch into packet ring
+ * @return Number of datagrams queued, -1 if none fit
+ */
+int queueRing(struct Sink* sink, uint32_t offset, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    struct msghdr* msg = &sink->messages[offset + i].msg_hdr;
+    int ret = packet_ring_queue(sink->packet_ring, msg->msg_iov, msg->msg_iovlen);
+    if (ret > 0) {
+      // Ring is full, let kernel catch up
+      syscalls_sent += packet_ring_kick(sink->packet_ring, true);
+      ret = packet_ring_queue(sink->packet_ring, msg->msg_iov, msg->msg_iovlen);
+    }
+
+    if (ret) {
+      errno = ENOBUFS;
+      return i ? (int)i : -1;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * @brief Kernel queue fill of sink, socket send buffer or packet ring
+ * @return Percent
+ */
+uint32_t getQueueFill(struct Sink* sink) {
+  if (sink->packet_ring) {
+    return packet_ring_pending(sink->packet_ring) * 100 / PACKET_RING_FRAMES;
+  }
+
+  if (!sink->send_buffer) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    getsockopt(sink->socket_handle, SOL_SOCKET, SO_SNDBUF, &size, &length);
+    sink->send_buffer = size > 0 ? size : 1;
+  }
+
+  // Bytes not yet sent by the interface, headers and buffer overhead included
+  int queued = 0;
+  if (ioctl(sink->socket_handle, SIOCOUTQ, &queued) || queued < 0) {
+    return 0;
+  }
+
+  return MIN2((uint64_t)queued * 100 / sink->send_buffer, 100);
+}
+
+/**
+ * @brief Wait until socket buffer of sink has space again
+ * @return true if datagrams can be sent
+ */
+bool waitWritable(struct Sink* sink) {
+  struct pollfd poll_fd = {.fd = sink->socket_handle, .events = POLLOUT};
+  int ret;
+  do {
+    ret = poll(&poll_fd, 1, CONGESTION_SEND_WAIT);
+  } while (ret < 0 && errno == EINTR);
+  return ret > 0 && (poll_fd.revents & POLLOUT);
+}
+
+void kickSink(struct Sink* sink) {
+  if (sink->packet_ring) {
+    syscalls_sent += packet_ring_kick(sink->packet_ring, false);
+  }
+}
+
+/**
+ * @brief Start a new datagram in the Tx batch
+ */
+void beginDatagram(struct Sink* sink) {
+  if (sink->batch_count == TX_BATCH_SIZE) {
+    flushPackets(sink);
+  }
+
+  struct msghdr* msg = &sink->messages[sink->batch_count].msg_hdr;
+  memset(msg, 0x00, sizeof(struct msghdr));
+  msg->msg_iov = sink->vectors[sink->batch_count];
+  msg->msg_name = &sink->address;
+  msg->msg_namelen = sizeof(struct sockaddr_in);
+  sink->header_used = 0;
+
+  // RTP header is filled in when the datagram is committed
+  if (sink->mode == 1) {
+    msg->msg_iov[0].iov_base = &sink->rtp_headers[sink->batch_count];
+    msg->msg_iov[0].iov_len = sizeof(struct RTPHeader);
+    msg->msg_iovlen = 1;
+
+    if (layer_marking) {
+      msg->msg_iov[1].iov_base = &sink->frame_markings[sink->batch_count];
+      msg->msg_iov[1].iov_len = sizeof(struct RTPFrameMarking);
+      msg->msg_iovlen = 2;
+    }
+  }
+}
+
+/**
+ * @brief Append a header to the current datagram, data is copied
+ */
+void appendHeader(struct Sink* sink, const uint8_t* header, uint32_t header_size) {
+  struct msghdr* msg = &sink->messages[sink->batch_count].msg_hdr;
+  uint8_t* slot = sink->nal_headers[sink->batch_count] + sink->header_used;
+  memcpy(slot, header, header_size);
+  sink->header_used += header_size;
+
+  msg->msg_iov[msg->msg_iovlen].iov_base = slot;
+  msg->msg_iov[msg->msg_iovlen].iov_len = header_size;
+  msg->msg_iovlen++;
+}
+
+/**
+ * @brief Append payload to the current datagram, data is referenced in place
+ */
+void appendPayload(struct Sink* sink, uint8_t* payload, uint32_t payload_size) {
+  struct msghdr* msg = &sink->messages[sink->batch_count].msg_hdr;
+  msg->msg_iov[msg->msg_iovlen].iov_base = payload;
+  msg->msg_iov[msg->msg_iovlen].iov_len = payload_size;
+  msg->msg_iovlen++;
+}
+
+// Forward error correction over blocks of RTP data packets
+
+/**
+ * @brief Send parity packets of FEC block and start a new block
+ */
+void closeBlock(struct Sink* sink, struct FECBlock* block) {
+  for (uint8_t i = 0; i < sink->fec_parity_count; i++) {
+    // Full batch is sent here, its parity buffers are free again
+    beginDatagram(sink);
+
+    // Block keeps accumulating once parity is copied out for the batch
+    uint8_t* out = sink->fec_parity_out + sink->fec_parity_used++ * sink->fec_parity_stride;
+    struct FECHeader* header = (struct FECHeader*)out;
+    header->base_sequence = htobe16(block->base_sequence);
+    header->stride = sink->fec_depth;
+    header->data_count = block->data_count;
+    header->parity_count = sink->fec_parity_count;
+    header->parity_index = i;
+    memcpy(out + sizeof(struct FECHeader), block->parity[i], block->symbol_size);
+
+    // Parity datagrams carry no frame marking
+    sink->messages[sink->batch_count].msg_hdr.msg_iovlen = 1;
+    appendPayload(sink, out, sizeof(struct FECHeader) + block->symbol_size);
+
+    // Parity is a stream of its own with its own sequence space
+    struct RTPHeader* rtp_header = &sink->rtp_headers[sink->batch_count];
+    rtp_header->version = 0x80;
+    rtp_header->payload_type = FEC_PAYLOAD_TYPE;
+    rtp_header->sequence = htobe16(sink->fec_sequence++);
+    rtp_header->timestamp = htobe32(rtp_timestamp);
+    rtp_header->ssrc_id = htobe32(FEC_SSRC);
+
+    sink->batch_count++;
+    fec_packets_sent++;
+  }
+
+  for (uint8_t i = 0; i < sink->fec_parity_count; i++) {
+    memset(block->parity[i], 0x00, block->symbol_size);
+  }
+
+  block->data_count = 0;
+  block->symbol_size = 0;
+}
+
+/**
+ * @brief Add current datagram to FEC block
+ */
+void protectDatagram(struct Sink* sink) {
+  struct msghdr* msg = &sink->messages[sink->batch_count].msg_hdr;
+  struct FECBlock* block = &sink->fec_blocks[sink->fec_block_index];
+  sink->fec_block_index = (sink->fec_block_index + 1) % sink->fec_depth;
+
+  if (!block->data_count) {
+    block->base_sequence = sink->rtp_sequence - 1;
+  }
+
+  // Symbol is 16-bit datagram length followed by datagram
+  uint32_t size = 0;
+  for (size_t i = 0; i < msg->msg_iovlen; i++) {
+    size += msg->msg_iov[i].iov_len;
+  }
+
+  uint8_t length[2] = { size >> 8, size & 0xFF };
+  uint8_t index = block->data_count++;
+
+  for (uint8_t i = 0; i < sink->fec_parity_count; i++) {
+    uint8_t coefficient = fec_coefficient(i, index);
+    uint8_t* parity = block->parity[i];
+
+    fec_encode(parity, length, sizeof(length), coefficient);
+    parity += sizeof(length);
+
+    for (size_t j = 0; j < msg->msg_iovlen; j++) {
+      fec_encode(parity, msg->msg_iov[j].iov_base, msg->msg_iov[j].iov_len,
+        coefficient);
+      parity += msg->msg_iov[j].iov_len;
+    }
+  }
+
+  block->symbol_size = MAX2(block->symbol_size, size + sizeof(length));
+}
+
+/**
+ * @brief Finish current datagram
+ * @param marker - Last datagram of access unit
+ */
+void commitDatagram(struct Sink* sink, bool marker) {
+  if (sink->mode == 1) {
+    struct RTPHeader* rtp_header = &sink->rtp_headers[sink->batch_count];
+    rtp_header->version = 0x80;
+    rtp_header->payload_type = 0x60 | (marker ? 0x80 : 0);
+    rtp_header->sequence = htobe16(sink->rtp_sequence++);
+    rtp_header->timestamp = htobe32(rtp_timestamp);
+    rtp_header->ssrc_id = htobe32(0xDEADBEEF);
+
+    // Relays drop enhancement layers by temporal layer ID alone
+    if (layer_marking) {
+      struct RTPFrameMarking* marking = &sink->frame_markings[sink->batch_count];
+      rtp_header->version |= 0x10;
+      marking->profile = htobe16(0xBEDE);
+      marking->length = htobe16(1);
+      marking->id_length = RTP_FRAME_MARKING_ID << 4 | 2;
+      marking->flags = (sink->frame_started ? 0 : FRAME_MARKING_START) |
+        (marker ? FRAME_MARKING_END : 0) |
+        (tx_independent ? FRAME_MARKING_INDEPENDENT : 0) | tx_layer;
+      marking->layer_id = 0;
+      marking->tl0_index = tl0_index;
+      sink->frame_started = !marker;
+    }
+
+    if (sink->nack_cache) {
+      cacheDatagram(sink);
+    }
+
+    sink->frame_last = marker ? -1 : (int32_t)sink->batch_count;
+    sink->frame_last_parity = -1;
+  }
+
+  if (!sink->fec_data_count) {
+    sink->batch_count++;
+    packets_sent++;
+    return;
+  }
+
+  struct FECBlock* block = &sink->fec_blocks[sink->fec_block_index];
+  protectDatagram(sink);
+  sink->frame_last_block = block;
+  sink->frame_last_index = block->data_count - 1;
+
+  sink->batch_count++;
+  packets_sent++;
+
+  if (block->data_count == sink->fec_data_count) {
+    // Parity is copied out behind the datagram, unless the batch was sent meanwhile
+    int32_t parity = sink->fec_parity_used;
+    closeBlock(sink, block);
+    if (sink->frame_last >= 0) {
+      sink->frame_last_parity = parity;
+    }
+  }
+
+  // Close all blocks at the end of frame, so a frame never waits for the next one
+  if (marker) {
+    for (uint8_t i = 0; i < sink->fec_depth; i++) {
+      if (sink->fec_blocks[i].data_count) {
+        closeBlock(sink, &sink->fec_blocks[i]);
+      }
+    }
+  }
+}
+
+// Selective retransmission
+// Every RTP data datagram is copied into a slot indexed by its sequence
+// number. Slots are reused as sequence numbers advance and a slot is only
+// valid for the NACK window after its frame started, so the cache is bounded
+// by time and never allocates while streaming.
+
+/**
+ * @brief Copy current datagram into retransmission cache
+ */
+void cacheDatagram(struct Sink* sink) {
+  struct msghdr* msg = &sink->messages[sink->batch_count].msg_hdr;
+  uint16_t sequence = sink->rtp_sequence - 1;
+  struct NackSlot* slot = &sink->nack_cache[sequence & (sink->nack_slots - 1)];
+  uint64_t now = getNanoseconds(CLOCK_MONOTONIC);
+
+  // All datagrams of a frame share its playout deadline
+  if (rtp_timestamp != sink->nack_timestamp || !sink->nack_frame_start) {
+    sink->nack_timestamp = rtp_timestamp;
+    sink->nack_frame_start = now;
+  }
+
+  slot->sequence = sequence;
+  slot->size = 0;
+  slot->sent = now;
+  slot->deadline = sink->nack_frame_start + (uint64_t)nack_window * 1000000;
+
+  for (size_t i = 0; i < msg->msg_iovlen; i++) {
+    if (slot->size + msg->msg_iov[i].iov_len > NACK_MAX_DATAGRAM) {
+      slot->size = 0;
+      return;
+    }
+
+    memcpy(slot->data + slot->size, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+    slot->size += msg->msg_iov[i].iov_len;
+  }
+}
+
+void retransmitDatagram(struct Sink* sink, uint16_t sequence, uint64_t now) {
+  struct NackSlot* slot = &sink->nack_cache[sequence & (sink->nack_slots - 1)];
+  if (slot->sequence != sequence || !slot->size || now > slot->deadline) {
+    nacks_missing++;
+    return;
+  }
+
+  // Request took about one round trip since the original was sent, the
+  // retransmission needs about half of that to reach the receiver
+  if (now + (now - slot->sent) / 2 > slot->deadline) {
+    nacks_late++;
+    return;
+  }
+
+  if (sink->packet_ring) {
+    struct iovec vector = { slot->data, slot->size };
+    if (packet_ring_queue(sink->packet_ring, &vector, 1)) {
+      sink->errors++;
+      return;
+    }
+    kickSink(sink);
+  } else if (sendto(sink->socket_handle, slot->data, slot->size, MSG_DONTWAIT,
+      (struct sockaddr*)&sink->address, sizeof(sink->address)) < 0) {
+    // Socket buffer is full of fresh frames, never wait for it with a repair
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+      sink->blocked = true;
+      packets_dropped++;
+      return;
+    }
+
+    sink->errors++;
+    return;
+  }
+
+  packets_retransmitted++;
+  packets_total++;
+  bytes_total += slot->size;
+  sink->packets_sent++;
+  sink->bytes_sent += slot->size;
+}
+
+void serveNacks() {
+  uint32_t head = __atomic_load_n(&nack_head, __ATOMIC_ACQUIRE);
+  if (head == nack_tail) {
+    return;
+  }
+
+  uint64_t now = getNanoseconds(CLOCK_MONOTONIC);
+  while (nack_tail != head) {
+    struct NackRequest* request = &nack_requests[nack_tail % NACK_QUEUE_SIZE];
+    struct Sink* sink = &sinks[request->sink];
+
+    retransmitDatagram(sink, request->sequence, now);
+    for (uint8_t i = 0; i < 16; i++) {
+      if (request->bitmask & (1 << i)) {
+        retransmitDatagram(sink, request->sequence + i + 1, now);
+      }
+    }
+
+    __atomic_store_n(&nack_tail, nack_tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Small NALs waiting for STAP-A (H.264) / AP (H.265) aggregation, RTP mode only
+
+bool isAggregatable(uint8_t* nal_data) {
+  if (stream_codec == PT_H265) {
+    uint8_t nal_type = (nal_data[0] >> 1) & 0x3F;
+    // VPS, SPS, PPS, AUD, SEI
+    return (nal_type >= 32 && nal_type <= 35) || nal_type == 39 || nal_type == 40;
+  }
+
+  uint8_t nal_type = nal_data[0] & 0x1F;
+  // SEI, SPS, PPS, AUD
+  return nal_type >= 6 && nal_type <= 9;
+}
+
+/**
+ * @brief Set marker on the last datagram of current frame after the
+ *   frame-final NAL was shed, its FEC parity and retransmission copy are
+ *   updated to match
+ */
+void markFrameEnd(struct Sink* sink) {
+  if (sink->mode != 1 || sink->frame_last < 0) {
+    return;
+  }
+
+  struct RTPHeader* rtp_header = &sink->rtp_headers[sink->frame_last];
+  struct RTPFrameMarking* marking = &sink->frame_markings[sink->frame_last];
+  uint32_t header_size = sizeof(struct RTPHeader) +
+    (layer_marking ? sizeof(struct RTPFrameMarking) : 0);
+
+  // Symbol bytes before and after differ by the marker and end bits only
+  uint8_t delta[2 + sizeof(struct RTPHeader) + sizeof(struct RTPFrameMarking)];
+  memset(delta, 0x00, sizeof(delta));
+  delta[2 + offsetof(struct RTPHeader, payload_type)] = ~rtp_header->payload_type & 0x80;
+  rtp_header->payload_type |= 0x80;
+  if (layer_marking) {
+    delta[2 + sizeof(struct RTPHeader) + offsetof(struct RTPFrameMarking, flags)] =
+      ~marking->flags & FRAME_MARKING_END;
+    marking->flags |= FRAME_MARKING_END;
+    sink->frame_started = false;
+  }
+
+  if (sink->nack_cache) {
+    uint16_t sequence = be16toh(rtp_header->sequence);
+    struct NackSlot* slot = &sink->nack_cache[sequence & (sink->nack_slots - 1)];
+    if (slot->sequence == sequence && slot->size >= header_size) {
+      memcpy(slot->data, rtp_header, sizeof(struct RTPHeader));
+      memcpy(slot->data + sizeof(struct RTPHeader), marking, header_size - sizeof(struct RTPHeader));
+    }
+  }
+
+  // Parity is linear in the data, add the change to open block or to
+  // parity already copied out for the batch
+  for (uint8_t i = 0; sink->fec_data_count && i < sink->fec_parity_count; i++) {
+    uint8_t* parity = sink->frame_last_block->parity[i];
+    if (sink->frame_last_parity >= 0) {
+      parity = sink->fec_parity_out + (sink->frame_last_parity + i) * sink->fec_parity_stride +
+        sizeof(struct FECHeader);
+    }
+    fec_encode(parity, delta, 2 + header_size,
+      fec_coefficient(i, sink->frame_last_index));
+  }
+
+  sink->frame_last = -1;
+}
+
+/**
+ * @brief End current frame of the sink without a frame-final datagram
+ */
+void endFrame(struct Sink* sink) {
+  sink->frame_open = false;
+  if (sink->aggregate_count) {
+    flushAggregate(sink, true);
+  } else {
+    markFrameEnd(sink);
+  }
+
+  // Blocks are closed at frame end as with a marked datagram
+  for (uint8_t i = 0; i < sink->fec_depth && sink->fec_data_count; i++) {
+    if (sink->fec_blocks[i].data_count) {
+      closeBlock(sink, &sink->fec_blocks[i]);
+    }
+  }
+}
+
+void flushAggregate(struct Sink* sink, bool marker) {
+  if (!sink->aggregate_count) {
+    return;
+  }
+
+  beginDatagram(sink);
+
+  if (sink->aggregate_count == 1) {
+    // Nothing to aggregate with, send as single NAL unit packet
+    appendPayload(sink, sink->aggregate_data[0], sink->aggregate_sizes[0]);
+  } else {
+    uint8_t header[2];
+    if (stream_codec == PT_H265) {
+      // AP payload header, TID is the lowest of aggregated units
+      uint8_t tid = 7;
+      for (uint32_t i = 0; i < sink->aggregate_count; i++) {
+        tid = MIN2(tid, sink->aggregate_data[i][1] & 0x07);
+      }
+
+      header[0] = 48 << 1;
+      header[1] = tid;
+      appendHeader(sink, header, 2);
+    } else {
+      // STAP-A header, F and NRI are the highest of aggregated units
+      uint8_t nal_bits = 0;
+      for (uint32_t i = 0; i < sink->aggregate_count; i++) {
+        nal_bits = MAX2(nal_bits, sink->aggregate_data[i][0] & 0x60);
+        nal_bits |= sink->aggregate_data[i][0] & 0x80;
+      }
+
+      header[0] = nal_bits | 24;
+      appendHeader(sink, header, 1);
+    }
+
+    for (uint32_t i = 0; i < sink->aggregate_count; i++) {
+      header[0] = sink->aggregate_sizes[i] >> 8;
+      header[1] = sink->aggregate_sizes[i] & 0xFF;
+      appendHeader(sink, header, 2);
+      appendPayload(sink, sink->aggregate_data[i], sink->aggregate_sizes[i]);
+    }
+
+    aggregated_packets++;
+  }
+
+  commitDatagram(sink, marker);
+
+  sink->aggregate_count = 0;
+  sink->aggregate_size = 0;
+}
+
+void countPack(uint8_t* pack_data, uint32_t pack_size, uint64_t pts, bool frame_end) {
+  uint8_t prefix = 4;
+  pack_data += prefix;
+  pack_size -= prefix;
+
+  frame_id++;
+  metrics_pack(&metrics_state, pack_data, pack_size, pts, frame_end);
+}
+
+void sendPacket(struct Sink* sink, uint8_t* pack_data, uint32_t pack_size,
+    bool frame_end) {
+  uint8_t prefix = 4;
+  pack_data += prefix;
+  pack_size -= prefix;
+
+  uint32_t max_size = sink->max_size;
+
+  // Collect small parameter sets into a single aggregation packet
+  if (sink->mode == 1 && isAggregatable(pack_data)) {
+    // Aggregation header (1 or 2 bytes) and 16-bit size per NAL
+    uint32_t header_size = sink->aggregate_count ? 0 : 2;
+    if (sink->aggregate_count == AGGREGATE_MAX_NALS ||
+        sink->aggregate_size + header_size + pack_size + 2 > max_size) {
+      flushAggregate(sink, false);
+      header_size = 2;
+    }
+
+    if (header_size + pack_size + 2 <= max_size) {
+      sink->aggregate_data[sink->aggregate_count] = pack_data;
+      sink->aggregate_sizes[sink->aggregate_count] = pack_size;
+      sink->aggregate_count++;
+      sink->aggregate_size += header_size + pack_size + 2;
+
+      if (frame_end) {
+        flushAggregate(sink, true);
+      }
+      return;
+    }
+  }
+
+  flushAggregate(sink, false);
+
+  // Datagram size without fragmentation (IPv4 + UDP + RTP headers)
+  uint32_t datagram_size = pack_size + 28 + getRtpHeaderSize(sink);
+  if (datagram_size > sink->mtu) {
+    nals_oversized++;
+  }
+
+  if (pack_size > max_size) {
+    // FU-A (H.264) or FU (H.265): NAL header is replaced by FU indicator and
+    // FU header, original NAL type is carried in FU header
+    uint8_t fu_header[3];
+    uint8_t fu_size;
+    uint8_t nal_header_size;
+    uint8_t nal_type;
+
+    if (stream_codec == PT_H265) {
+      nal_type = (pack_data[0] >> 1) & 0x3F;
+      fu_header[0] = (pack_data[0] & 0x81) | 49 << 1;
+      fu_header[1] = pack_data[1];
+      fu_size = 3;
+      nal_header_size = 2;
+    } else {
+      nal_type = pack_data[0] & 0x1F;
+      fu_header[0] = (pack_data[0] & 0xE0) | 28;
+      fu_size = 2;
+      nal_header_size = 1;
+    }
+
+    pack_data += nal_header_size;
+    pack_size -= nal_header_size;
+    nals_fragmented++;
+
+    bool start_bit = true;
+    while (pack_size) {
+      uint32_t chunk_size = MIN2(pack_size, max_size - fu_size);
+      bool end_bit = chunk_size == pack_size;
+
+      fu_header[fu_size - 1] = nal_type | (start_bit ? 0x80 : 0) | (end_bit ? 0x40 : 0);
+      start_bit = false;
+
+      beginDatagram(sink);
+      appendHeader(sink, fu_header, fu_size);
+      appendPayload(sink, pack_data, chunk_size);
+      commitDatagram(sink, frame_end && end_bit);
+
+      pack_data += chunk_size;
+      pack_size -= chunk_size;
+    }
+  } else {
+    beginDatagram(sink);
+    appendPayload(sink, pack_data, pack_size);
+    commitDatagram(sink, frame_end);
+  }
+}